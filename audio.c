@@ -0,0 +1,172 @@
+#define _POSIX_C_SOURCE 200809L
+
+#include "audio.h"
+#include "scheduler.h"
+#include <string.h>
+
+#define SAMPLE_RATE 48000
+#define BUFFER_SAMPLES 512
+#define TONE_FREQUENCY 440.0f
+#define VOLUME 0.2f
+#define FADE_SAMPLES 96 // Ramp when the tone starts or stops, 2 ms at 48 kHz
+
+#define NS_PER_SECOND 1000000000ULL
+
+// edges are placed this many buffers after their time, the callback runs
+// about a buffer ahead of what is being heard
+#define LEAD_BUFFERS 2
+// and never further ahead than this, the clocks may drift apart
+#define MAX_LEAD_BUFFERS 8
+
+// correction for the step of a square wave at phase t, spreading it over
+// the neighbouring samples so the tone does not alias (PolyBLEP)
+static float blep(float t, float dt)
+{
+    if (t < dt) {
+        t /= dt;
+        return t + t - t * t - 1.0f;
+    }
+
+    if (t > 1.0f - dt) {
+        t = (t - 1.0f) / dt;
+        return t * t + t + t + 1.0f;
+    }
+
+    return 0.0f;
+}
+
+// take the next edge off the queue and work out the sample it is played
+// at, false when there is none
+static bool next_edge(struct audio *audio)
+{
+    if (audio->pending) {
+        return true;
+    }
+
+    if (!tone_queue_pop(&audio->tones, &audio->next)) {
+        return false;
+    }
+
+    uint64_t elapsed = audio->next.time > audio->start ? audio->next.time - audio->start : 0;
+    // in two parts, elapsed * rate alone overflows after days of uptime
+    uint64_t samples = elapsed / NS_PER_SECOND * audio->rate + elapsed % NS_PER_SECOND * audio->rate / NS_PER_SECOND;
+    int64_t sample = (int64_t)samples + audio->offset;
+    int64_t lead = sample - (int64_t)audio->position;
+
+    // an edge arriving late or far too early moves the timeline rather than
+    // being played late or held back, the ones after it keep their spacing
+    if (lead < 0) {
+        audio->offset -= lead;
+        sample = audio->position;
+    } else if (lead > MAX_LEAD_BUFFERS * audio->buffer) {
+        audio->offset -= lead - LEAD_BUFFERS * audio->buffer;
+        sample = audio->position + LEAD_BUFFERS * audio->buffer;
+    }
+
+    audio->next_sample = sample;
+    audio->pending = true;
+    return true;
+}
+
+// audio thread: fill a buffer, switching the tone on and off on the
+// samples the edges fall on
+static void generate(void *userdata, Uint8 *stream, int length)
+{
+    struct audio *audio = userdata;
+    float *samples = (float *)stream;
+    int count = length / sizeof(float);
+    float dt = TONE_FREQUENCY / audio->rate;
+
+    for (int i = 0; i < count; i++) {
+        while (next_edge(audio) && audio->next_sample <= audio->position) {
+            audio->on = audio->next.on;
+            audio->pending = false;
+        }
+
+        // fade rather than switch, a step in level would click
+        if (audio->on) {
+            audio->level += 1.0f / FADE_SAMPLES;
+
+            if (audio->level > 1.0f) {
+                audio->level = 1.0f;
+            }
+        } else {
+            audio->level -= 1.0f / FADE_SAMPLES;
+
+            if (audio->level < 0.0f) {
+                audio->level = 0.0f;
+            }
+        }
+
+        if (audio->level == 0.0f) {
+            samples[i] = 0.0f;
+        } else {
+            float half = audio->phase + 0.5f;
+            float square = audio->phase < 0.5f ? 1.0f : -1.0f;
+
+            // the rising edge at 0 and the falling one half a period later
+            square += blep(audio->phase, dt);
+            square -= blep(half < 1.0f ? half : half - 1.0f, dt);
+            samples[i] = square * audio->level * VOLUME;
+        }
+
+        // the phase carries on through silence, so restarting never clicks
+        audio->phase += dt;
+
+        if (audio->phase >= 1.0f) {
+            audio->phase -= 1.0f;
+        }
+
+        audio->position += 1;
+    }
+}
+
+bool audio_init(struct audio *audio)
+{
+    SDL_AudioSpec want;
+    SDL_AudioSpec have;
+
+    memset(&want, 0, sizeof(want));
+    want.freq = SAMPLE_RATE;
+    want.format = AUDIO_F32SYS;
+    want.channels = 1;
+    want.samples = BUFFER_SAMPLES;
+    want.callback = generate;
+    want.userdata = audio;
+
+    tone_queue_init(&audio->tones);
+    audio->position = 0;
+    audio->pending = false;
+    audio->on = false;
+    audio->phase = 0.0f;
+    audio->level = 0.0f;
+
+    audio->device = SDL_OpenAudioDevice(NULL, 0, &want, &have, SDL_AUDIO_ALLOW_FREQUENCY_CHANGE | SDL_AUDIO_ALLOW_SAMPLES_CHANGE);
+
+    if (audio->device == 0) {
+        return false;
+    }
+
+    audio->rate = have.freq;
+    audio->buffer = have.samples;
+    audio->offset = LEAD_BUFFERS * audio->buffer;
+
+    // set before the callback first runs, it only reads it afterwards
+    audio->start = scheduler_now();
+    SDL_PauseAudioDevice(audio->device, 0);
+    return true;
+}
+
+void audio_destroy(struct audio *audio)
+{
+    SDL_CloseAudioDevice(audio->device);
+}
+
+// emulation thread: queue the tone starting or stopping at a time on the
+// scheduler's clock, never waiting for the audio thread
+void audio_tone(struct audio *audio, uint64_t time, bool on)
+{
+    // with a whole queue of edges unplayed the callback is not running,
+    // dropping one changes nothing that can be heard
+    tone_queue_push(&audio->tones, time, on);
+}
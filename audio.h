@@ -0,0 +1,34 @@
+#ifndef AUDIO_H
+#define AUDIO_H
+
+#include "handoff.h"
+#include <SDL2/SDL.h>
+#include <stdbool.h>
+#include <stdint.h>
+
+// Plays the tone while the sound timer runs. The emulation thread queues
+// the times it starts and stops, the SDL audio callback turns them into a
+// square wave; the tone queue is all they share.
+struct audio {
+    SDL_AudioDeviceID device;
+    struct tone_queue tones;
+    int rate; // Samples per second
+    int buffer; // Samples per callback
+    uint64_t start; // Scheduler time of sample zero (ns)
+
+    // Audio callback only
+    int64_t offset; // Samples from an edge's time to where it is played
+    uint64_t position; // Samples generated so far
+    struct tone_edge next; // Edge popped but not reached yet
+    uint64_t next_sample; // Where next is played
+    bool pending; // next holds an edge
+    bool on;
+    float phase; // Through the current period, 0 to 1
+    float level; // Fades towards 1 while on and 0 while off
+};
+
+bool audio_init(struct audio *audio);
+void audio_destroy(struct audio *audio);
+void audio_tone(struct audio *audio, uint64_t time, bool on);
+
+#endif
@@ -0,0 +1,684 @@
+#define _POSIX_C_SOURCE 200809L
+
+#include "chip8.h"
+#include "input.h"
+#include "rompack.h"
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#define USAGE "Usage: chip8-batch [-t threads] [-i instructions per frame] [-o results] [-p ROM pack] manifest"
+
+#define MAX_LINE 1024
+#define CACHE_LINE 64
+
+// A ROM file's memory image, shared read-only by every job that runs it
+struct rom {
+    char *path;
+    uint8_t image[CHIP8_MEMORY_SIZE];
+};
+
+// An input script shared read-only by every job that replays it
+struct script {
+    char *path;
+    struct input_script input;
+};
+
+// One manifest line: run a ROM with an input script for some frames
+struct job {
+    const char *rom; // Name the results report
+    const uint8_t *image; // Memory the machine starts with, see chip8_init_image
+    const struct script *script; // NULL when no keys are pressed
+    uint32_t frames;
+    uint8_t quirks; // enum chip8_quirks
+};
+
+// What a job leaves behind, written out in manifest order
+struct result {
+    uint64_t graphics_hash;
+    uint64_t cycles;
+    struct cpu cpu;
+};
+
+// Chase-Lev deque of job indexes. The owner pushes and takes at the bottom,
+// other workers steal from the top.
+struct deque {
+    _Alignas(CACHE_LINE) atomic_long top;
+    _Alignas(CACHE_LINE) atomic_long bottom;
+    atomic_uint *jobs;
+    long mask;
+};
+
+enum steal_status {
+    STEAL_EMPTY,
+    STEAL_ABORT, // Lost a race with another thief or the owner, retry
+    STEAL_SUCCESS
+};
+
+// Recycled machines so jobs do not pay for allocating and faulting in a
+// fresh struct chip8 each time
+struct pool {
+    struct chip8 **free;
+    size_t count;
+    size_t capacity;
+};
+
+struct worker {
+    _Alignas(CACHE_LINE) struct deque deque;
+    struct pool pool;
+    pthread_t thread;
+    uint32_t seed; // Victim selection
+    unsigned long jobs_run;
+    unsigned long jobs_stolen;
+    struct batch *batch;
+};
+
+struct batch {
+    struct job *jobs;
+    struct result *results;
+    size_t job_count;
+    struct rom **roms;
+    size_t rom_count;
+    struct rom_pack *pack; // Where ROMs are looked up first, NULL when not given
+    struct script **scripts;
+    size_t script_count;
+    struct worker *workers;
+    size_t worker_count;
+    uint16_t instructions_per_frame;
+};
+
+bool deque_init(struct deque *deque, size_t capacity);
+void deque_push(struct deque *deque, uint32_t job);
+bool deque_take(struct deque *deque, uint32_t *job);
+enum steal_status deque_steal(struct deque *deque, uint32_t *job);
+struct chip8 *pool_acquire(struct pool *pool);
+void pool_release(struct pool *pool, struct chip8 *chip8);
+void pool_destroy(struct pool *pool);
+bool read_manifest(struct batch *batch, const char *path);
+void run_job(struct batch *batch, struct pool *pool, uint32_t index);
+void *run_worker(void *arg);
+bool write_results(const struct batch *batch, const char *path);
+uint64_t hash_graphics(const struct chip8 *chip8);
+
+int main(int argc, char *argv[])
+{
+    long threads = sysconf(_SC_NPROCESSORS_ONLN);
+    long instructions_per_frame = CHIP8_DEFAULT_INSTRUCTIONS_PER_FRAME;
+    const char *output = "-";
+    const char *pack_path = NULL;
+    int opt;
+
+    while ((opt = getopt(argc, argv, "t:i:o:p:")) != -1) {
+        switch (opt) {
+        case 't':
+            threads = strtol(optarg, NULL, 10);
+            break;
+        case 'i':
+            instructions_per_frame = strtol(optarg, NULL, 10);
+            break;
+        case 'o':
+            output = optarg;
+            break;
+        case 'p':
+            pack_path = optarg;
+            break;
+        default:
+            puts(USAGE);
+            return 0;
+        }
+    }
+
+    if (optind >= argc || threads < 1 || instructions_per_frame < 1 || instructions_per_frame > UINT16_MAX) {
+        puts(USAGE);
+        return 0;
+    }
+
+    struct batch batch = {
+        .instructions_per_frame = instructions_per_frame
+    };
+
+    if (pack_path != NULL) {
+        batch.pack = rom_pack_open(pack_path);
+
+        if (batch.pack == NULL) {
+            fprintf(stderr, "Could not open ROM pack: %s\n", pack_path);
+            return -1;
+        }
+    }
+
+    if (!read_manifest(&batch, argv[optind])) {
+        return -1;
+    }
+
+    batch.results = calloc(batch.job_count, sizeof(*batch.results));
+    batch.worker_count = (size_t)threads < batch.job_count ? (size_t)threads : batch.job_count;
+    batch.workers = aligned_alloc(CACHE_LINE, batch.worker_count * sizeof(*batch.workers));
+
+    if (batch.results == NULL || batch.workers == NULL) {
+        fputs("Out of memory\n", stderr);
+        return -1;
+    }
+
+    // deal out contiguous runs of jobs so neighbouring manifest lines, which
+    // usually share a ROM, stay on one core until stealing rebalances them
+    for (size_t i = 0; i < batch.worker_count; i++) {
+        struct worker *worker = &batch.workers[i];
+        size_t first = batch.job_count * i / batch.worker_count;
+        size_t last = batch.job_count * (i + 1) / batch.worker_count;
+
+        memset(worker, 0, sizeof(*worker));
+        worker->batch = &batch;
+        worker->seed = i * 2654435761u + 1;
+
+        if (!deque_init(&worker->deque, last - first)) {
+            fputs("Out of memory\n", stderr);
+            return -1;
+        }
+
+        for (size_t job = first; job < last; job++) {
+            deque_push(&worker->deque, job);
+        }
+    }
+
+    for (size_t i = 0; i < batch.worker_count; i++) {
+        if (pthread_create(&batch.workers[i].thread, NULL, run_worker, &batch.workers[i]) != 0) {
+            fputs("Could not start worker thread\n", stderr);
+            return -1;
+        }
+    }
+
+    unsigned long stolen = 0;
+
+    for (size_t i = 0; i < batch.worker_count; i++) {
+        pthread_join(batch.workers[i].thread, NULL);
+        stolen += batch.workers[i].jobs_stolen;
+    }
+
+    if (!write_results(&batch, output)) {
+        fprintf(stderr, "Could not write results: %s\n", output);
+        return -1;
+    }
+
+    fprintf(stderr, "%zu jobs on %zu threads, %lu stolen\n", batch.job_count, batch.worker_count, stolen);
+    return 0;
+}
+
+// capacity is rounded up to a power of two so indexes wrap with a mask
+bool deque_init(struct deque *deque, size_t capacity)
+{
+    size_t size = 1;
+
+    while (size < capacity) {
+        size *= 2;
+    }
+
+    deque->jobs = calloc(size, sizeof(*deque->jobs));
+    deque->mask = size - 1;
+    atomic_init(&deque->top, 0);
+    atomic_init(&deque->bottom, 0);
+
+    return deque->jobs != NULL;
+}
+
+// owner only, the deque never holds more than its initial capacity
+void deque_push(struct deque *deque, uint32_t job)
+{
+    long bottom = atomic_load_explicit(&deque->bottom, memory_order_relaxed);
+
+    atomic_store_explicit(&deque->jobs[bottom & deque->mask], job, memory_order_relaxed);
+    atomic_thread_fence(memory_order_release);
+    atomic_store_explicit(&deque->bottom, bottom + 1, memory_order_relaxed);
+}
+
+// owner only, pops the most recently pushed job
+bool deque_take(struct deque *deque, uint32_t *job)
+{
+    long bottom = atomic_load_explicit(&deque->bottom, memory_order_relaxed) - 1;
+    atomic_store_explicit(&deque->bottom, bottom, memory_order_relaxed);
+    atomic_thread_fence(memory_order_seq_cst);
+    long top = atomic_load_explicit(&deque->top, memory_order_relaxed);
+
+    if (top > bottom) {
+        // already empty
+        atomic_store_explicit(&deque->bottom, bottom + 1, memory_order_relaxed);
+        return false;
+    }
+
+    *job = atomic_load_explicit(&deque->jobs[bottom & deque->mask], memory_order_relaxed);
+
+    if (top == bottom) {
+        // last job, race thieves for it
+        bool won = atomic_compare_exchange_strong_explicit(&deque->top, &top, top + 1,
+            memory_order_seq_cst, memory_order_relaxed);
+        atomic_store_explicit(&deque->bottom, bottom + 1, memory_order_relaxed);
+        return won;
+    }
+
+    return true;
+}
+
+// any thread, takes the oldest job
+enum steal_status deque_steal(struct deque *deque, uint32_t *job)
+{
+    long top = atomic_load_explicit(&deque->top, memory_order_acquire);
+    atomic_thread_fence(memory_order_seq_cst);
+    long bottom = atomic_load_explicit(&deque->bottom, memory_order_acquire);
+
+    if (top >= bottom) {
+        return STEAL_EMPTY;
+    }
+
+    *job = atomic_load_explicit(&deque->jobs[top & deque->mask], memory_order_relaxed);
+
+    if (!atomic_compare_exchange_strong_explicit(&deque->top, &top, top + 1,
+            memory_order_seq_cst, memory_order_relaxed)) {
+        return STEAL_ABORT;
+    }
+
+    return STEAL_SUCCESS;
+}
+
+struct chip8 *pool_acquire(struct pool *pool)
+{
+    if (pool->count > 0) {
+        pool->count -= 1;
+        return pool->free[pool->count];
+    }
+
+    // allocated by the worker that uses it, so first touch puts the pages
+    // on that worker's NUMA node
+    return aligned_alloc(CACHE_LINE, (sizeof(struct chip8) + CACHE_LINE - 1) / CACHE_LINE * CACHE_LINE);
+}
+
+void pool_release(struct pool *pool, struct chip8 *chip8)
+{
+    if (pool->count == pool->capacity) {
+        size_t capacity = pool->capacity ? pool->capacity * 2 : 4;
+        struct chip8 **free_list = realloc(pool->free, capacity * sizeof(*free_list));
+
+        if (free_list == NULL) {
+            free(chip8);
+            return;
+        }
+
+        pool->free = free_list;
+        pool->capacity = capacity;
+    }
+
+    pool->free[pool->count] = chip8;
+    pool->count += 1;
+}
+
+void pool_destroy(struct pool *pool)
+{
+    for (size_t i = 0; i < pool->count; i++) {
+        free(pool->free[i]);
+    }
+
+    free(pool->free);
+    pool->free = NULL;
+    pool->count = 0;
+    pool->capacity = 0;
+}
+
+static struct rom *find_rom(struct batch *batch, const char *path)
+{
+    for (size_t i = 0; i < batch->rom_count; i++) {
+        if (strcmp(batch->roms[i]->path, path) == 0) {
+            return batch->roms[i];
+        }
+    }
+
+    FILE *file = fopen(path, "rb");
+
+    if (file == NULL) {
+        return NULL;
+    }
+
+    struct rom *rom = malloc(sizeof(*rom));
+    struct chip8 *loader = malloc(sizeof(*loader));
+
+    if (rom == NULL || loader == NULL) {
+        free(rom);
+        free(loader);
+        fclose(file);
+        return NULL;
+    }
+
+    uint8_t program[MAX_PROGRAM_SIZE];
+    size_t size = fread(program, 1, sizeof(program), file);
+
+    rom->path = strdup(path);
+
+    // anything left over means the ROM does not fit in memory
+    bool failed = ferror(file) || fgetc(file) != EOF;
+    fclose(file);
+
+    // loaded once the usual way, jobs then start from a copy of the result
+    chip8_init(loader);
+    chip8_load(loader, program, size);
+    memcpy(rom->image, loader->memory, sizeof(rom->image));
+    free(loader);
+
+    struct rom **roms = failed ? NULL : realloc(batch->roms, (batch->rom_count + 1) * sizeof(*roms));
+
+    if (roms == NULL || rom->path == NULL) {
+        free(rom->path);
+        free(rom);
+        return NULL;
+    }
+
+    batch->roms = roms;
+    batch->roms[batch->rom_count] = rom;
+    batch->rom_count += 1;
+    return rom;
+}
+
+// a ROM in the pack by name, or by content hash written as @<hex>, else a
+// ROM file
+static bool find_image(struct batch *batch, const char *name, struct job *job)
+{
+    struct rom_pack_rom packed;
+
+    if (batch->pack != NULL && rom_pack_find(batch->pack, name, &packed)) {
+        job->rom = packed.name;
+        job->image = packed.image;
+        return true;
+    }
+
+    if (batch->pack != NULL && name[0] == '@') {
+        char *end;
+        uint64_t hash = strtoull(name + 1, &end, 16);
+
+        if (*end == '\0' && rom_pack_find_hash(batch->pack, hash, &packed)) {
+            job->rom = packed.name;
+            job->image = packed.image;
+            return true;
+        }
+    }
+
+    const struct rom *rom = find_rom(batch, name);
+
+    if (rom == NULL) {
+        return false;
+    }
+
+    job->rom = rom->path;
+    job->image = rom->image;
+    return true;
+}
+
+static struct script *find_script(struct batch *batch, const char *path)
+{
+    for (size_t i = 0; i < batch->script_count; i++) {
+        if (strcmp(batch->scripts[i]->path, path) == 0) {
+            return batch->scripts[i];
+        }
+    }
+
+    struct script *script = malloc(sizeof(*script));
+
+    if (script == NULL || !input_script_load(&script->input, path)) {
+        free(script);
+        return NULL;
+    }
+
+    script->path = strdup(path);
+
+    struct script **scripts = realloc(batch->scripts, (batch->script_count + 1) * sizeof(*scripts));
+
+    if (scripts == NULL || script->path == NULL) {
+        input_script_free(&script->input);
+        free(script->path);
+        free(script);
+        return NULL;
+    }
+
+    batch->scripts = scripts;
+    batch->scripts[batch->script_count] = script;
+    batch->script_count += 1;
+    return script;
+}
+
+// each line is "<rom> <input script or -> <frames>", '#' starts a comment
+// line. ROMs and scripts are read once however many jobs use them, and
+// ROMs in the pack are not read at all.
+bool read_manifest(struct batch *batch, const char *path)
+{
+    FILE *file = fopen(path, "r");
+
+    if (file == NULL) {
+        fprintf(stderr, "Could not open manifest: %s\n", path);
+        return false;
+    }
+
+    char line[MAX_LINE];
+    size_t capacity = 0;
+    unsigned long number = 0;
+    bool failed = false;
+
+    while (!failed && fgets(line, sizeof(line), file) != NULL) {
+        char rom_path[MAX_LINE];
+        char script_path[MAX_LINE];
+        char quirks_name[MAX_LINE];
+        unsigned long frames;
+        enum chip8_quirks quirks = CHIP8_QUIRKS_MODERN;
+
+        number += 1;
+
+        const char *start = line + strspn(line, " \t");
+
+        if (*start == '#' || *start == '\n' || *start == '\0') {
+            continue;
+        }
+
+        int fields = sscanf(start, "%s %s %lu %s", rom_path, script_path, &frames, quirks_name);
+
+        if (fields < 3 || frames > UINT32_MAX) {
+            fprintf(stderr, "%s:%lu: expected <rom> <input script or -> <frames> [quirks]\n", path, number);
+            failed = true;
+            break;
+        }
+
+        if (fields == 4 && !chip8_find_quirks(quirks_name, &quirks)) {
+            fprintf(stderr, "%s:%lu: unknown quirks: %s\n", path, number, quirks_name);
+            failed = true;
+            break;
+        }
+
+        if (batch->job_count == capacity) {
+            capacity = capacity ? capacity * 2 : 256;
+            struct job *jobs = realloc(batch->jobs, capacity * sizeof(*jobs));
+
+            if (jobs == NULL) {
+                fputs("Out of memory\n", stderr);
+                failed = true;
+                break;
+            }
+
+            batch->jobs = jobs;
+        }
+
+        struct job *job = &batch->jobs[batch->job_count];
+
+        job->frames = frames;
+        job->script = NULL;
+        job->quirks = quirks;
+
+        if (!find_image(batch, rom_path, job)) {
+            fprintf(stderr, "%s:%lu: could not load ROM: %s\n", path, number, rom_path);
+            failed = true;
+        } else if (strcmp(script_path, "-") != 0) {
+            job->script = find_script(batch, script_path);
+
+            if (job->script == NULL) {
+                fprintf(stderr, "%s:%lu: could not load input script: %s\n", path, number, script_path);
+                failed = true;
+            }
+        }
+
+        batch->job_count += 1;
+    }
+
+    fclose(file);
+
+    if (!failed && batch->job_count == 0) {
+        fprintf(stderr, "No jobs in manifest: %s\n", path);
+        failed = true;
+    }
+
+    return !failed;
+}
+
+void run_job(struct batch *batch, struct pool *pool, uint32_t index)
+{
+    const struct job *job = &batch->jobs[index];
+    struct result *result = &batch->results[index];
+    struct chip8 *chip8 = pool_acquire(pool);
+
+    if (chip8 == NULL) {
+        fputs("Out of memory\n", stderr);
+        exit(-1);
+    }
+
+    chip8_init_image(chip8, job->image);
+    chip8_set_quirks(chip8, job->quirks);
+    chip8->instructions_per_frame = batch->instructions_per_frame;
+
+    // a recorded session reproduces only with the numbers it saw
+    if (job->script != NULL) {
+        chip8_seed(chip8, job->script->input.seed);
+    }
+
+    size_t next_event = 0;
+
+    for (uint32_t frame = 0; frame < job->frames; frame++) {
+        if (job->script != NULL) {
+            next_event = input_script_apply(&job->script->input, next_event, frame, chip8);
+        }
+
+        chip8_emulate_frame(chip8);
+    }
+
+    result->graphics_hash = hash_graphics(chip8);
+    result->cycles = (uint64_t)job->frames * chip8->instructions_per_frame;
+    result->cpu = chip8->cpu;
+
+    chip8_release(chip8);
+    pool_release(pool, chip8);
+}
+
+// drain our own deque, then steal from the others until every deque is
+// empty. Jobs never create jobs, so once all are empty the batch is done.
+void *run_worker(void *arg)
+{
+    struct worker *worker = arg;
+    struct batch *batch = worker->batch;
+    uint32_t job;
+
+    for (;;) {
+        while (deque_take(&worker->deque, &job)) {
+            run_job(batch, &worker->pool, job);
+            worker->jobs_run += 1;
+        }
+
+        bool contended = false;
+        bool stolen = false;
+
+        // start at a random victim so thieves spread out
+        worker->seed ^= worker->seed << 13;
+        worker->seed ^= worker->seed >> 17;
+        worker->seed ^= worker->seed << 5;
+
+        size_t first = worker->seed % batch->worker_count;
+
+        for (size_t i = 0; i < batch->worker_count && !stolen; i++) {
+            struct worker *victim = &batch->workers[(first + i) % batch->worker_count];
+
+            if (victim == worker) {
+                continue;
+            }
+
+            switch (deque_steal(&victim->deque, &job)) {
+            case STEAL_SUCCESS:
+                stolen = true;
+                break;
+            case STEAL_ABORT:
+                contended = true;
+                break;
+            case STEAL_EMPTY:
+                break;
+            }
+        }
+
+        if (stolen) {
+            run_job(batch, &worker->pool, job);
+            worker->jobs_run += 1;
+            worker->jobs_stolen += 1;
+        } else if (!contended) {
+            break;
+        }
+    }
+
+    pool_destroy(&worker->pool);
+    return NULL;
+}
+
+// one line per job in manifest order:
+// <job> <rom> <frames> <cycles> <graphics hash> <pc> <I> <sp> <V0-VF>
+bool write_results(const struct batch *batch, const char *path)
+{
+    FILE *file = strcmp(path, "-") == 0 ? stdout : fopen(path, "w");
+
+    if (file == NULL) {
+        return false;
+    }
+
+    for (size_t i = 0; i < batch->job_count; i++) {
+        const struct job *job = &batch->jobs[i];
+        const struct result *result = &batch->results[i];
+
+        fprintf(file, "%zu %s %lu %llu %016llx %03X %03X %X",
+            i,
+            job->rom,
+            (unsigned long)job->frames,
+            (unsigned long long)result->cycles,
+            (unsigned long long)result->graphics_hash,
+            result->cpu.pc,
+            result->cpu.I,
+            result->cpu.sp);
+
+        for (int v = 0; v < 16; v++) {
+            fprintf(file, " %02X", result->cpu.V[v]);
+        }
+
+        fputc('\n', file);
+    }
+
+    bool failed = ferror(file);
+
+    if (file != stdout) {
+        failed |= fclose(file) != 0;
+    }
+
+    return !failed;
+}
+
+// FNV-1a over the display rows
+uint64_t hash_graphics(const struct chip8 *chip8)
+{
+    uint64_t hash = 0xcbf29ce484222325ULL;
+
+    for (int y = 0; y < CHIP8_HEIGHT; y++) {
+        for (int shift = 56; shift >= 0; shift -= 8) {
+            hash ^= (chip8->graphics[y] >> shift) & 0xff;
+            hash *= 0x100000001b3ULL;
+        }
+    }
+
+    return hash;
+}
@@ -0,0 +1,669 @@
+#define _POSIX_C_SOURCE 200809L
+
+#include "chip8.h"
+#include "lockstep.h"
+#include "opcodes.h"
+#include "scheduler.h"
+#include <math.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#define USAGE "Usage: chip8-bench [-j] [-T] [-q quirks] [-r repetitions] [-w warm-up runs] [-i instructions per frame] [-o results]"
+
+#define DEFAULT_REPETITIONS 10
+#define DEFAULT_WARMUP 2
+#define DEFAULT_INSTRUCTIONS_PER_FRAME 1000 // A fast machine, so frames measure the CPU
+
+#define HANDLER_CALLS 1000000 // Per repetition of a handler benchmark
+#define DISPATCH_CYCLES 4000000 // Per repetition of a dispatch benchmark
+#define ROM_INSTRUCTIONS 4000000 // Per repetition of a ROM, rounded to whole frames
+#define LOCKSTEP_LANES 64 // Instances of the ROM in the lockstep benchmark
+#define JIT_TOLERANCE 1.05 // How much longer than the interpreter the JIT's best ROM run may take, for timing noise
+
+// operands for the handler benchmarks, chosen so every handler stays in
+// bounds when it runs over and over from the same state
+#define OPERAND_X 1
+#define OPERAND_Y 2
+#define OPERAND_N 5
+#define OPERAND_KK 0x5a
+#define OPERAND_NNN 0x300
+#define OPERAND_I 0x300
+
+// Summary of one benchmark's repetitions
+struct stats {
+    double mean;
+    double stddev;
+    double min;
+    double max;
+};
+
+// Synthetic ROM exercising one part of the core
+struct workload {
+    const char *name;
+    const uint8_t *program;
+    size_t size;
+};
+
+// arithmetic and logic on registers in a tight loop
+static const uint8_t alu_rom[] = {
+    0x70, 0x01, // 200: V0 += 1
+    0x81, 0x04, // 202: V1 += V0
+    0x82, 0x13, // 204: V2 ^= V1
+    0x83, 0x22, // 206: V3 &= V2
+    0x84, 0x31, // 208: V4 |= V3
+    0x85, 0x16, // 20A: V5 = V1 >> 1
+    0x86, 0x2e, // 20C: V6 = V2 << 1
+    0x87, 0x15, // 20E: V7 -= V1
+    0x88, 0x27, // 210: V8 = V2 - V8
+    0x39, 0x00, // 212: skip if V9 == 0
+    0x69, 0x01, // 214: V9 = 1, always skipped
+    0x12, 0x00, // 216: jump 200
+};
+
+// font sprites drawn across the whole screen, wrapping at the edges
+static const uint8_t draw_rom[] = {
+    0x60, 0x00, // 200: V0 = 0
+    0x61, 0x00, // 202: V1 = 0
+    0xf2, 0x29, // 204: I = sprite for V2
+    0xd0, 0x15, // 206: draw 5 rows at V0, V1
+    0x70, 0x05, // 208: V0 += 5
+    0x71, 0x03, // 20A: V1 += 3
+    0x72, 0x01, // 20C: V2 += 1
+    0x12, 0x04, // 20E: jump 204
+};
+
+// nested subroutine calls
+static const uint8_t call_rom[] = {
+    0x22, 0x06, // 200: call 206
+    0x70, 0x01, // 202: V0 += 1
+    0x12, 0x00, // 204: jump 200
+    0x22, 0x0c, // 206: call 20C
+    0x71, 0x01, // 208: V1 += 1
+    0x00, 0xee, // 20A: return
+    0x72, 0x01, // 20C: V2 += 1
+    0x00, 0xee, // 20E: return
+};
+
+// sequences common in games: a sprite set up and drawn, a counted loop
+// and a score split into digits
+static const uint8_t idioms_rom[] = {
+    0x60, 0x08, // 200: V0 = 8
+    0xa0, 0x0a, // 202: I = sprite for "2"
+    0xd0, 0x15, // 204: draw 5 rows at V0, V1
+    0x71, 0x01, // 206: V1 += 1
+    0x41, 0x1a, // 208: skip if V1 != 1A
+    0x12, 0x0e, // 20A: jump 20E
+    0x12, 0x00, // 20C: jump 200
+    0x61, 0x00, // 20E: V1 = 0
+    0xa3, 0x00, // 210: I = 300
+    0xf2, 0x33, // 212: store V2 as decimal digits at 300
+    0xf2, 0x65, // 214: load V0-V2 from 300
+    0x72, 0x07, // 216: V2 += 7
+    0x12, 0x00, // 218: jump 200
+};
+
+// rewrites the instruction it runs next on every pass, so decoded and
+// compiled code is thrown away all the time
+static const uint8_t self_modifying_rom[] = {
+    0x60, 0x73, // 200: V0 = 0x73
+    0x71, 0x01, // 202: V1 += 1
+    0xa2, 0x08, // 204: I = 208
+    0xf1, 0x55, // 206: store V0-V1 at 208, making it "V3 += V1"
+    0x73, 0x00, // 208: V3 += 0, rewritten above
+    0x12, 0x02, // 20A: jump 202
+};
+
+static const struct workload workloads[] = {
+    { "alu", alu_rom, sizeof(alu_rom) },
+    { "draw", draw_rom, sizeof(draw_rom) },
+    { "call", call_rom, sizeof(call_rom) },
+    { "idioms", idioms_rom, sizeof(idioms_rom) },
+    { "self_modifying", self_modifying_rom, sizeof(self_modifying_rom) },
+};
+
+static const char *handler_names[INSTRUCTION_KIND_COUNT] = {
+    [OP_CLEAR_SCREEN] = "clear_screen",
+    [OP_RETURN] = "return",
+    [OP_JUMP] = "jump",
+    [OP_CALL] = "call",
+    [OP_SKIP_EQUAL] = "skip_equal",
+    [OP_SKIP_NOT_EQUAL] = "skip_not_equal",
+    [OP_SKIP_REGISTERS_EQUAL] = "skip_registers_equal",
+    [OP_LOAD] = "load",
+    [OP_ADD] = "add",
+
+    [OP_LOAD_FROM_REGISTER] = "load_from_register",
+    [OP_OR] = "or",
+    [OP_AND] = "and",
+    [OP_XOR] = "xor",
+    [OP_ADD_REGISTERS] = "add_registers",
+    [OP_SUBTRACT_X_Y] = "subtract_x_y",
+    [OP_SHIFT_RIGHT] = "shift_right",
+    [OP_SUBTRACT_Y_X] = "subtract_y_x",
+    [OP_SHIFT_LEFT] = "shift_left",
+
+    [OP_SKIP_REGISTERS_NOT_EQUAL] = "skip_registers_not_equal",
+    [OP_LOAD_I] = "load_i",
+    [OP_JUMP_OFFSET] = "jump_offset",
+    [OP_RANDOM] = "random",
+    [OP_DRAW] = "draw",
+    [OP_SKIP_KEY_PRESSED] = "skip_key_pressed",
+    [OP_SKIP_KEY_NOT_PRESSED] = "skip_key_not_pressed",
+
+    [OP_LOAD_DELAY_TIMER] = "load_delay_timer",
+    [OP_WAIT_FOR_KEY] = "wait_for_key",
+    [OP_SET_DELAY_TIMER] = "set_delay_timer",
+    [OP_SET_SOUND_TIMER] = "set_sound_timer",
+    [OP_ADD_I] = "add_i",
+    [OP_LOAD_SPRITE] = "load_sprite",
+    [OP_BCD] = "bcd",
+    [OP_REGISTER_DUMP] = "register_dump",
+    [OP_REGISTER_LOAD] = "register_load"
+};
+
+// Settings shared by every benchmark
+struct bench {
+    bool jit;
+    bool specialized; // Run through the per-opcode handlers
+    enum chip8_quirks quirks;
+    const char *quirks_name;
+    int repetitions;
+    int warmup;
+    uint16_t instructions_per_frame;
+    double *samples; // One per repetition
+    FILE *out;
+    bool first; // No entry written yet in the current JSON array
+};
+
+static struct chip8 chip8;
+
+static void summarize(const double *samples, int count, struct stats *stats)
+{
+    double sum = 0;
+
+    stats->min = samples[0];
+    stats->max = samples[0];
+
+    for (int i = 0; i < count; i++) {
+        sum += samples[i];
+
+        if (stats->min > samples[i]) {
+            stats->min = samples[i];
+        }
+        if (stats->max < samples[i]) {
+            stats->max = samples[i];
+        }
+    }
+
+    stats->mean = sum / count;
+
+    double squares = 0;
+
+    for (int i = 0; i < count; i++) {
+        squares += (samples[i] - stats->mean) * (samples[i] - stats->mean);
+    }
+
+    stats->stddev = count > 1 ? sqrt(squares / (count - 1)) : 0;
+}
+
+static void print_stats(FILE *out, const char *name, const struct stats *stats)
+{
+    fprintf(out, "\"%s\": {\"mean\": %.4f, \"stddev\": %.4f, \"min\": %.4f, \"max\": %.4f}",
+        name, stats->mean, stats->stddev, stats->min, stats->max);
+}
+
+static void begin_entry(struct bench *bench)
+{
+    fputs(bench->first ? "\n    " : ",\n    ", bench->out);
+    bench->first = false;
+}
+
+// state every handler call starts from, resetting whatever the previous
+// call changed that would otherwise move it out of bounds
+static inline void reset_cpu(struct chip8 *chip8, uint8_t kind)
+{
+    chip8->cpu.pc = PROGRAM_START;
+    chip8->cpu.sp = kind == OP_RETURN;
+    chip8->cpu.I = OPERAND_I;
+    chip8->cpu.V[OPERAND_X] = 3;
+    chip8->cpu.V[OPERAND_Y] = 7;
+}
+
+// one handler called directly, without fetching or dispatching
+static void bench_handler(struct bench *bench, uint8_t kind)
+{
+    struct instruction ins = {
+        .kind = kind,
+        .x = OPERAND_X,
+        .y = OPERAND_Y,
+        .n = OPERAND_N,
+        .kk = OPERAND_KK,
+        .nnn = OPERAND_NNN
+    };
+    opcode_handler handler = opcode_handlers[kind];
+
+    chip8_init(&chip8);
+
+    for (int run = -bench->warmup; run < bench->repetitions; run++) {
+        uint64_t start = scheduler_now();
+
+        for (long i = 0; i < HANDLER_CALLS; i++) {
+            reset_cpu(&chip8, kind);
+            handler(&chip8, &ins);
+        }
+
+        uint64_t elapsed = scheduler_now() - start;
+
+        if (run >= 0) {
+            bench->samples[run] = (double)elapsed / HANDLER_CALLS;
+        }
+    }
+
+    struct stats ns;
+
+    summarize(bench->samples, bench->repetitions, &ns);
+
+    begin_entry(bench);
+    fprintf(bench->out, "{\"name\": \"op_%s\", \"calls\": %d, ", handler_names[kind], HANDLER_CALLS);
+    print_stats(bench->out, "ns_per_call", &ns);
+    fputs("}", bench->out);
+
+    printf("op_%-26s %8.2f ns/call (+/- %.2f)\n", handler_names[kind], ns.mean, ns.stddev);
+}
+
+// fetch and dispatch of a jump to itself, one chip8_emulate_cycle call per
+// instruction or one chip8_emulate_cycles call for all of them
+static void bench_dispatch(struct bench *bench, bool batched)
+{
+    const uint8_t program[] = { 0x12, 0x00 };
+    const char *name = batched ? "emulate_cycles" : "emulate_cycle";
+
+    chip8_init(&chip8);
+    chip8_load(&chip8, program, sizeof(program));
+
+    chip8_set_quirks(&chip8, bench->quirks);
+
+    if (bench->jit) {
+        chip8_enable_jit(&chip8);
+    }
+
+    if (bench->specialized) {
+        chip8_enable_specialized(&chip8);
+    }
+
+    for (int run = -bench->warmup; run < bench->repetitions; run++) {
+        uint64_t start = scheduler_now();
+
+        if (batched) {
+            chip8_emulate_cycles(&chip8, DISPATCH_CYCLES);
+        } else {
+            for (long i = 0; i < DISPATCH_CYCLES; i++) {
+                chip8_emulate_cycle(&chip8);
+            }
+        }
+
+        uint64_t elapsed = scheduler_now() - start;
+
+        if (run >= 0) {
+            bench->samples[run] = (double)elapsed / DISPATCH_CYCLES;
+        }
+    }
+
+    chip8_release(&chip8);
+
+    struct stats ns;
+
+    summarize(bench->samples, bench->repetitions, &ns);
+
+    begin_entry(bench);
+    fprintf(bench->out, "{\"name\": \"%s\", \"instructions\": %d, ", name, DISPATCH_CYCLES);
+    print_stats(bench->out, "ns_per_instruction", &ns);
+    fputs("}", bench->out);
+
+    printf("%-29s %8.2f ns/instruction (+/- %.2f)\n", name, ns.mean, ns.stddev);
+}
+
+// one run of a ROM from power on, frame by frame with timers, in ns
+static uint64_t run_workload(const struct bench *bench, const struct workload *workload, long frames, bool jit, bool specialized)
+{
+    chip8_init(&chip8);
+    chip8_load(&chip8, workload->program, workload->size);
+    chip8.instructions_per_frame = bench->instructions_per_frame;
+    chip8_set_quirks(&chip8, bench->quirks);
+
+    if (jit) {
+        chip8_enable_jit(&chip8);
+    }
+
+    if (specialized) {
+        chip8_enable_specialized(&chip8);
+    }
+
+    uint64_t start = scheduler_now();
+
+    for (long frame = 0; frame < frames; frame++) {
+        chip8_emulate_frame(&chip8);
+    }
+
+    uint64_t elapsed = scheduler_now() - start;
+
+    chip8_release(&chip8);
+    return elapsed;
+}
+
+// a whole ROM run, every run from power on so they all do the same work.
+// With the JIT the interpreter runs it too, in turns so that both see the
+// same load on the host; false when the JIT was slower.
+static bool bench_workload(struct bench *bench, const struct workload *workload)
+{
+    long frames = ROM_INSTRUCTIONS / bench->instructions_per_frame;
+
+    if (frames < 1) {
+        frames = 1;
+    }
+
+    double instructions = (double)frames * bench->instructions_per_frame;
+    double *fps = malloc(bench->repetitions * sizeof(*fps));
+    double *interpreted = malloc(bench->repetitions * sizeof(*interpreted));
+
+    if (fps == NULL || interpreted == NULL) {
+        free(fps);
+        free(interpreted);
+        return true;
+    }
+
+    for (int run = -bench->warmup; run < bench->repetitions; run++) {
+        uint64_t elapsed = run_workload(bench, workload, frames, bench->jit, bench->specialized);
+
+        if (run >= 0) {
+            bench->samples[run] = elapsed / instructions;
+            fps[run] = frames * 1e9 / elapsed;
+        }
+
+        if (bench->jit) {
+            elapsed = run_workload(bench, workload, frames, false, false);
+
+            if (run >= 0) {
+                interpreted[run] = elapsed / instructions;
+            }
+        }
+    }
+
+    struct stats ns;
+    struct stats frame_rate;
+    struct stats mips;
+    struct stats interpreted_ns;
+
+    summarize(bench->samples, bench->repetitions, &ns);
+    summarize(fps, bench->repetitions, &frame_rate);
+    summarize(interpreted, bench->repetitions, &interpreted_ns);
+
+    // MIPS is 1000 / (ns per instruction), taken per repetition
+    for (int i = 0; i < bench->repetitions; i++) {
+        bench->samples[i] = 1000 / bench->samples[i];
+    }
+
+    summarize(bench->samples, bench->repetitions, &mips);
+    free(fps);
+    free(interpreted);
+
+    // best runs are compared, they are the least disturbed by the host
+    bool faster = !bench->jit || ns.min <= interpreted_ns.min * JIT_TOLERANCE;
+
+    begin_entry(bench);
+    fprintf(bench->out, "{\"name\": \"%s\", \"frames\": %ld, \"instructions\": %.0f, ", workload->name, frames, instructions);
+    print_stats(bench->out, "mips", &mips);
+    fputs(", ", bench->out);
+    print_stats(bench->out, "ns_per_instruction", &ns);
+    fputs(", ", bench->out);
+    print_stats(bench->out, "frames_per_second", &frame_rate);
+
+    if (bench->jit) {
+        fputs(", ", bench->out);
+        print_stats(bench->out, "interpreter_ns_per_instruction", &interpreted_ns);
+    }
+
+    fputs("}", bench->out);
+
+    printf("rom %-25s %8.2f MIPS, %.2f ns/instruction, %.0f frames/s", workload->name, mips.mean, ns.mean, frame_rate.mean);
+
+    if (bench->jit) {
+        printf(", %.2fx the interpreter%s", interpreted_ns.min / ns.min, faster ? "" : ", SLOWER");
+    }
+
+    putchar('\n');
+    return faster;
+}
+
+// many instances of one ROM stepped together, against as many independent
+// machines interpreting it one after the other, frame by frame, in turns
+// like the JIT comparison. Timed per instruction of one instance.
+static void bench_lockstep(struct bench *bench, const struct workload *workload)
+{
+    long frames = ROM_INSTRUCTIONS / LOCKSTEP_LANES / bench->instructions_per_frame;
+
+    if (frames < 1) {
+        frames = 1;
+    }
+
+    double instructions = (double)frames * bench->instructions_per_frame * LOCKSTEP_LANES;
+    double *independent = malloc(bench->repetitions * sizeof(*independent));
+    struct chip8 *machines = malloc(LOCKSTEP_LANES * sizeof(*machines));
+
+    if (independent == NULL || machines == NULL) {
+        free(independent);
+        free(machines);
+        return;
+    }
+
+    for (int run = -bench->warmup; run < bench->repetitions; run++) {
+        struct lockstep *lockstep = lockstep_create(LOCKSTEP_LANES, workload->program, workload->size, bench->instructions_per_frame);
+
+        if (lockstep == NULL) {
+            fputs("Lockstep is not supported by this compiler, skipping it\n", stderr);
+            free(independent);
+            free(machines);
+            return;
+        }
+
+        uint64_t start = scheduler_now();
+
+        for (long frame = 0; frame < frames; frame++) {
+            lockstep_emulate_frame(lockstep);
+        }
+
+        uint64_t elapsed = scheduler_now() - start;
+
+        lockstep_destroy(lockstep);
+
+        for (int lane = 0; lane < LOCKSTEP_LANES; lane++) {
+            chip8_init(&machines[lane]);
+            chip8_load(&machines[lane], workload->program, workload->size);
+            machines[lane].instructions_per_frame = bench->instructions_per_frame;
+        }
+
+        start = scheduler_now();
+
+        for (long frame = 0; frame < frames; frame++) {
+            for (int lane = 0; lane < LOCKSTEP_LANES; lane++) {
+                chip8_emulate_frame(&machines[lane]);
+            }
+        }
+
+        uint64_t independent_elapsed = scheduler_now() - start;
+
+        for (int lane = 0; lane < LOCKSTEP_LANES; lane++) {
+            chip8_release(&machines[lane]);
+        }
+
+        if (run >= 0) {
+            bench->samples[run] = elapsed / instructions;
+            independent[run] = independent_elapsed / instructions;
+        }
+    }
+
+    struct stats ns;
+    struct stats independent_ns;
+
+    summarize(bench->samples, bench->repetitions, &ns);
+    summarize(independent, bench->repetitions, &independent_ns);
+    free(independent);
+    free(machines);
+
+    begin_entry(bench);
+    fprintf(bench->out, "{\"name\": \"%s\", \"lanes\": %d, \"frames\": %ld, \"instructions\": %.0f, ",
+        workload->name, LOCKSTEP_LANES, frames, instructions);
+    print_stats(bench->out, "ns_per_instruction", &ns);
+    fputs(", ", bench->out);
+    print_stats(bench->out, "independent_ns_per_instruction", &independent_ns);
+    fputs("}", bench->out);
+
+    printf("lockstep %-20s %8.2f ns/instruction, %.2f independently, %.2fx over %d lanes\n",
+        workload->name, ns.mean, independent_ns.mean, independent_ns.min / ns.min, LOCKSTEP_LANES);
+}
+
+int main(int argc, char *argv[])
+{
+    struct bench bench = {
+        .jit = false,
+        .specialized = false,
+        .quirks = CHIP8_QUIRKS_MODERN,
+        .quirks_name = "modern",
+        .repetitions = DEFAULT_REPETITIONS,
+        .warmup = DEFAULT_WARMUP,
+        .instructions_per_frame = DEFAULT_INSTRUCTIONS_PER_FRAME
+    };
+    const char *results = NULL;
+    long instructions_per_frame = DEFAULT_INSTRUCTIONS_PER_FRAME;
+    int opt;
+
+    while ((opt = getopt(argc, argv, "jTq:r:w:i:o:")) != -1) {
+        switch (opt) {
+        case 'j':
+            bench.jit = true;
+            break;
+        case 'T':
+            bench.specialized = true;
+            break;
+        case 'q':
+            if (!chip8_find_quirks(optarg, &bench.quirks)) {
+                puts(USAGE);
+                return 0;
+            }
+            bench.quirks_name = optarg;
+            break;
+        case 'r':
+            bench.repetitions = strtol(optarg, NULL, 10);
+            break;
+        case 'w':
+            bench.warmup = strtol(optarg, NULL, 10);
+            break;
+        case 'i':
+            instructions_per_frame = strtol(optarg, NULL, 10);
+            break;
+        case 'o':
+            results = optarg;
+            break;
+        default:
+            puts(USAGE);
+            return 0;
+        }
+    }
+
+    if (optind != argc || bench.repetitions < 1 || bench.warmup < 0 || instructions_per_frame < 1 || instructions_per_frame > UINT16_MAX) {
+        puts(USAGE);
+        return 0;
+    }
+
+    bench.instructions_per_frame = instructions_per_frame;
+
+    if ((bench.jit || bench.specialized) && bench.quirks != CHIP8_QUIRKS_MODERN) {
+        fputs("The JIT and specialized handlers only run the modern quirks, interpreting instead\n", stderr);
+        bench.jit = false;
+        bench.specialized = false;
+    }
+
+    if (bench.jit) {
+        chip8_init(&chip8);
+
+        if (!chip8_enable_jit(&chip8)) {
+            fputs("JIT is not supported on this platform, interpreting instead\n", stderr);
+            bench.jit = false;
+        }
+
+        chip8_disable_jit(&chip8);
+    }
+
+    if (bench.specialized && !chip8_enable_specialized(&chip8)) {
+        fputs("Specialized handlers are not compiled in, build with make SPECIALIZED=1\n", stderr);
+        bench.specialized = false;
+    }
+
+    // the human readable summary goes to stdout, so JSON without -o goes to
+    // stderr rather than being mixed in with it
+    bench.out = results != NULL ? fopen(results, "w") : stderr;
+    bench.samples = malloc(bench.repetitions * sizeof(*bench.samples));
+
+    if (bench.out == NULL || bench.samples == NULL) {
+        fprintf(stderr, "Could not write results: %s\n", results);
+        return -1;
+    }
+
+    fprintf(bench.out, "{\n  \"jit\": %s,\n  \"specialized\": %s,\n  \"quirks\": \"%s\",\n  \"repetitions\": %d,\n  \"warmup\": %d,\n  \"instructions_per_frame\": %u,\n",
+        bench.jit ? "true" : "false", bench.specialized ? "true" : "false", bench.quirks_name, bench.repetitions, bench.warmup, bench.instructions_per_frame);
+
+    // handlers always run interpreted, the JIT only changes the rest
+    fputs("  \"handlers\": [", bench.out);
+    bench.first = true;
+
+    for (int kind = OP_CLEAR_SCREEN; kind < INSTRUCTION_KIND_COUNT; kind++) {
+        bench_handler(&bench, kind);
+    }
+
+    fputs("\n  ],\n  \"dispatch\": [", bench.out);
+    bench.first = true;
+    bench_dispatch(&bench, false);
+    bench_dispatch(&bench, true);
+
+    fputs("\n  ],\n  \"roms\": [", bench.out);
+    bench.first = true;
+
+    bool slower = false;
+
+    for (size_t i = 0; i < sizeof(workloads) / sizeof(workloads[0]); i++) {
+        slower |= !bench_workload(&bench, &workloads[i]);
+    }
+
+    // lanes run the modern handlers on the vector core, whatever the options
+    fputs("\n  ],\n  \"lockstep\": [", bench.out);
+    bench.first = true;
+
+    if (bench.quirks == CHIP8_QUIRKS_MODERN) {
+        bench_lockstep(&bench, &workloads[0]);
+    }
+
+    fputs("\n  ]\n}\n", bench.out);
+
+    bool failed = ferror(bench.out);
+
+    if (results != NULL) {
+        failed |= fclose(bench.out) != 0;
+    }
+
+    free(bench.samples);
+
+    if (failed) {
+        fprintf(stderr, "Could not write results: %s\n", results);
+        return -1;
+    }
+
+    if (slower) {
+        fputs("The JIT ran a ROM slower than the interpreter\n", stderr);
+        return -1;
+    }
+
+    return 0;
+}
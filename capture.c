@@ -0,0 +1,653 @@
+#define _POSIX_C_SOURCE 200809L
+
+#include "capture.h"
+#include <pthread.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+// Frames are encoded on the emulation thread, straight into chunks of
+// memory. Full chunks go to a writer thread which does all the file I/O;
+// the two only share the chunk lists, and the lock around them is never
+// held while writing, so a slow disk delays the file, not the emulation.
+// Written chunks are reused, a new one is allocated only while the writer
+// is behind.
+//
+// Y4M frames are the display in shades of grey at the machine's largest
+// resolution, lores pictures doubled. The native format starts with the
+// magic, a version byte, the width and height of that picture and a
+// reserved byte. Then comes a record per frame, or per run of frames:
+//
+// 'K' a keyframe: width, height and the number of planes stored (1 or 2),
+//     then the rows of each plane, width / 8 bytes, bit 7 of the first
+//     byte is x = 0. One starts the file and follows every resolution
+//     change and CAPTURE_KEYFRAME_INTERVAL frames.
+// 'D' the rows changed since the previous frame: their count, then for
+//     each plane << 7 | y and the row XOR the previous one, as runs. A run
+//     byte c below 128 is followed by c + 1 literal bytes, one from 128
+//     stands for c - 127 zero bytes.
+// 'R' the previous frame again, as many more times as the LEB128 number
+//     that follows.
+#define CAPTURE_MAGIC "C8CV"
+#define CAPTURE_VERSION 1
+#define CAPTURE_HEADER_SIZE 8
+
+#define RECORD_KEYFRAME 'K'
+#define RECORD_DELTA 'D'
+#define RECORD_REPEAT 'R'
+
+#define ROW_BYTES (CHIP8_HIRES_WIDTH / 8)
+#define MAX_RECORD_SIZE (4 + CHIP8_PLANE_COUNT * CHIP8_HIRES_HEIGHT * (1 + ROW_BYTES * 2)) // Runs of single bytes at worst
+#define MAX_Y4M_FRAME_SIZE (6 + CHIP8_HIRES_WIDTH * CHIP8_HIRES_HEIGHT * 3 / 2)
+#define CHUNK_SIZE (256 * 1024)
+
+// Y4M luma for the planes lit, the renderer's palette in video range
+static const uint8_t shades[1 << CHIP8_PLANE_COUNT] = { 16, 235, 126, 181 };
+
+struct chunk {
+    struct chunk *next;
+    size_t used;
+    uint8_t data[CHUNK_SIZE];
+};
+
+struct capture {
+    FILE *file; // Writer thread only, once it runs
+    enum capture_format format;
+    int width; // Of the Y4M picture
+    int height;
+    pthread_t writer;
+    pthread_mutex_t lock;
+    pthread_cond_t queued; // Signalled when a chunk is queued and on close
+    struct chunk *full; // Chunks waiting to be written, oldest first
+    struct chunk *last_full;
+    struct chunk *spare; // Written chunks to fill again
+    bool closing;
+    bool failed; // A write failed, the file is incomplete
+
+    // Emulation thread only
+    struct chunk *current; // Being filled
+    bool lost; // A chunk could not be allocated, nothing more is captured
+    struct chip8_display previous; // Last frame encoded
+    bool started;
+    unsigned long since_keyframe; // Frames
+    unsigned long repeats; // Frames the same as previous, not written yet
+};
+
+// writer thread: write chunks as they are queued until closed and drained
+static void *write_chunks(void *arg)
+{
+    struct capture *capture = arg;
+
+    pthread_mutex_lock(&capture->lock);
+
+    for (;;) {
+        while (capture->full == NULL && !capture->closing) {
+            pthread_cond_wait(&capture->queued, &capture->lock);
+        }
+
+        struct chunk *chunk = capture->full;
+
+        if (chunk == NULL) {
+            break;
+        }
+
+        capture->full = chunk->next;
+        bool failed = capture->failed;
+        pthread_mutex_unlock(&capture->lock);
+
+        // after a failed write the rest is only recycled, a hole in the
+        // middle would make the file unreadable rather than short
+        if (!failed && fwrite(chunk->data, 1, chunk->used, capture->file) != chunk->used) {
+            failed = true;
+        }
+
+        pthread_mutex_lock(&capture->lock);
+        capture->failed = failed;
+        chunk->used = 0;
+        chunk->next = capture->spare;
+        capture->spare = chunk;
+    }
+
+    pthread_mutex_unlock(&capture->lock);
+    return NULL;
+}
+
+static void queue_chunk(struct capture *capture, struct chunk *chunk)
+{
+    chunk->next = NULL;
+
+    pthread_mutex_lock(&capture->lock);
+
+    if (capture->full == NULL) {
+        capture->full = chunk;
+    } else {
+        capture->last_full->next = chunk;
+    }
+
+    capture->last_full = chunk;
+    pthread_cond_signal(&capture->queued);
+    pthread_mutex_unlock(&capture->lock);
+}
+
+// room for size bytes at the end of the output, NULL once out of memory;
+// the caller adds what it used to current->used
+static uint8_t *reserve(struct capture *capture, size_t size)
+{
+    if (capture->lost) {
+        return NULL;
+    }
+
+    if (capture->current != NULL && capture->current->used + size <= CHUNK_SIZE) {
+        return capture->current->data + capture->current->used;
+    }
+
+    if (capture->current != NULL) {
+        queue_chunk(capture, capture->current);
+    }
+
+    pthread_mutex_lock(&capture->lock);
+    struct chunk *chunk = capture->spare;
+
+    if (chunk != NULL) {
+        capture->spare = chunk->next;
+    }
+
+    pthread_mutex_unlock(&capture->lock);
+
+    if (chunk == NULL) {
+        chunk = malloc(sizeof(*chunk));
+
+        if (chunk == NULL) {
+            capture->current = NULL;
+            capture->lost = true;
+            return NULL;
+        }
+
+        chunk->used = 0;
+    }
+
+    capture->current = chunk;
+    return chunk->data;
+}
+
+static void free_chunks(struct chunk *chunk)
+{
+    while (chunk != NULL) {
+        struct chunk *next = chunk->next;
+
+        free(chunk);
+        chunk = next;
+    }
+}
+
+// the display as a width x height Y4M frame, scaled up when smaller;
+// returns the bytes written
+static size_t put_y4m_frame(uint8_t *out, const struct chip8_display *display, int width, int height)
+{
+    int scale_x = width / display->width;
+    int scale_y = height / display->height;
+    uint8_t *start = out;
+
+    memcpy(out, "FRAME\n", 6);
+    out += 6;
+
+    for (int y = 0; y < height; y++) {
+        int row = y / scale_y;
+
+        for (int x = 0; x < width; x++) {
+            int column = x / scale_x;
+            int shift = 63 - column % 64;
+            uint8_t lit = 0;
+
+            for (int plane = 0; plane < CHIP8_PLANE_COUNT; plane++) {
+                lit |= ((display->planes[plane][row][column / 64] >> shift) & 1) << plane;
+            }
+
+            *out++ = shades[lit];
+        }
+    }
+
+    // no colour
+    size_t chroma = (size_t)(width / 2) * (height / 2) * 2;
+
+    memset(out, 128, chroma);
+    return out + chroma - start;
+}
+
+static int put_y4m_header(FILE *file, int width, int height)
+{
+    return fprintf(file, "YUV4MPEG2 W%d H%d F%d:1 Ip A1:1 C420jpeg\n", width, height, CHIP8_FRAME_RATE);
+}
+
+static void get_row(const uint64_t *words, uint8_t *bytes, int count)
+{
+    for (int i = 0; i < count; i++) {
+        bytes[i] = words[i / 8] >> (56 - i % 8 * 8);
+    }
+}
+
+static void set_row(uint64_t *words, const uint8_t *bytes, int count)
+{
+    memset(words, 0, CHIP8_ROW_WORDS * sizeof(*words));
+
+    for (int i = 0; i < count; i++) {
+        words[i / 8] |= (uint64_t)bytes[i] << (56 - i % 8 * 8);
+    }
+}
+
+// count bytes as runs of zeros and runs of literals
+static uint8_t *put_runs(uint8_t *out, const uint8_t *bytes, int count)
+{
+    int i = 0;
+
+    while (i < count) {
+        int end = i;
+
+        while (end < count && bytes[end] == 0) {
+            end++;
+        }
+
+        if (end > i) {
+            *out++ = 127 + (end - i);
+            i = end;
+            continue;
+        }
+
+        while (end < count && bytes[end] != 0) {
+            end++;
+        }
+
+        *out++ = end - i - 1;
+        memcpy(out, bytes + i, end - i);
+        out += end - i;
+        i = end;
+    }
+
+    return out;
+}
+
+static void flush_repeats(struct capture *capture)
+{
+    if (capture->repeats == 0) {
+        return;
+    }
+
+    uint8_t *out = reserve(capture, 1 + 10);
+
+    if (out == NULL) {
+        return;
+    }
+
+    uint8_t *start = out;
+    unsigned long repeats = capture->repeats;
+
+    *out++ = RECORD_REPEAT;
+
+    do {
+        *out = repeats & 0x7F;
+        repeats >>= 7;
+
+        if (repeats != 0) {
+            *out |= 0x80;
+        }
+        out++;
+    } while (repeats != 0);
+
+    capture->current->used += out - start;
+    capture->repeats = 0;
+}
+
+static void encode_native(struct capture *capture, const struct chip8_display *display)
+{
+    const struct chip8_display *previous = &capture->previous;
+    bool resized = display->width != previous->width || display->height != previous->height;
+    bool keyframe = !capture->started || resized || capture->since_keyframe >= CAPTURE_KEYFRAME_INTERVAL;
+
+    capture->since_keyframe++;
+
+    // rows past the resolution are always clear, so the whole planes compare
+    if (!keyframe && memcmp(display->planes, previous->planes, sizeof(display->planes)) == 0) {
+        capture->repeats++;
+        return;
+    }
+
+    flush_repeats(capture);
+
+    uint8_t *out = reserve(capture, MAX_RECORD_SIZE);
+
+    if (out == NULL) {
+        return;
+    }
+
+    uint8_t *start = out;
+    int row_bytes = display->width / 8;
+    int row_words = (display->width + 63) / 64;
+
+    if (keyframe) {
+        int planes = 1;
+
+        for (int y = 0; y < display->height && planes == 1; y++) {
+            for (int word = 0; word < row_words; word++) {
+                if (display->planes[1][y][word] != 0) {
+                    planes = 2;
+                }
+            }
+        }
+
+        *out++ = RECORD_KEYFRAME;
+        *out++ = display->width;
+        *out++ = display->height;
+        *out++ = planes;
+
+        for (int plane = 0; plane < planes; plane++) {
+            for (int y = 0; y < display->height; y++) {
+                get_row(display->planes[plane][y], out, row_bytes);
+                out += row_bytes;
+            }
+        }
+
+        capture->since_keyframe = 1;
+        capture->started = true;
+    } else {
+        uint8_t *count = out + 1;
+
+        *out++ = RECORD_DELTA;
+        *out++ = 0;
+
+        for (int plane = 0; plane < CHIP8_PLANE_COUNT; plane++) {
+            for (int y = 0; y < display->height; y++) {
+                uint64_t changed[CHIP8_ROW_WORDS];
+                uint8_t bytes[ROW_BYTES];
+                bool same = true;
+
+                for (int word = 0; word < row_words; word++) {
+                    changed[word] = display->planes[plane][y][word] ^ previous->planes[plane][y][word];
+                    same = same && changed[word] == 0;
+                }
+
+                if (same) {
+                    continue;
+                }
+
+                *out++ = plane << 7 | y;
+                get_row(changed, bytes, row_bytes);
+                out = put_runs(out, bytes, row_bytes);
+                *count += 1;
+            }
+        }
+    }
+
+    capture->current->used += out - start;
+    capture->previous = *display;
+}
+
+struct capture *capture_open(const char *path, enum capture_format format, const struct chip8 *chip8)
+{
+    struct capture *capture = calloc(1, sizeof(*capture));
+
+    if (capture == NULL) {
+        return NULL;
+    }
+
+    capture->format = format;
+    capture->width = chip8->profile == CHIP8_PROFILE_CHIP8 ? CHIP8_WIDTH : CHIP8_HIRES_WIDTH;
+    capture->height = chip8->profile == CHIP8_PROFILE_CHIP8 ? CHIP8_HEIGHT : CHIP8_HIRES_HEIGHT;
+    capture->file = fopen(path, "wb");
+
+    if (capture->file == NULL) {
+        free(capture);
+        return NULL;
+    }
+
+    // the headers are small enough to write before the thread starts
+    int written;
+
+    if (format == CAPTURE_Y4M) {
+        written = put_y4m_header(capture->file, capture->width, capture->height);
+    } else {
+        uint8_t header[CAPTURE_HEADER_SIZE] = { 0 };
+
+        memcpy(header, CAPTURE_MAGIC, 4);
+        header[4] = CAPTURE_VERSION;
+        header[5] = capture->width;
+        header[6] = capture->height;
+        written = fwrite(header, 1, sizeof(header), capture->file) == sizeof(header) ? 1 : -1;
+    }
+
+    pthread_mutex_init(&capture->lock, NULL);
+    pthread_cond_init(&capture->queued, NULL);
+
+    if (written < 0 || pthread_create(&capture->writer, NULL, write_chunks, capture) != 0) {
+        pthread_cond_destroy(&capture->queued);
+        pthread_mutex_destroy(&capture->lock);
+        fclose(capture->file);
+        free(capture);
+        return NULL;
+    }
+
+    return capture;
+}
+
+// emulation thread: add the picture at the end of a frame
+void capture_frame(struct capture *capture, const struct chip8 *chip8)
+{
+    struct chip8_display display;
+
+    chip8_get_display(chip8, &display);
+
+    if (capture->format == CAPTURE_NATIVE) {
+        encode_native(capture, &display);
+        return;
+    }
+
+    uint8_t *out = reserve(capture, MAX_Y4M_FRAME_SIZE);
+
+    if (out != NULL) {
+        capture->current->used += put_y4m_frame(out, &display, capture->width, capture->height);
+    }
+}
+
+// write out what is left and close the file, false if any of it was lost
+bool capture_close(struct capture *capture)
+{
+    flush_repeats(capture);
+
+    if (capture->current != NULL) {
+        queue_chunk(capture, capture->current);
+        capture->current = NULL;
+    }
+
+    pthread_mutex_lock(&capture->lock);
+    capture->closing = true;
+    pthread_cond_signal(&capture->queued);
+    pthread_mutex_unlock(&capture->lock);
+    pthread_join(capture->writer, NULL);
+
+    bool ok = !capture->failed && !capture->lost;
+
+    if (fclose(capture->file) != 0) {
+        ok = false;
+    }
+
+    free_chunks(capture->spare);
+    pthread_cond_destroy(&capture->queued);
+    pthread_mutex_destroy(&capture->lock);
+    free(capture);
+    return ok;
+}
+
+static bool read_bytes(FILE *in, uint8_t *bytes, size_t count)
+{
+    return fread(bytes, 1, count, in) == count;
+}
+
+// the rows of a keyframe into display, after its width and height
+static bool read_keyframe(FILE *in, struct chip8_display *display, int width, int height)
+{
+    uint8_t header[3];
+
+    if (!read_bytes(in, header, sizeof(header))) {
+        return false;
+    }
+
+    bool lores = header[0] == CHIP8_WIDTH && header[1] == CHIP8_HEIGHT;
+    bool hires = header[0] == CHIP8_HIRES_WIDTH && header[1] == CHIP8_HIRES_HEIGHT;
+
+    if ((!lores && !hires) || header[0] > width || header[1] > height || header[2] < 1 || header[2] > CHIP8_PLANE_COUNT) {
+        return false;
+    }
+
+    display->width = header[0];
+    display->height = header[1];
+    memset(display->planes, 0, sizeof(display->planes));
+
+    for (int plane = 0; plane < header[2]; plane++) {
+        for (int y = 0; y < display->height; y++) {
+            uint8_t bytes[ROW_BYTES];
+
+            if (!read_bytes(in, bytes, display->width / 8)) {
+                return false;
+            }
+
+            set_row(display->planes[plane][y], bytes, display->width / 8);
+        }
+    }
+
+    return true;
+}
+
+// apply a delta to display, after its record type
+static bool read_delta(FILE *in, struct chip8_display *display)
+{
+    int count = fgetc(in);
+    int row_bytes = display->width / 8;
+
+    if (count == EOF) {
+        return false;
+    }
+
+    for (int i = 0; i < count; i++) {
+        int index = fgetc(in);
+
+        if (index == EOF || (index & 0x7F) >= display->height) {
+            return false;
+        }
+
+        uint64_t *words = display->planes[index >> 7][index & 0x7F];
+        uint8_t bytes[ROW_BYTES];
+        int filled = 0;
+
+        get_row(words, bytes, row_bytes);
+
+        while (filled < row_bytes) {
+            int run = fgetc(in);
+
+            if (run == EOF) {
+                return false;
+            }
+
+            if (run >= 128) {
+                filled += run - 127;
+                continue;
+            }
+
+            uint8_t literals[ROW_BYTES];
+
+            if (filled + run + 1 > row_bytes || !read_bytes(in, literals, run + 1)) {
+                return false;
+            }
+
+            for (int j = 0; j <= run; j++) {
+                bytes[filled++] ^= literals[j];
+            }
+        }
+
+        if (filled != row_bytes) {
+            return false;
+        }
+
+        set_row(words, bytes, row_bytes);
+    }
+
+    return true;
+}
+
+static bool read_repeats(FILE *in, unsigned long *repeats)
+{
+    *repeats = 0;
+
+    for (int shift = 0; shift < 64; shift += 7) {
+        int byte = fgetc(in);
+
+        if (byte == EOF) {
+            return false;
+        }
+
+        *repeats |= (unsigned long)(byte & 0x7F) << shift;
+
+        if ((byte & 0x80) == 0) {
+            return true;
+        }
+    }
+
+    return false;
+}
+
+// turn a native capture into the Y4M stream it would have been recorded
+// as, false if it is not one or could not be written
+bool capture_to_y4m(FILE *in, FILE *out)
+{
+    uint8_t header[CAPTURE_HEADER_SIZE];
+
+    if (!read_bytes(in, header, sizeof(header)) || memcmp(header, CAPTURE_MAGIC, 4) != 0 || header[4] != CAPTURE_VERSION) {
+        return false;
+    }
+
+    int width = header[5];
+    int height = header[6];
+
+    if (!(width == CHIP8_WIDTH && height == CHIP8_HEIGHT) && !(width == CHIP8_HIRES_WIDTH && height == CHIP8_HIRES_HEIGHT)) {
+        return false;
+    }
+
+    if (put_y4m_header(out, width, height) < 0) {
+        return false;
+    }
+
+    static uint8_t frame[MAX_Y4M_FRAME_SIZE];
+    struct chip8_display display;
+    bool started = false;
+    int record;
+
+    while ((record = fgetc(in)) != EOF) {
+        unsigned long repeats = 1;
+
+        if (record == RECORD_KEYFRAME) {
+            if (!read_keyframe(in, &display, width, height)) {
+                return false;
+            }
+
+            started = true;
+        } else if (record == RECORD_DELTA && started) {
+            if (!read_delta(in, &display)) {
+                return false;
+            }
+        } else if (record == RECORD_REPEAT && started) {
+            if (!read_repeats(in, &repeats)) {
+                return false;
+            }
+        } else {
+            return false;
+        }
+
+        size_t size = put_y4m_frame(frame, &display, width, height);
+
+        for (unsigned long i = 0; i < repeats; i++) {
+            if (fwrite(frame, 1, size, out) != size) {
+                return false;
+            }
+        }
+    }
+
+    return !ferror(in) && fflush(out) == 0;
+}
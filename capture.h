@@ -0,0 +1,25 @@
+#ifndef CAPTURE_H
+#define CAPTURE_H
+
+#include "chip8.h"
+#include <stdbool.h>
+#include <stdio.h>
+
+#define CAPTURE_KEYFRAME_INTERVAL 600 // Frames between keyframes in the native format
+
+// What a capture is written as: an uncompressed YUV4MPEG2 stream for
+// video encoders, or keyframes and row deltas (see capture.c), which
+// capture_to_y4m turns into the same stream
+enum capture_format {
+    CAPTURE_Y4M,
+    CAPTURE_NATIVE
+};
+
+struct capture;
+
+struct capture *capture_open(const char *path, enum capture_format format, const struct chip8 *chip8);
+void capture_frame(struct capture *capture, const struct chip8 *chip8);
+bool capture_close(struct capture *capture);
+bool capture_to_y4m(FILE *in, FILE *out);
+
+#endif
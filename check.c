@@ -0,0 +1,650 @@
+#define _POSIX_C_SOURCE 200809L
+
+#include "chip8.h"
+#include "interpret.h"
+#include "lockstep.h"
+#include "opcodes.h"
+#include "rewind.h"
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+// Differential checks for the cores, see make check. Every core is run on
+// random programs next to a reference that decodes each instruction afresh
+// and runs it through the single-instruction handlers of the same quirk
+// set, one at a time, so it has no cache, no superinstructions and no
+// compiled code. Each program runs once per quirk set; the JIT and the
+// specialized core take part on the modern set only. The cores run whole
+// frames with chip8_emulate_frame, which fast-forwards through idle loops,
+// so programs are sprinkled with those loops and mostly run with no key
+// held. After every frame the CPU, timers, display and memory of each core
+// have to match the reference. Run n is generated from seed + n, so -s <seed + n> -n 1
+// repeats it.
+//
+// Each program also runs in lockstep on a number of lanes, every lane with
+// keys of its own, next to as many independent machines given the same
+// keys, and every lane has to match its machine after every frame.
+//
+// A few directed checks for cases random programs rarely reach run first.
+
+#define USAGE "Usage: chip8-check [-n runs] [-s seed] [-f frames]"
+
+#define ADDRESS_MASK (CHIP8_MEMORY_SIZE - 1)
+#define MAX_PROGRAM 128 // Bytes of random program, the rest of memory is left as chip8_init made it
+#define IDLE_ODDS 16 // One instruction in this many starts an idle loop
+#define KEY_ODDS 8 // One frame in this many has a key held, the rest none
+#define LOCKSTEP_LANES 20 // More than one block of lanes, and not a whole number of them
+
+enum core {
+    CORE_INTERPRETER, // decoded cache and superinstructions
+    CORE_JIT,
+    CORE_SPECIALIZED,
+    CORE_COUNT
+};
+
+static const char *core_names[CORE_COUNT] = {
+    [CORE_INTERPRETER] = "interpreter",
+    [CORE_JIT] = "jit",
+    [CORE_SPECIALIZED] = "specialized"
+};
+
+static const char *quirks_names[CHIP8_QUIRKS_COUNT] = {
+    [CHIP8_QUIRKS_MODERN] = "modern",
+    [CHIP8_QUIRKS_COSMAC_VIP] = "vip",
+    [CHIP8_QUIRKS_CHIP48] = "chip48",
+    [CHIP8_QUIRKS_SCHIP] = "schip"
+};
+
+static const struct interpreter *const references[CHIP8_QUIRKS_COUNT] = {
+    [CHIP8_QUIRKS_MODERN] = &interpreter_modern,
+    [CHIP8_QUIRKS_COSMAC_VIP] = &interpreter_cosmac_vip,
+    [CHIP8_QUIRKS_CHIP48] = &interpreter_chip48,
+    [CHIP8_QUIRKS_SCHIP] = &interpreter_schip
+};
+
+// the low bytes of the Fxkk instructions there are
+static const uint8_t fx_opcodes[] = { 0x07, 0x0A, 0x15, 0x18, 0x1E, 0x29, 0x33, 0x55, 0x65 };
+
+static uint64_t next_random(uint64_t *state)
+{
+    *state ^= *state >> 12;
+    *state ^= *state << 25;
+    *state ^= *state >> 27;
+    return *state * 0x2545F4914F6CDD1DULL;
+}
+
+// one instruction, decoded from memory every time
+static void reference_step(struct chip8 *chip8)
+{
+    uint16_t pc = chip8->cpu.pc & ADDRESS_MASK;
+    struct instruction ins;
+
+    opcode_decode(chip8->memory[pc] << 8 | chip8->memory[(pc + 1) & ADDRESS_MASK], &ins);
+    references[chip8->quirks]->handlers[ins.kind](chip8, &ins);
+}
+
+static void reference_frame(struct chip8 *chip8)
+{
+    for (unsigned int i = 0; i < chip8->instructions_per_frame && !chip8->halted; i++) {
+        reference_step(chip8);
+    }
+    chip8_update_timers(chip8);
+}
+
+static bool enable_core(struct chip8 *chip8, enum core core)
+{
+    switch (core) {
+    case CORE_JIT:
+        return chip8_enable_jit(chip8);
+    case CORE_SPECIALIZED:
+        return chip8_enable_specialized(chip8);
+    default:
+        return true;
+    }
+}
+
+// name the first part of the state that differs, NULL when none does
+static const char *compare(const struct chip8 *expected, const struct chip8 *actual)
+{
+    if (memcmp(expected->cpu.V, actual->cpu.V, sizeof(expected->cpu.V)) != 0) {
+        return "V";
+    }
+    if (expected->cpu.I != actual->cpu.I) {
+        return "I";
+    }
+    if ((expected->cpu.pc & ADDRESS_MASK) != (actual->cpu.pc & ADDRESS_MASK)) {
+        return "pc";
+    }
+    if (expected->cpu.sp != actual->cpu.sp || memcmp(expected->cpu.stack, actual->cpu.stack, sizeof(expected->cpu.stack)) != 0) {
+        return "stack";
+    }
+    if (expected->delay_timer != actual->delay_timer || expected->sound_timer != actual->sound_timer) {
+        return "timers";
+    }
+    if (memcmp(expected->graphics, actual->graphics, sizeof(expected->graphics)) != 0) {
+        return "graphics";
+    }
+    if (memcmp(expected->memory, actual->memory, sizeof(expected->memory)) != 0) {
+        return "memory";
+    }
+    if (expected->rng != actual->rng) {
+        return "rng";
+    }
+    return NULL;
+}
+
+static void print_cpu(const char *name, const struct chip8 *chip8)
+{
+    printf("  %-12s pc %03X I %04X sp %X V", name, chip8->cpu.pc, chip8->cpu.I, chip8->cpu.sp);
+    for (int i = 0; i < 16; i++) {
+        printf(" %02X", chip8->cpu.V[i]);
+    }
+    printf("\n");
+}
+
+// write one of the loops chip8_emulate_frame fast-forwards through at
+// offset i, cut off at the end of the program; returns the offset after it
+static size_t add_idle_loop(uint64_t *state, uint8_t *program, size_t i, size_t size)
+{
+    uint64_t choice = next_random(state);
+    uint16_t x = (choice >> 8) & 0xF;
+    uint16_t opcodes[5];
+    size_t count;
+
+    switch (choice % 3) {
+    case 0: // jump to itself
+        opcodes[0] = 0x1000 | (PROGRAM_START + i);
+        count = 1;
+        break;
+    case 1: // wait for a key
+        opcodes[0] = 0xF00A | x << 8;
+        count = 1;
+        break;
+    default: // set the delay timer, then poll it until it reaches kk (3xkk)
+             // or for as long as it is kk (4xkk)
+        opcodes[0] = 0x6000 | x << 8 | ((choice >> 16) & 0x3F);
+        opcodes[1] = 0xF015 | x << 8;
+        opcodes[2] = 0xF007 | x << 8;
+        opcodes[3] = ((choice >> 24) & 1 ? 0x4000 : 0x3000) | x << 8 | ((choice >> 32) & 3);
+        opcodes[4] = 0x1000 | (PROGRAM_START + i + 4);
+        count = 5;
+        break;
+    }
+
+    for (size_t j = 0; j < count && i + 2 * j < size; j++) {
+        program[i + 2 * j] = opcodes[j] >> 8;
+        program[i + 2 * j + 1] = opcodes[j] & 0xFF;
+    }
+
+    return i + 2 * count;
+}
+
+// a random program of whole instructions, returns its size
+static size_t generate_program(uint64_t *state, uint8_t *program)
+{
+    size_t size = 2 * (1 + next_random(state) % (MAX_PROGRAM / 2));
+
+    for (size_t i = 0; i < size; i += 2) {
+        uint16_t opcode = next_random(state) >> 48;
+
+        if (opcode % IDLE_ODDS == 0) {
+            i = add_idle_loop(state, program, i, size) - 2;
+            continue;
+        }
+
+        // keep most jumps and calls inside the program, so that it loops
+        // long enough for code to get hot
+        switch (opcode >> 12) {
+        case 0x0:
+            opcode = opcode & 1 ? 0x00E0 : 0x00EE;
+            break;
+        case 0x1:
+        case 0x2:
+        case 0xB:
+            if (opcode & 0x0800) {
+                opcode = (opcode & 0xF000) | (PROGRAM_START + (opcode % size & ~1));
+            }
+            break;
+        case 0xA:
+            // and point I at the program often enough to rewrite it, or
+            // at the end of memory from where stores wrap around to it
+            if (opcode & 0x0800) {
+                opcode = 0xA000 | (PROGRAM_START + opcode % size);
+            } else if (opcode & 0x0400) {
+                opcode = 0xA000 | (CHIP8_MEMORY_SIZE - 1 - (opcode & 0xFF));
+            }
+            break;
+        case 0xF:
+            opcode = (opcode & 0xFF00) | fx_opcodes[(opcode & 0xFF) % (sizeof(fx_opcodes) / sizeof(fx_opcodes[0]))];
+            break;
+        }
+
+        program[i] = opcode >> 8;
+        program[i + 1] = opcode & 0xFF;
+    }
+
+    return size;
+}
+
+static struct chip8 reference;
+static struct chip8 machines[CORE_COUNT];
+
+// run one random program on every core, false at the first difference
+static bool check_program(uint64_t seed, int frames, enum chip8_quirks quirks, bool enabled[CORE_COUNT])
+{
+    uint64_t state = seed != 0 ? seed : 1;
+    uint8_t program[MAX_PROGRAM];
+    size_t size = generate_program(&state, program);
+
+    chip8_init(&reference);
+    chip8_load(&reference, program, size);
+    chip8_seed(&reference, seed);
+    chip8_set_quirks(&reference, quirks);
+    reference.instructions_per_frame = 1 + next_random(&state) % 32;
+
+    for (int core = 0; core < CORE_COUNT; core++) {
+        if (!enabled[core]) {
+            continue;
+        }
+
+        machines[core] = reference;
+        enabled[core] = enable_core(&machines[core], core);
+    }
+
+    bool passed = true;
+
+    for (int frame = 0; frame < frames && passed; frame++) {
+        // the same key for every machine, mostly none so that Fx0A waits
+        uint64_t key = next_random(&state);
+
+        memset(reference.keypad, 0, sizeof(reference.keypad));
+
+        if (key % KEY_ODDS == 0) {
+            chip8_set_key(&reference, (key >> 8) & 0xF, true);
+        }
+
+        reference_frame(&reference);
+
+        for (int core = 0; core < CORE_COUNT; core++) {
+            if (!enabled[core]) {
+                continue;
+            }
+
+            struct chip8 *chip8 = &machines[core];
+
+            memcpy(chip8->keypad, reference.keypad, sizeof(chip8->keypad));
+            chip8_emulate_frame(chip8);
+
+            const char *difference = compare(&reference, chip8);
+
+            if (difference != NULL) {
+                printf("seed %llu, %s quirks: %s differs from the reference in %s after frame %d\n",
+                    (unsigned long long)seed, quirks_names[quirks], core_names[core], difference, frame);
+                print_cpu("reference", &reference);
+                print_cpu(core_names[core], chip8);
+                passed = false;
+            }
+        }
+    }
+
+    for (int core = 0; core < CORE_COUNT; core++) {
+        chip8_release(&machines[core]);
+    }
+
+    return passed;
+}
+
+static struct chip8 lanes[LOCKSTEP_LANES];
+
+// run one random program in lockstep and on independent machines, with a
+// different key held on each lane, false at the first difference
+static bool check_lockstep(uint64_t seed, int frames)
+{
+    uint64_t state = seed != 0 ? seed : 1;
+    uint8_t program[MAX_PROGRAM];
+    size_t size = generate_program(&state, program);
+    uint16_t instructions_per_frame = 1 + next_random(&state) % 32;
+    struct lockstep *lockstep = lockstep_create(LOCKSTEP_LANES, program, size, instructions_per_frame);
+
+    if (lockstep == NULL) {
+        return false;
+    }
+
+    for (int lane = 0; lane < LOCKSTEP_LANES; lane++) {
+        chip8_init(&lanes[lane]);
+        chip8_load(&lanes[lane], program, size);
+        lanes[lane].instructions_per_frame = instructions_per_frame;
+    }
+
+    bool passed = true;
+
+    for (int frame = 0; frame < frames && passed; frame++) {
+        for (int lane = 0; lane < LOCKSTEP_LANES; lane++) {
+            uint64_t key = next_random(&state);
+
+            for (uint8_t k = 0; k < 16; k++) {
+                bool pressed = key % KEY_ODDS == 0 && k == ((key >> 8) & 0xF);
+
+                chip8_set_key(&lanes[lane], k, pressed);
+                lockstep_set_key(lockstep, lane, k, pressed);
+            }
+
+            chip8_emulate_frame(&lanes[lane]);
+        }
+
+        lockstep_emulate_frame(lockstep);
+
+        for (int lane = 0; lane < LOCKSTEP_LANES && passed; lane++) {
+            const struct chip8 *actual = lockstep_lane(lockstep, lane);
+            const char *difference = compare(&lanes[lane], actual);
+
+            if (difference != NULL) {
+                printf("seed %llu: lockstep lane %d differs from its machine in %s after frame %d\n",
+                    (unsigned long long)seed, lane, difference, frame);
+                print_cpu("machine", &lanes[lane]);
+                print_cpu("lockstep", actual);
+                passed = false;
+            }
+        }
+    }
+
+    for (int lane = 0; lane < LOCKSTEP_LANES; lane++) {
+        chip8_release(&lanes[lane]);
+    }
+
+    lockstep_destroy(lockstep);
+    return passed;
+}
+
+// load a program given as opcodes, into a freshly initialised machine
+static void load_opcodes(struct chip8 *chip8, const uint16_t *opcodes, size_t count)
+{
+    uint8_t program[MAX_PROGRAM_SIZE];
+
+    for (size_t i = 0; i < count; i++) {
+        program[2 * i] = opcodes[i] >> 8;
+        program[2 * i + 1] = opcodes[i] & 0xFF;
+    }
+
+    chip8_init(chip8);
+    chip8_load(chip8, program, 2 * count);
+}
+
+// Fx55 with I past the end of memory wraps to 0, where it rewrites a
+// subroutine the JIT compiled; the next call must run the new code
+static bool check_jit_wrapping_store(void)
+{
+    static const uint16_t opcodes[] = {
+        0x6000, // 200: V0 = 0
+        0x2300, // 202: call 300
+        0x7001, // 204: V0 += 1
+        0x3040, // 206: skip when V0 == 64
+        0x1202, // 208: loop to 202
+        0xAF01, // 20A: I = F01
+        0x62FF, // 20C: V2 = FF
+        0xF21E, // 20E: I += FF
+        0xF21E, // 210: I += FF
+        0xF21E, // 212: I += FF
+        0x6281, // 214: V2 = 81
+        0xF21E, // 216: I += 81
+        0xF21E, // 218: I += 81, now 1300
+        0x606A, // 21A: V0 = 6A
+        0x6102, // 21C: V1 = 02
+        0xF155, // 21E: store V0-V1 at 1300, which is 300
+        0x2300, // 220: call 300, now VA = 2
+        0x1222  // 222: loop forever
+    };
+
+    struct chip8 chip8;
+
+    load_opcodes(&chip8, opcodes, sizeof(opcodes) / sizeof(opcodes[0]));
+    chip8.memory[0x300] = 0x6A; // 300: VA = 1
+    chip8.memory[0x301] = 0x01;
+    chip8.memory[0x302] = 0x00; // 302: return
+    chip8.memory[0x303] = 0xEE;
+    chip8_invalidate(&chip8, 0x300, 4);
+
+    if (!chip8_enable_jit(&chip8)) {
+        printf("  skipped, no JIT on this host\n");
+        return true;
+    }
+
+    chip8_emulate_cycles(&chip8, 1000);
+
+    bool passed = chip8.cpu.V[0xA] == 2;
+
+    if (!passed) {
+        print_cpu("jit", &chip8);
+    }
+
+    chip8_release(&chip8);
+    return passed;
+}
+
+// an instruction rewritten on every pass is compiled to read its kk as it
+// runs, and the block is left when the rewrite changes its kind
+static bool check_jit_rewritten_operands(void)
+{
+    static const uint16_t counter[] = {
+        0x6073, // 200: V0 = 73
+        0x7101, // 202: V1 += 1
+        0xA208, // 204: I = 208
+        0xF155, // 206: store V0-V1 at 208
+        0x7300, // 208: V3 += V1, rewritten above
+        0x1202  // 20A: jump 202
+    };
+    static const uint16_t alternating[] = {
+        0x6073, // 200: V0 = 73
+        0x6210, // 202: V2 = 10
+        0x7101, // 204: V1 += 1
+        0x8023, // 206: V0 ^= V2, 63 and 73 in turn
+        0xA20C, // 208: I = 20C
+        0xF155, // 20A: store V0-V1 at 20C
+        0x7300, // 20C: V3 = V1 and V3 += V1 in turn
+        0x1204  // 20E: jump 204
+    };
+    static const struct {
+        const uint16_t *opcodes;
+        size_t count;
+    } programs[] = {
+        { counter, sizeof(counter) / sizeof(counter[0]) },
+        { alternating, sizeof(alternating) / sizeof(alternating[0]) }
+    };
+    bool passed = true;
+
+    for (size_t i = 0; i < sizeof(programs) / sizeof(programs[0]); i++) {
+        struct chip8 interpreted;
+        struct chip8 compiled;
+
+        load_opcodes(&interpreted, programs[i].opcodes, programs[i].count);
+        load_opcodes(&compiled, programs[i].opcodes, programs[i].count);
+
+        if (!chip8_enable_jit(&compiled)) {
+            printf("  skipped, no JIT on this host\n");
+            return true;
+        }
+
+        chip8_emulate_cycles(&interpreted, 20000);
+        chip8_emulate_cycles(&compiled, 20000);
+
+        if (memcmp(&interpreted.cpu, &compiled.cpu, sizeof(interpreted.cpu)) != 0) {
+            printf("  program %zu:\n", i);
+            print_cpu("interpreter", &interpreted);
+            print_cpu("jit", &compiled);
+            passed = false;
+        }
+
+        chip8_release(&interpreted);
+        chip8_release(&compiled);
+    }
+
+    return passed;
+}
+
+// the second instruction of a program starts a sequence, and it is only
+// decoded once the first has run
+static bool check_fused_after_entry(void)
+{
+    static const uint16_t clear_first[] = { 0x00E0, 0x6005, 0xA000, 0xD015, 0x1208 };
+    static const uint16_t load_first[] = { 0x6105, 0x6005, 0xA000, 0xD015, 0x1208 };
+    static const uint16_t *programs[] = { clear_first, load_first };
+    bool passed = true;
+
+    for (size_t i = 0; i < sizeof(programs) / sizeof(programs[0]); i++) {
+        struct chip8 chip8;
+
+        load_opcodes(&chip8, programs[i], 5);
+        chip8_interpret(&chip8, 4);
+
+        if (chip8.decoded[0x202].kind != OP_FUSED_SPRITE) {
+            printf("  program %zu: kind %u at 202, not a fused sprite\n", i, chip8.decoded[0x202].kind);
+            passed = false;
+        }
+
+        chip8_release(&chip8);
+    }
+
+    return passed;
+}
+
+// step back past a keyframe and compare everything that was saved, the
+// random number generator included
+static bool check_rewind_round_trip(void)
+{
+    static const uint16_t opcodes[] = {
+        0xC0FF, // 200: V0 = random
+        0xA300, // 202: I = 300
+        0xF033, // 204: store V0 as decimal digits
+        0x1200  // 206: loop to 200
+    };
+    enum { FRAMES = 30, BACK = 5 };
+
+    static struct chip8_snapshot saved[FRAMES];
+    struct chip8_snapshot restored;
+    struct chip8 chip8;
+    struct rewind *rewind = rewind_create(FRAMES, 1 << 20, 8);
+
+    if (rewind == NULL) {
+        return false;
+    }
+
+    load_opcodes(&chip8, opcodes, sizeof(opcodes) / sizeof(opcodes[0]));
+    memset(saved, 0, sizeof(saved));
+    memset(&restored, 0, sizeof(restored));
+
+    for (int frame = 0; frame < FRAMES; frame++) {
+        chip8_emulate_frame(&chip8);
+        rewind_push(rewind, &chip8);
+        chip8_save(&chip8, &saved[frame]);
+    }
+
+    bool passed = rewind_restore(rewind, BACK, &chip8);
+
+    chip8_save(&chip8, &restored);
+    passed = passed && memcmp(&restored, &saved[FRAMES - 1 - BACK], sizeof(restored)) == 0;
+
+    if (!passed) {
+        printf("  rng %016llx, expected %016llx\n", (unsigned long long)restored.rng,
+            (unsigned long long)saved[FRAMES - 1 - BACK].rng);
+    }
+
+    rewind_destroy(rewind);
+    chip8_release(&chip8);
+    return passed;
+}
+
+struct directed_check {
+    const char *name;
+    bool (*run)(void);
+};
+
+static const struct directed_check directed_checks[] = {
+    { "jit wrapping store", check_jit_wrapping_store },
+    { "jit rewritten operands", check_jit_rewritten_operands },
+    { "fused after entry", check_fused_after_entry },
+    { "rewind round trip", check_rewind_round_trip }
+};
+
+int main(int argc, char *argv[])
+{
+    unsigned long runs = 3000;
+    uint64_t seed = 1;
+    int frames = 120;
+    int opt;
+
+    while ((opt = getopt(argc, argv, "n:s:f:")) != -1) {
+        switch (opt) {
+        case 'n':
+            runs = strtoul(optarg, NULL, 10);
+            break;
+        case 's':
+            seed = strtoull(optarg, NULL, 0);
+            break;
+        case 'f':
+            frames = atoi(optarg);
+            break;
+        default:
+            puts(USAGE);
+            return 0;
+        }
+    }
+
+    int failures = 0;
+
+    for (size_t i = 0; i < sizeof(directed_checks) / sizeof(directed_checks[0]); i++) {
+        bool passed = directed_checks[i].run();
+
+        printf("%-32s %s\n", directed_checks[i].name, passed ? "ok" : "FAILED");
+        failures += !passed;
+    }
+
+    bool available[CORE_COUNT];
+    unsigned long failed_runs = 0;
+
+    for (int core = 0; core < CORE_COUNT; core++) {
+        struct chip8 probe;
+
+        chip8_init(&probe);
+        available[core] = enable_core(&probe, core);
+        chip8_disable_jit(&probe);
+    }
+
+    // lanes run the modern handlers, like the compiled cores
+    static const uint8_t jump_to_itself[] = { 0x12, 0x00 };
+    struct lockstep *lockstep = lockstep_create(1, jump_to_itself, sizeof(jump_to_itself), 1);
+    bool lockstep_available = lockstep != NULL;
+
+    lockstep_destroy(lockstep);
+
+    for (unsigned long run = 0; run < runs; run++) {
+        for (int quirks = 0; quirks < CHIP8_QUIRKS_COUNT; quirks++) {
+            bool enabled[CORE_COUNT];
+
+            memcpy(enabled, available, sizeof(enabled));
+
+            if (!check_program(seed + run, frames, quirks, enabled)) {
+                failed_runs += 1;
+            }
+        }
+
+        if (lockstep_available && !check_lockstep(seed + run, frames)) {
+            failed_runs += 1;
+        }
+    }
+
+    for (int core = 0; core < CORE_COUNT; core++) {
+        printf("%-32s %s\n", core_names[core], available[core] ? "compared" : "not built");
+    }
+    printf("%-32s %s\n", "lockstep", lockstep_available ? "compared" : "not built");
+    for (int quirks = 0; quirks < CHIP8_QUIRKS_COUNT; quirks++) {
+        printf("%-32s compared\n", quirks_names[quirks]);
+    }
+    printf("%lu of %lu runs diverged, %lu random programs on each quirk set and in lockstep\n",
+        failed_runs, runs * (CHIP8_QUIRKS_COUNT + lockstep_available), runs);
+
+    return failures == 0 && failed_runs == 0 ? 0 : 1;
+}
@@ -1,27 +1,71 @@
 #include "chip8.h"
+#include "extended.h"
+#include "interpret.h"
+#include "jit.h"
 #include "opcodes.h"
+#include "stats.h"
 #include <stdint.h>
 #include <stdio.h>
+#include <stdlib.h>
 #include <string.h>
 
-#define OPCODE_LEN 16
+#define ADDRESS_MASK (CHIP8_MEMORY_SIZE - 1)
 
-void chip8_init(struct chip8 *chip8)
+// instrumentation, compiled out entirely without CHIP8_STATS
+#ifdef CHIP8_STATS
+#define STATS_ACTIVE(chip8) ((chip8)->stats != NULL)
+#else
+#define STATS_ACTIVE(chip8) false
+#endif
+
+static const struct interpreter *const interpreters[CHIP8_QUIRKS_COUNT] = {
+    [CHIP8_QUIRKS_MODERN] = &interpreter_modern,
+    [CHIP8_QUIRKS_COSMAC_VIP] = &interpreter_cosmac_vip,
+    [CHIP8_QUIRKS_CHIP48] = &interpreter_chip48,
+    [CHIP8_QUIRKS_SCHIP] = &interpreter_schip
+};
+
+// power-on state of everything except memory
+static void reset(struct chip8 *chip8)
 {
-    chip8->cpu.opcode = 0;
     memset(chip8->cpu.V, 0, sizeof(chip8->cpu.V));
     chip8->cpu.I = 0;
-    chip8->cpu.pc = 0x200;
+    chip8->cpu.pc = PROGRAM_START;
     memset(chip8->cpu.stack, 0, sizeof(chip8->cpu.stack));
     chip8->cpu.sp = 0;
 
-    memset(chip8->memory, 0, sizeof(chip8->memory));
     memset(chip8->graphics, 0, sizeof(chip8->graphics));
     chip8->delay_timer = 0;
     chip8->sound_timer = 0;
+    chip8->instructions_per_frame = CHIP8_DEFAULT_INSTRUCTIONS_PER_FRAME;
     memset(chip8->keypad, 0, sizeof(chip8->keypad));
 
     chip8->draw = 0;
+    chip8_seed(chip8, CHIP8_DEFAULT_SEED);
+    chip8->decoded = NULL;
+    chip8->jit = NULL;
+    chip8->stats = NULL;
+    chip8->specialized = false;
+    chip8->extended = NULL;
+    chip8->profile = CHIP8_PROFILE_CHIP8;
+    chip8->quirks = CHIP8_QUIRKS_MODERN;
+    chip8->dirty_pages = UINT64_MAX;
+
+    chip8->idle = CHIP8_BUSY;
+    chip8->halted = false;
+    chip8->sounding = false;
+    memset(chip8->trap_policy, CHIP8_TRAP_RECORD, sizeof(chip8->trap_policy));
+    chip8->trap_handler = NULL;
+    chip8->trap_context = NULL;
+    chip8->event_head = 0;
+    chip8->event_count = 0;
+    chip8->events_dropped = 0;
+}
+
+void chip8_init(struct chip8 *chip8)
+{
+    reset(chip8);
+    memset(chip8->memory, 0, sizeof(chip8->memory));
 
     // load font set into memory
     uint8_t font_set[80] = {
@@ -48,53 +92,655 @@ void chip8_init(struct chip8 *chip8)
     }
 }
 
-void chip8_load(struct chip8 *chip8, uint8_t *program, size_t size)
+// chip8_init and chip8_load in one step, from the memory a machine has
+// after both (see rompack.h), so starting a ROM is a single copy
+void chip8_init_image(struct chip8 *chip8, const uint8_t *image)
 {
-    memcpy(chip8->memory + 512, program, size);
+    reset(chip8);
+    memcpy(chip8->memory, image, sizeof(chip8->memory));
 }
 
-void chip8_emulate_cycle(struct chip8 *chip8)
+bool chip8_load(struct chip8 *chip8, const uint8_t *program, size_t size)
+{
+    if (chip8->profile == CHIP8_PROFILE_XO_CHIP) {
+        return extended_load(chip8, program, size);
+    }
+
+    if (size > MAX_PROGRAM_SIZE) {
+        return false;
+    }
+
+    memcpy(chip8->memory + PROGRAM_START, program, size);
+    chip8_invalidate(chip8, PROGRAM_START, size);
+    return true;
+}
+
+// load a ROM image from disk, fails if it cannot be read or does not fit
+bool chip8_load_file(struct chip8 *chip8, const char *path)
+{
+    FILE *file = fopen(path, "rb");
+
+    if (file == NULL) {
+        return false;
+    }
+
+    // read one byte more than fits to notice oversized files
+    size_t memory_size = chip8->profile == CHIP8_PROFILE_XO_CHIP ? CHIP8_XO_MEMORY_SIZE : CHIP8_MEMORY_SIZE;
+    size_t capacity = memory_size - PROGRAM_START + 1;
+    uint8_t *program = malloc(capacity);
+
+    if (program == NULL) {
+        fclose(file);
+        return false;
+    }
+
+    size_t size = fread(program, 1, capacity, file);
+    bool loaded = !ferror(file) && chip8_load(chip8, program, size);
+
+    fclose(file);
+    free(program);
+    return loaded;
+}
+
+// start the random number generator from a seed, the same seed always
+// gives the same numbers
+void chip8_seed(struct chip8 *chip8, uint64_t seed)
+{
+    // splitmix64, so nearby seeds give unrelated sequences
+    uint64_t z = seed + 0x9E3779B97F4A7C15ULL;
+
+    z = (z ^ (z >> 30)) * 0xBF58476D1CE4E5B9ULL;
+    z = (z ^ (z >> 27)) * 0x94D049BB133111EBULL;
+    z ^= z >> 31;
+
+    // xorshift never leaves zero
+    chip8->rng = z ? z : CHIP8_DEFAULT_SEED;
+}
+
+// turn the machine into another one, keeping memory, registers and timers;
+// the display starts blank. Load the ROM afterwards, XO-CHIP has its own
+// memory.
+bool chip8_set_profile(struct chip8 *chip8, enum chip8_profile profile)
+{
+    if (profile >= CHIP8_PROFILE_COUNT) {
+        return false;
+    }
+
+    if (profile == CHIP8_PROFILE_CHIP8) {
+        extended_disable(chip8);
+        return true;
+    }
+
+    // neither compiled core knows the extended instructions, and the
+    // extended interpreter has the machine's own behaviour only
+    chip8_disable_jit(chip8);
+    chip8_disable_specialized(chip8);
+    chip8->quirks = CHIP8_QUIRKS_MODERN;
+    return extended_enable(chip8, profile);
+}
+
+// look a profile up by the name used on command lines
+bool chip8_find_profile(const char *name, enum chip8_profile *profile)
 {
-    void (*opcodes[])(struct chip8 * chip8) = {
-        &op_clear_or_return,
-        &op_jump,
-        &op_call,
-        &op_skip_equal,
-        &op_skip_not_equal,
-        &op_skip_registers_equal,
-        &op_load,
-        &op_add,
-        &op_arithmetic,
-        &op_skip_registers_not_equal,
-        &op_load_i,
-        &op_jump_offset,
-        &op_random,
-        &op_draw,
-        &op_skip_if_key,
-        &op_misc
+    static const char *names[CHIP8_PROFILE_COUNT] = {
+        [CHIP8_PROFILE_CHIP8] = "chip8",
+        [CHIP8_PROFILE_SUPER_CHIP] = "schip",
+        [CHIP8_PROFILE_XO_CHIP] = "xochip"
     };
 
-    // fetch (merge two bytes together)
-    chip8->cpu.opcode = chip8->memory[chip8->cpu.pc] << 8 | chip8->memory[chip8->cpu.pc + 1];
+    for (int i = 0; i < CHIP8_PROFILE_COUNT; i++) {
+        if (strcmp(name, names[i]) == 0) {
+            *profile = i;
+            return true;
+        }
+    }
+    return false;
+}
+
+// run CHIP-8 programs the way another interpreter did; each set has an
+// interpreter of its own, so switching costs nothing per instruction.
+// SUPER-CHIP and XO-CHIP machines have no sets, false for those.
+bool chip8_set_quirks(struct chip8 *chip8, enum chip8_quirks quirks)
+{
+    if (quirks >= CHIP8_QUIRKS_COUNT || chip8->profile != CHIP8_PROFILE_CHIP8) {
+        return false;
+    }
 
-    // decode (only need the first 4 bits)
-    uint8_t index = (chip8->cpu.opcode & 0xf000) >> 12;
+    // the compiled cores only know the modern behaviour
+    if (quirks != CHIP8_QUIRKS_MODERN) {
+        chip8_disable_jit(chip8);
+        chip8_disable_specialized(chip8);
+    }
 
-    // execute
-    if (index < OPCODE_LEN) {
-        opcodes[index](chip8);
+    chip8->quirks = quirks;
+    return true;
+}
+
+bool chip8_find_quirks(const char *name, enum chip8_quirks *quirks)
+{
+    static const char *names[CHIP8_QUIRKS_COUNT] = {
+        [CHIP8_QUIRKS_MODERN] = "modern",
+        [CHIP8_QUIRKS_COSMAC_VIP] = "vip",
+        [CHIP8_QUIRKS_CHIP48] = "chip48",
+        [CHIP8_QUIRKS_SCHIP] = "schip"
+    };
+
+    for (int i = 0; i < CHIP8_QUIRKS_COUNT; i++) {
+        if (strcmp(name, names[i]) == 0) {
+            *quirks = i;
+            return true;
+        }
+    }
+    return false;
+}
+
+// forget decoded instructions overlapping a range of memory that was written
+void chip8_invalidate(struct chip8 *chip8, uint16_t address, uint16_t length)
+{
+    // the instruction starting one byte earlier reads the first byte too
+    for (uint32_t i = 0; chip8->decoded != NULL && i <= length; i++) {
+        chip8->decoded[(address - 1 + i) & ADDRESS_MASK].kind = OP_UNDECODED;
+    }
+
+    for (uint32_t i = 0; i < length; i += CHIP8_PAGE_SIZE) {
+        chip8->dirty_pages |= 1ULL << (((address + i) & ADDRESS_MASK) / CHIP8_PAGE_SIZE);
+    }
+
+    if (length > 0) {
+        // the range may end part way into a page the loop stepped over
+        chip8->dirty_pages |= 1ULL << (((address + length - 1) & ADDRESS_MASK) / CHIP8_PAGE_SIZE);
+    }
+
+    // most writes are to data, which no compiled block covers
+    if (chip8->jit != NULL && jit_covers(chip8->jit, address, length)) {
+        uint16_t start = address & ADDRESS_MASK;
+        uint32_t end = (uint32_t)start + length;
+
+        // Fx33 and Fx55 wrap at the end of memory, so the tail lands at 0
+        if (end > CHIP8_MEMORY_SIZE) {
+            jit_invalidate(chip8->jit, start, CHIP8_MEMORY_SIZE - start);
+            jit_invalidate(chip8->jit, 0, end - CHIP8_MEMORY_SIZE);
+        } else {
+            jit_invalidate(chip8->jit, start, length);
+        }
+    }
+}
+
+// translate hot code to native instructions when the host supports it
+bool chip8_enable_jit(struct chip8 *chip8)
+{
+    if (chip8->extended != NULL || chip8->quirks != CHIP8_QUIRKS_MODERN) {
+        return false;
+    }
+
+    if (chip8->jit == NULL) {
+        chip8->jit = jit_create();
+    }
+    return chip8->jit != NULL;
+}
+
+void chip8_disable_jit(struct chip8 *chip8)
+{
+    jit_destroy(chip8->jit);
+    chip8->jit = NULL;
+}
+
+// switch to the specialized core, false when built without CHIP8_SPECIALIZED
+bool chip8_enable_specialized(struct chip8 *chip8)
+{
+#ifdef CHIP8_SPECIALIZED
+    chip8->specialized = chip8->extended == NULL && chip8->quirks == CHIP8_QUIRKS_MODERN;
+    return chip8->specialized;
+#else
+    (void)chip8;
+    return false;
+#endif
+}
+
+void chip8_disable_specialized(struct chip8 *chip8)
+{
+    chip8->specialized = false;
+}
+
+// free what the machine allocated as it ran: the decoded cache, compiled
+// code and extended state. Call before chip8_init or chip8_init_image
+// reuse a machine, they forget all three.
+void chip8_release(struct chip8 *chip8)
+{
+    free(chip8->decoded);
+    chip8->decoded = NULL;
+    chip8_disable_jit(chip8);
+    extended_disable(chip8);
+}
+
+void chip8_save(const struct chip8 *chip8, struct chip8_snapshot *snapshot)
+{
+    snapshot->cpu = chip8->cpu;
+    memcpy(snapshot->graphics, chip8->graphics, sizeof(snapshot->graphics));
+    snapshot->delay_timer = chip8->delay_timer;
+    snapshot->sound_timer = chip8->sound_timer;
+    memcpy(snapshot->keypad, chip8->keypad, sizeof(snapshot->keypad));
+    snapshot->rng = chip8->rng;
+    memcpy(snapshot->memory, chip8->memory, sizeof(snapshot->memory));
+}
+
+// only pages that differ are copied, so decoded and compiled code elsewhere
+// survives the restore
+void chip8_restore(struct chip8 *chip8, const struct chip8_snapshot *snapshot)
+{
+    chip8->cpu = snapshot->cpu;
+    memcpy(chip8->graphics, snapshot->graphics, sizeof(chip8->graphics));
+    chip8->delay_timer = snapshot->delay_timer;
+    chip8->sound_timer = snapshot->sound_timer;
+    memcpy(chip8->keypad, snapshot->keypad, sizeof(chip8->keypad));
+    chip8->rng = snapshot->rng;
+    chip8->draw = true;
+    chip8->halted = false;
+
+    for (uint16_t address = 0; address < CHIP8_MEMORY_SIZE; address += CHIP8_PAGE_SIZE) {
+        if (memcmp(chip8->memory + address, snapshot->memory + address, CHIP8_PAGE_SIZE) != 0) {
+            memcpy(chip8->memory + address, snapshot->memory + address, CHIP8_PAGE_SIZE);
+            chip8_invalidate(chip8, address, CHIP8_PAGE_SIZE);
+        }
+    }
+}
+
+bool chip8_set_trap_policy(struct chip8 *chip8, enum chip8_event_kind kind, enum chip8_trap_policy policy)
+{
+    if (kind >= CHIP8_EVENT_KIND_COUNT || policy > CHIP8_TRAP_CALLBACK) {
+        return false;
+    }
+
+    chip8->trap_policy[kind] = policy;
+    return true;
+}
+
+// handler for events whose policy is CHIP8_TRAP_CALLBACK, called from
+// inside the instruction that raised them
+void chip8_set_trap_handler(struct chip8 *chip8, chip8_trap_handler handler, void *context)
+{
+    chip8->trap_handler = handler;
+    chip8->trap_context = context;
+}
+
+// report an event as its policy says, returns true when the machine halted
+// so the instruction raising it can stop where it is
+bool chip8_trap(struct chip8 *chip8, enum chip8_event_kind kind, uint16_t detail)
+{
+    // a halted machine re-running its instruction does not report it again
+    if (chip8->halted) {
+        return true;
+    }
+
+    struct chip8_event event = {
+        .kind = kind,
+        .pc = chip8->cpu.pc,
+        .detail = detail
+    };
+
+    switch (chip8->trap_policy[kind]) {
+    case CHIP8_TRAP_IGNORE:
+        return false;
+    case CHIP8_TRAP_CALLBACK:
+        chip8->halted = chip8->trap_handler != NULL && chip8->trap_handler(chip8, &event, chip8->trap_context);
+        return chip8->halted;
+    case CHIP8_TRAP_HALT:
+        chip8->halted = true;
+        break;
+    default:
+        break;
+    }
+
+    // the newest events are the ones lost when the host falls behind
+    if (chip8->event_count == CHIP8_EVENT_QUEUE_SIZE) {
+        chip8->events_dropped += 1;
     } else {
-        printf("Unknown opcode: 0x%X\n", chip8->cpu.opcode);
+        chip8->events[(chip8->event_head + chip8->event_count) % CHIP8_EVENT_QUEUE_SIZE] = event;
+        chip8->event_count += 1;
+    }
+
+    return chip8->halted;
+}
+
+// take the oldest queued event, false when there is none
+bool chip8_poll_event(struct chip8 *chip8, struct chip8_event *event)
+{
+    if (chip8->event_count == 0) {
+        return false;
+    }
+
+    *event = chip8->events[chip8->event_head];
+    chip8->event_head = (chip8->event_head + 1) % CHIP8_EVENT_QUEUE_SIZE;
+    chip8->event_count -= 1;
+    return true;
+}
+
+// carry on after a halt, from the instruction that halted (which traps
+// again unless its policy or the machine changed)
+void chip8_resume(struct chip8 *chip8)
+{
+    chip8->halted = false;
+}
+
+const char *chip8_event_name(enum chip8_event_kind kind)
+{
+    static const char *names[CHIP8_EVENT_KIND_COUNT] = {
+        [CHIP8_EVENT_ILLEGAL_OPCODE] = "illegal opcode",
+        [CHIP8_EVENT_STACK_OVERFLOW] = "stack overflow",
+        [CHIP8_EVENT_STACK_UNDERFLOW] = "stack underflow",
+        [CHIP8_EVENT_MEMORY_RANGE] = "memory access out of range",
+        [CHIP8_EVENT_KEY_RANGE] = "key out of range",
+        [CHIP8_EVENT_SOUND_START] = "sound start",
+        [CHIP8_EVENT_SOUND_STOP] = "sound stop"
+    };
+
+    return kind < CHIP8_EVENT_KIND_COUNT ? names[kind] : "unknown event";
+}
+
+void chip8_set_key(struct chip8 *chip8, uint8_t key, bool pressed)
+{
+    chip8->keypad[key & 0xf] = pressed;
+}
+
+// copy out the picture in the same layout for every profile
+void chip8_get_display(const struct chip8 *chip8, struct chip8_display *display)
+{
+    if (chip8->extended != NULL) {
+        extended_get_display(chip8, display);
+        return;
     }
 
-    // update timers
+    display->width = CHIP8_WIDTH;
+    display->height = CHIP8_HEIGHT;
+    memset(display->planes, 0, sizeof(display->planes));
+
+    for (int y = 0; y < CHIP8_HEIGHT; y++) {
+        display->planes[0][y][0] = chip8->graphics[y];
+    }
+}
+
+// the planes lit at (x, y), bit 0 for the first; x and y are within the
+// current resolution
+uint8_t chip8_pixel(const struct chip8 *chip8, int x, int y)
+{
+    if (chip8->extended == NULL) {
+        return (chip8->graphics[y] >> (CHIP8_WIDTH - 1 - x)) & 1;
+    }
+
+    const struct chip8_extended *extended = chip8->extended;
+    uint8_t lit = 0;
+
+    for (int plane = 0; plane < CHIP8_PLANE_COUNT; plane++) {
+        lit |= ((extended->planes[plane][y][x / 64] >> (63 - x % 64)) & 1) << plane;
+    }
+    return lit;
+}
+
+// expand the display to one byte per pixel (the planes lit), row by row, at
+// the current resolution; pixels must have room for the high one
+void chip8_unpack_graphics(const struct chip8 *chip8, uint8_t *pixels)
+{
+    int width = CHIP8_WIDTH;
+    int height = CHIP8_HEIGHT;
+
+    if (chip8->extended != NULL && chip8->extended->hires) {
+        width = CHIP8_HIRES_WIDTH;
+        height = CHIP8_HIRES_HEIGHT;
+    }
+
+    for (int y = 0; y < height; y++) {
+        for (int x = 0; x < width; x++) {
+            pixels[y * width + x] = chip8_pixel(chip8, x, y);
+        }
+    }
+}
+
+// count both timers down, called once per 60 Hz frame
+void chip8_update_timers(struct chip8 *chip8)
+{
     if (chip8->delay_timer > 0) {
         chip8->delay_timer -= 1;
     }
+
+    // the sound timer may have been set anywhere in the frame, by any path
+    if (chip8->sound_timer > 0 && !chip8->sounding) {
+        chip8->sounding = true;
+        chip8_trap(chip8, CHIP8_EVENT_SOUND_START, chip8->sound_timer);
+    }
     if (chip8->sound_timer > 0) {
         chip8->sound_timer -= 1;
-        if (chip8->sound_timer == 0) {
-            printf("\a");
+    }
+    if (chip8->sound_timer == 0 && chip8->sounding) {
+        chip8->sounding = false;
+        chip8_trap(chip8, CHIP8_EVENT_SOUND_STOP, 0);
+    }
+}
+
+void chip8_emulate_cycle(struct chip8 *chip8)
+{
+    chip8_emulate_cycles(chip8, 1);
+}
+
+static uint16_t opcode_at(const struct chip8 *chip8, uint16_t address)
+{
+    return chip8->memory[address & ADDRESS_MASK] << 8 | chip8->memory[(address + 1) & ADDRESS_MASK];
+}
+
+// the decoded cache is allocated and cleared the first time a machine
+// interprets rather than on every reset, machines that never do (lockstep
+// lanes, ROM pack images) go without
+static bool allocate_decoded(struct chip8 *chip8)
+{
+    if (chip8->decoded == NULL) {
+        chip8->decoded = calloc(CHIP8_MEMORY_SIZE, sizeof(*chip8->decoded));
+    }
+    return chip8->decoded != NULL;
+}
+
+// without memory for the cache every instruction is decoded afresh
+static void interpret_uncached(struct chip8 *chip8, unsigned long count)
+{
+    while (count > 0) {
+        struct instruction ins;
+
+        opcode_decode(opcode_at(chip8, chip8->cpu.pc), &ins);
+        interpreters[chip8->quirks]->handlers[ins.kind](chip8, &ins);
+        count -= 1;
+
+        if (chip8->halted) {
+            return;
         }
     }
 }
+
+#ifdef CHIP8_STATS
+
+static struct instruction *decode(struct chip8 *chip8, uint16_t pc)
+{
+    struct instruction *ins = &chip8->decoded[pc];
+    uint16_t opcode = chip8->memory[pc] << 8 | chip8->memory[(pc + 1) & ADDRESS_MASK];
+
+    opcode_decode(opcode, ins);
+    return ins;
+}
+
+// interpreter that counts every instruction, kept apart so the fast paths
+// stay exactly as they are while nothing is counted
+static void interpret_counted(struct chip8 *chip8, unsigned long count)
+{
+    if (!allocate_decoded(chip8)) {
+        interpret_uncached(chip8, count);
+        return;
+    }
+
+    while (count > 0) {
+        uint16_t pc = chip8->cpu.pc & ADDRESS_MASK;
+        struct instruction *ins = &chip8->decoded[pc];
+
+        // superinstructions are counted as the instructions they are made of
+        if (ins->kind == OP_UNDECODED || ins->kind >= INSTRUCTION_KIND_COUNT) {
+            ins = decode(chip8, pc);
+        }
+
+        stats_count(chip8->stats, pc, ins->kind);
+        interpreters[chip8->quirks]->handlers[ins->kind](chip8, ins);
+        count -= 1;
+
+        if (chip8->halted) {
+            return;
+        }
+    }
+}
+
+#endif
+
+#ifdef CHIP8_SPECIALIZED
+
+// the opcode is the index into the handler table, so nothing is decoded
+// and writes to memory never need invalidating
+static void interpret_specialized(struct chip8 *chip8, unsigned long count)
+{
+    while (count > 0) {
+        uint16_t pc = chip8->cpu.pc & ADDRESS_MASK;
+
+        specialized_handlers[chip8->memory[pc] << 8 | chip8->memory[(pc + 1) & ADDRESS_MASK]](chip8);
+        count -= 1;
+
+        if (chip8->halted) {
+            return;
+        }
+    }
+}
+
+#endif
+
+void chip8_emulate_cycles(struct chip8 *chip8, unsigned long count)
+{
+    if (chip8->halted) {
+        return;
+    }
+
+    if (chip8->extended != NULL) {
+        extended_run(chip8, count);
+        return;
+    }
+
+#ifdef CHIP8_STATS
+    // compiled code cannot be counted, so it is bypassed while counting
+    if (STATS_ACTIVE(chip8)) {
+        interpret_counted(chip8, count);
+        return;
+    }
+#endif
+
+    if (chip8->jit != NULL) {
+        jit_run(chip8, count);
+        return;
+    }
+
+#ifdef CHIP8_SPECIALIZED
+    if (chip8->specialized) {
+        interpret_specialized(chip8, count);
+        return;
+    }
+#endif
+
+    chip8_interpret(chip8, count);
+}
+
+// run on the interpreter for the machine's quirk set
+void chip8_interpret(struct chip8 *chip8, unsigned long count)
+{
+    if (!allocate_decoded(chip8)) {
+        interpret_uncached(chip8, count);
+        return;
+    }
+
+    interpreters[chip8->quirks]->run(chip8, count);
+}
+
+// whether a delay timer poll starts at head: Fx07, then 3xkk or 4xkk, then
+// a jump back to the Fx07
+static bool is_timer_poll(const struct chip8 *chip8, uint16_t head)
+{
+    uint16_t load = opcode_at(chip8, head);
+    uint16_t skip = opcode_at(chip8, head + 2);
+
+    return head <= ADDRESS_MASK - 4
+        && (load & 0xf0ff) == 0xf007
+        && ((skip & 0xf000) == 0x3000 || (skip & 0xf000) == 0x4000)
+        && (skip & 0x0f00) == (load & 0x0f00)
+        && opcode_at(chip8, head + 4) == (0x1000 | head);
+}
+
+// recognise a loop that cannot change anything before the next timer tick
+// or key press, and skip it. Runs the few instructions needed to reach the
+// top of a timer poll, and leaves the machine exactly as running all count
+// instructions would have. Returns how many instructions are left to run.
+static unsigned long fast_forward(struct chip8 *chip8, unsigned long count)
+{
+    uint16_t pc = chip8->cpu.pc & ADDRESS_MASK;
+    uint16_t opcode = opcode_at(chip8, pc);
+
+    if (opcode == (0x1000 | pc)) {
+        chip8->idle = CHIP8_IDLE_LOOP;
+        return 0;
+    }
+
+    if ((opcode & 0xf0ff) == 0xf00a && memchr(chip8->keypad, 1, sizeof(chip8->keypad)) == NULL) {
+        chip8->idle = CHIP8_IDLE_KEY;
+        return 0;
+    }
+
+    for (uint16_t head = pc - 4; head != pc + 2; head += 2) {
+        if (head > ADDRESS_MASK || !is_timer_poll(chip8, head)) {
+            continue;
+        }
+
+        // Vx may hold the timer from before the last tick until the loop
+        // comes round to reload it
+        while (chip8->cpu.pc != head && chip8->cpu.pc >= head && chip8->cpu.pc <= head + 4 && count > 0) {
+            chip8_emulate_cycles(chip8, 1);
+            count -= 1;
+        }
+
+        if (chip8->cpu.pc != head || count == 0 || chip8->halted) {
+            break;
+        }
+
+        // every pass until the tick sees the same timer value
+        uint16_t skip = opcode_at(chip8, head + 2);
+        bool equal = chip8->delay_timer == (skip & 0x00ff);
+
+        if (equal != ((skip & 0xf000) == 0x3000)) {
+            chip8->cpu.V[(skip & 0x0f00) >> 8] = chip8->delay_timer;
+            chip8->cpu.pc = head + 2 * (count % 3);
+            chip8->idle = CHIP8_IDLE_TIMER;
+            return 0;
+        }
+
+        break;
+    }
+
+    chip8->idle = CHIP8_BUSY;
+    return count;
+}
+
+// run one 60 Hz frame: the configured number of instructions, then the timers
+void chip8_emulate_frame(struct chip8 *chip8)
+{
+    unsigned long count = chip8->instructions_per_frame;
+
+    // counts stay exact while collecting statistics, and XO-CHIP memory
+    // is not where fast_forward looks
+    if (!chip8->halted && !STATS_ACTIVE(chip8) && chip8->profile != CHIP8_PROFILE_XO_CHIP) {
+        count = fast_forward(chip8, count);
+    }
+
+    chip8_emulate_cycles(chip8, count);
+    chip8_update_timers(chip8);
+
+    if (STATS_ACTIVE(chip8)) {
+        stats_end_frame(chip8->stats);
+    }
+}
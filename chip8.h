@@ -5,29 +5,213 @@
 #include <stdint.h>
 #include <stdlib.h>
 
-#define MAX_PROGRAM_SIZE 4096 - 512
+#define CHIP8_MEMORY_SIZE 4096
+#define CHIP8_WIDTH 64
+#define CHIP8_HEIGHT 32
+#define CHIP8_HIRES_WIDTH 128 // SUPER-CHIP and XO-CHIP high resolution
+#define CHIP8_HIRES_HEIGHT 64
+#define CHIP8_PLANE_COUNT 2 // XO-CHIP bitplanes
+#define CHIP8_ROW_WORDS (CHIP8_HIRES_WIDTH / 64)
+#define CHIP8_XO_MEMORY_SIZE 0x10000
+#define CHIP8_FRAME_RATE 60 // Hz, timers count down once per frame
+#define CHIP8_DEFAULT_INSTRUCTIONS_PER_FRAME 12
+#define PROGRAM_START 0x200
+#define MAX_PROGRAM_SIZE (CHIP8_MEMORY_SIZE - PROGRAM_START)
+#define CHIP8_PAGE_SIZE 64 // Granularity of dirty memory tracking
+#define CHIP8_PAGE_COUNT (CHIP8_MEMORY_SIZE / CHIP8_PAGE_SIZE)
+#define CHIP8_DEFAULT_SEED 0x43484950 // Random numbers repeat from run to run unless reseeded
+#define CHIP8_STACK_SIZE 16
+#define CHIP8_EVENT_QUEUE_SIZE 32 // Events kept until the host polls them
+
+struct jit;
+struct chip8_stats;
+struct chip8_extended;
 
 struct cpu {
-    uint16_t opcode; // Current opcode
     uint8_t V[16]; // Registers V0-VE
     uint16_t I; // Index register
     uint16_t pc; // Program counter
-    uint16_t stack[16]; // Stack
+    uint16_t stack[CHIP8_STACK_SIZE]; // Stack
     uint16_t sp; // Stack pointer
 };
 
+// An opcode with its operands already extracted
+struct instruction {
+    uint8_t kind; // Handler to run (enum instruction_kind)
+    uint8_t x; // 0x0f00
+    uint8_t y; // 0x00f0
+    uint8_t n; // 0x000f
+    uint8_t kk; // 0x00ff
+    uint16_t nnn; // 0x0fff
+};
+
+// Conditions reported to the host instead of printed from the core
+enum chip8_event_kind {
+    CHIP8_EVENT_ILLEGAL_OPCODE, // Detail is the opcode
+    CHIP8_EVENT_STACK_OVERFLOW, // Call with a full stack, detail is the target
+    CHIP8_EVENT_STACK_UNDERFLOW, // Return with an empty stack, detail is sp
+    CHIP8_EVENT_MEMORY_RANGE, // Access past the end of memory, detail is I
+    CHIP8_EVENT_KEY_RANGE, // Key check on a value above F, detail is the value
+    CHIP8_EVENT_SOUND_START,
+    CHIP8_EVENT_SOUND_STOP,
+    CHIP8_EVENT_KIND_COUNT
+};
+
+// What happens when an event occurs, chosen per kind
+enum chip8_trap_policy {
+    CHIP8_TRAP_RECORD, // Queue the event and carry on (default)
+    CHIP8_TRAP_IGNORE, // Carry on without a trace
+    CHIP8_TRAP_HALT, // Queue the event and stop on the instruction until chip8_resume
+    CHIP8_TRAP_CALLBACK // Call the trap handler, which decides whether to halt
+};
+
+struct chip8_event {
+    uint8_t kind; // enum chip8_event_kind
+    uint16_t pc; // Instruction that caused it
+    uint16_t detail;
+};
+
+// What the program was found waiting for at the start of the last frame.
+// The rest of an idle frame is skipped, as running it changes nothing.
+enum chip8_idle {
+    CHIP8_BUSY,
+    CHIP8_IDLE_LOOP, // Jumping to itself, only the timers still change
+    CHIP8_IDLE_TIMER, // Polling the delay timer until the next tick
+    CHIP8_IDLE_KEY // Waiting for a key press
+};
+
+// Machines the core can be, chosen with chip8_set_profile
+enum chip8_profile {
+    CHIP8_PROFILE_CHIP8,
+    CHIP8_PROFILE_SUPER_CHIP, // 128x64, scrolling, 16x16 sprites and a large font
+    CHIP8_PROFILE_XO_CHIP, // SUPER-CHIP with 64 KB of memory and two bitplanes
+    CHIP8_PROFILE_COUNT
+};
+
+// Sets of behaviours that differ between interpreters, chosen with
+// chip8_set_quirks (see quirks.h)
+enum chip8_quirks {
+    CHIP8_QUIRKS_MODERN,
+    CHIP8_QUIRKS_COSMAC_VIP,
+    CHIP8_QUIRKS_CHIP48,
+    CHIP8_QUIRKS_SCHIP,
+    CHIP8_QUIRKS_COUNT
+};
+
+// The picture whatever the profile, one bitplane per XO-CHIP plane. A row
+// is CHIP8_ROW_WORDS words, bit 63 of the first is x = 0; at 64x32 only the
+// first word of the first 32 rows is used.
+struct chip8_display {
+    uint8_t width;
+    uint8_t height;
+    uint64_t planes[CHIP8_PLANE_COUNT][CHIP8_HIRES_HEIGHT][CHIP8_ROW_WORDS];
+};
+
+struct chip8;
+
+// returns true to halt the machine
+typedef bool (*chip8_trap_handler)(struct chip8 *chip8, const struct chip8_event *event, void *context);
+
 struct chip8 {
     struct cpu cpu;
-    uint8_t memory[4096];
-    uint8_t graphics[64 * 32];
+    uint8_t memory[CHIP8_MEMORY_SIZE];
+    uint64_t graphics[CHIP8_HEIGHT]; // One word per row, bit 63 is x = 0
     uint8_t delay_timer;
     uint8_t sound_timer;
+    uint16_t instructions_per_frame; // CPU clock, in instructions per timer tick
     uint8_t keypad[16];
     bool draw;
+    uint64_t rng; // xorshift64* state for RND, never zero
+
+    // Decoded instruction starting at each address, filled in lazily.
+    // Allocated the first time the machine interprets, NULL before.
+    struct instruction *decoded;
+    struct jit *jit; // Native code cache, NULL when only interpreting
+    struct chip8_stats *stats; // Instrumentation, NULL unless enabled (see stats.h)
+    bool specialized; // Run through the per-opcode handlers (see specialized.c)
+    struct chip8_extended *extended; // SUPER-CHIP and XO-CHIP state, NULL for CHIP-8 (see extended.h)
+    uint8_t profile; // enum chip8_profile
+    uint8_t quirks; // enum chip8_quirks
+
+    // Bit n set when memory page n was written, cleared by whoever consumes it
+    uint64_t dirty_pages;
+
+    uint8_t idle; // enum chip8_idle
+    bool halted; // Stopped by a trap, nothing runs until chip8_resume
+    bool sounding; // Sound timer was running at the last timer tick
+    uint8_t trap_policy[CHIP8_EVENT_KIND_COUNT]; // enum chip8_trap_policy per event kind
+    chip8_trap_handler trap_handler;
+    void *trap_context;
+    struct chip8_event events[CHIP8_EVENT_QUEUE_SIZE]; // Ring of events not yet polled
+    uint8_t event_head;
+    uint8_t event_count;
+    uint32_t events_dropped; // Events lost to a full queue
 };
 
+// Machine state without host resources, for saving and restoring
+struct chip8_snapshot {
+    struct cpu cpu;
+    uint64_t graphics[CHIP8_HEIGHT];
+    uint8_t delay_timer;
+    uint8_t sound_timer;
+    uint8_t keypad[16];
+    uint64_t rng;
+    uint8_t memory[CHIP8_MEMORY_SIZE]; // Last, so the rest can be handled as one block
+};
+
+// Machine setup
 void chip8_init(struct chip8 *chip8);
+void chip8_init_image(struct chip8 *chip8, const uint8_t *image);
+bool chip8_load(struct chip8 *chip8, const uint8_t *program, size_t size);
+bool chip8_load_file(struct chip8 *chip8, const char *path);
+void chip8_seed(struct chip8 *chip8, uint64_t seed);
+bool chip8_set_profile(struct chip8 *chip8, enum chip8_profile profile);
+bool chip8_find_profile(const char *name, enum chip8_profile *profile);
+bool chip8_set_quirks(struct chip8 *chip8, enum chip8_quirks quirks);
+bool chip8_find_quirks(const char *name, enum chip8_quirks *quirks);
+bool chip8_enable_jit(struct chip8 *chip8);
+void chip8_disable_jit(struct chip8 *chip8);
+bool chip8_enable_specialized(struct chip8 *chip8);
+void chip8_disable_specialized(struct chip8 *chip8);
+void chip8_release(struct chip8 *chip8);
+
+// Execution
 void chip8_emulate_cycle(struct chip8 *chip8);
-void chip8_load(struct chip8 *chip8, uint8_t *program, size_t size);
+void chip8_emulate_cycles(struct chip8 *chip8, unsigned long count);
+void chip8_emulate_frame(struct chip8 *chip8);
+void chip8_interpret(struct chip8 *chip8, unsigned long count);
+void chip8_update_timers(struct chip8 *chip8);
+void chip8_invalidate(struct chip8 *chip8, uint16_t address, uint16_t length);
+
+// Snapshots, of the CHIP-8 state only
+void chip8_save(const struct chip8 *chip8, struct chip8_snapshot *snapshot);
+void chip8_restore(struct chip8 *chip8, const struct chip8_snapshot *snapshot);
+
+// Traps and events
+bool chip8_set_trap_policy(struct chip8 *chip8, enum chip8_event_kind kind, enum chip8_trap_policy policy);
+void chip8_set_trap_handler(struct chip8 *chip8, chip8_trap_handler handler, void *context);
+bool chip8_trap(struct chip8 *chip8, enum chip8_event_kind kind, uint16_t detail);
+bool chip8_poll_event(struct chip8 *chip8, struct chip8_event *event);
+void chip8_resume(struct chip8 *chip8);
+const char *chip8_event_name(enum chip8_event_kind kind);
+
+// Input and output
+void chip8_set_key(struct chip8 *chip8, uint8_t key, bool pressed);
+void chip8_get_display(const struct chip8 *chip8, struct chip8_display *display);
+void chip8_unpack_graphics(const struct chip8 *chip8, uint8_t *pixels);
+uint8_t chip8_pixel(const struct chip8 *chip8, int x, int y);
+
+// next byte from the machine's own generator, the high bits are the best
+static inline uint8_t chip8_random(struct chip8 *chip8)
+{
+    uint64_t x = chip8->rng;
+
+    x ^= x >> 12;
+    x ^= x << 25;
+    x ^= x >> 27;
+    chip8->rng = x;
+
+    return (x * 0x2545F4914F6CDD1DULL) >> 56;
+}
 
 #endif
@@ -0,0 +1,557 @@
+#include "extended.h"
+#include "opcodes.h"
+#include <stdlib.h>
+#include <string.h>
+
+// SUPER-CHIP and XO-CHIP interpreter. It decodes each instruction as it
+// runs it and does itself what the extensions change: the display, kept as
+// bitplanes so that scrolling moves whole rows and words, memory past 4 KB
+// and the new instructions. The rest goes to the ordinary handlers. The
+// CHIP-8 cores never come here, so they run as fast as without it.
+
+#define SCROLL_STEP 4 // Pixels moved by 00FB and 00FC
+
+// 8x10 digits for Fx30, SUPER-CHIP has 0-9 and XO-CHIP adds A-F
+static const uint8_t big_font[16 * 10] = {
+    0x3C, 0x7E, 0xE7, 0xC3, 0xC3, 0xC3, 0xC3, 0xE7, 0x7E, 0x3C, // 0
+    0x18, 0x38, 0x58, 0x18, 0x18, 0x18, 0x18, 0x18, 0x18, 0x3C, // 1
+    0x3E, 0x7F, 0xC3, 0x06, 0x0C, 0x18, 0x30, 0x60, 0xFF, 0xFF, // 2
+    0x3C, 0x7E, 0xC3, 0x03, 0x0E, 0x0E, 0x03, 0xC3, 0x7E, 0x3C, // 3
+    0x06, 0x0E, 0x1E, 0x36, 0x66, 0xC6, 0xFF, 0xFF, 0x06, 0x06, // 4
+    0xFF, 0xFF, 0xC0, 0xC0, 0xFC, 0xFE, 0x03, 0xC3, 0x7E, 0x3C, // 5
+    0x3E, 0x7C, 0xE0, 0xC0, 0xFC, 0xFE, 0xC3, 0xC3, 0x7E, 0x3C, // 6
+    0xFF, 0xFF, 0x03, 0x06, 0x0C, 0x18, 0x30, 0x60, 0x60, 0x60, // 7
+    0x3C, 0x7E, 0xC3, 0xC3, 0x7E, 0x7E, 0xC3, 0xC3, 0x7E, 0x3C, // 8
+    0x3C, 0x7E, 0xC3, 0xC3, 0x7F, 0x3F, 0x03, 0x03, 0x3E, 0x7C, // 9
+    0x7E, 0xFF, 0xC3, 0xC3, 0xC3, 0xFF, 0xFF, 0xC3, 0xC3, 0xC3, // A
+    0xFC, 0xFC, 0xC3, 0xC3, 0xFC, 0xFC, 0xC3, 0xC3, 0xFC, 0xFC, // B
+    0x3C, 0xFF, 0xC3, 0xC0, 0xC0, 0xC0, 0xC0, 0xC3, 0xFF, 0x3C, // C
+    0xFC, 0xFE, 0xC3, 0xC3, 0xC3, 0xC3, 0xC3, 0xC3, 0xFE, 0xFC, // D
+    0xFF, 0xFF, 0xC0, 0xC0, 0xFF, 0xFF, 0xC0, 0xC0, 0xFF, 0xFF, // E
+    0xFF, 0xFF, 0xC0, 0xC0, 0xFF, 0xFF, 0xC0, 0xC0, 0xC0, 0xC0 // F
+};
+
+// What running an instruction needs besides the machine, worked out once
+// per run
+struct context {
+    struct chip8 *chip8;
+    struct chip8_extended *extended;
+    uint8_t *memory;
+    uint32_t mask; // Memory size - 1
+    bool xo;
+};
+
+// switch the machine to a profile with extensions, the display starts
+// blank in low resolution and the program is loaded afterwards
+bool extended_enable(struct chip8 *chip8, enum chip8_profile profile)
+{
+    bool xo = profile == CHIP8_PROFILE_XO_CHIP;
+    struct chip8_extended *extended = calloc(1, sizeof(*extended) + (xo ? CHIP8_XO_MEMORY_SIZE : 0));
+
+    if (extended == NULL) {
+        return false;
+    }
+
+    extended_disable(chip8);
+    extended->hires = false;
+    extended->plane_mask = 1;
+
+    memcpy(chip8->memory + EXTENDED_BIG_FONT, big_font, sizeof(big_font));
+    chip8_invalidate(chip8, EXTENDED_BIG_FONT, sizeof(big_font));
+
+    // fonts and anything loaded so far carry over into the larger memory
+    if (xo) {
+        memcpy(extended->ram, chip8->memory, CHIP8_MEMORY_SIZE);
+    }
+
+    chip8->extended = extended;
+    chip8->profile = profile;
+    return true;
+}
+
+void extended_disable(struct chip8 *chip8)
+{
+    free(chip8->extended);
+    chip8->extended = NULL;
+    chip8->profile = CHIP8_PROFILE_CHIP8;
+}
+
+// XO-CHIP programs may fill all 64 KB
+bool extended_load(struct chip8 *chip8, const uint8_t *program, size_t size)
+{
+    if (size > CHIP8_XO_MEMORY_SIZE - PROGRAM_START) {
+        return false;
+    }
+
+    memcpy(chip8->extended->ram + PROGRAM_START, program, size);
+    return true;
+}
+
+static uint16_t fetch(const struct context *context, uint16_t address)
+{
+    return context->memory[address & context->mask] << 8 | context->memory[(address + 1) & context->mask];
+}
+
+// accesses that run past the end of memory wrap around after reporting it
+static bool check_range(struct context *context, uint32_t length)
+{
+    struct chip8 *chip8 = context->chip8;
+
+    return chip8->cpu.I + length <= context->mask + 1 || !chip8_trap(chip8, CHIP8_EVENT_MEMORY_RANGE, chip8->cpu.I);
+}
+
+// SUPER-CHIP shares memory, and with it the decode cache, with CHIP-8
+static void written(struct context *context, uint16_t address, uint16_t length)
+{
+    if (!context->xo) {
+        chip8_invalidate(context->chip8, address, length);
+    }
+}
+
+static int height(const struct chip8_extended *extended)
+{
+    return extended->hires ? CHIP8_HIRES_HEIGHT : CHIP8_HEIGHT;
+}
+
+static void clear(struct chip8_extended *extended, uint8_t planes)
+{
+    for (int plane = 0; plane < CHIP8_PLANE_COUNT; plane++) {
+        if (planes & (1 << plane)) {
+            memset(extended->planes[plane], 0, sizeof(extended->planes[plane]));
+        }
+    }
+}
+
+// scrolls move whole rows, by pixels of the current resolution
+static void scroll_down(struct chip8_extended *extended, int n)
+{
+    int rows = height(extended);
+
+    n = n < rows ? n : rows;
+
+    for (int plane = 0; plane < CHIP8_PLANE_COUNT; plane++) {
+        uint64_t(*row)[CHIP8_ROW_WORDS] = extended->planes[plane];
+
+        if (extended->plane_mask & (1 << plane)) {
+            memmove(row + n, row, (rows - n) * sizeof(*row));
+            memset(row, 0, n * sizeof(*row));
+        }
+    }
+}
+
+static void scroll_up(struct chip8_extended *extended, int n)
+{
+    int rows = height(extended);
+
+    n = n < rows ? n : rows;
+
+    for (int plane = 0; plane < CHIP8_PLANE_COUNT; plane++) {
+        uint64_t(*row)[CHIP8_ROW_WORDS] = extended->planes[plane];
+
+        if (extended->plane_mask & (1 << plane)) {
+            memmove(row, row + n, (rows - n) * sizeof(*row));
+            memset(row + rows - n, 0, n * sizeof(*row));
+        }
+    }
+}
+
+// a row is one word in low resolution and two in high resolution, with
+// the pixels shifted across from one word into the other
+static void scroll_right(struct chip8_extended *extended)
+{
+    for (int plane = 0; plane < CHIP8_PLANE_COUNT; plane++) {
+        if (!(extended->plane_mask & (1 << plane))) {
+            continue;
+        }
+
+        for (int y = 0; y < height(extended); y++) {
+            uint64_t *row = extended->planes[plane][y];
+
+            if (extended->hires) {
+                row[1] = row[1] >> SCROLL_STEP | row[0] << (64 - SCROLL_STEP);
+            }
+
+            row[0] >>= SCROLL_STEP;
+        }
+    }
+}
+
+static void scroll_left(struct chip8_extended *extended)
+{
+    for (int plane = 0; plane < CHIP8_PLANE_COUNT; plane++) {
+        if (!(extended->plane_mask & (1 << plane))) {
+            continue;
+        }
+
+        for (int y = 0; y < height(extended); y++) {
+            uint64_t *row = extended->planes[plane][y];
+
+            row[0] <<= SCROLL_STEP;
+
+            if (extended->hires) {
+                row[0] |= row[1] >> (64 - SCROLL_STEP);
+                row[1] <<= SCROLL_STEP;
+            }
+        }
+    }
+}
+
+// a sprite line of up to 16 pixels, left aligned in line, as the words of
+// a row with the sprite at column x. Pixels past the right edge wrap
+// around or are cut off.
+static void place(uint64_t line, unsigned int x, bool hires, bool wrap, uint64_t words[CHIP8_ROW_WORDS])
+{
+    uint64_t overflow; // Pixels past the edge, left aligned
+
+    if (!hires) {
+        words[0] = line >> x;
+        words[1] = 0;
+        overflow = x > 0 ? line << (64 - x) : 0;
+    } else if (x < 64) {
+        words[0] = line >> x;
+        words[1] = x > 0 ? line << (64 - x) : 0;
+        overflow = 0;
+    } else {
+        words[0] = 0;
+        words[1] = line >> (x - 64);
+        overflow = x > 64 ? line << (128 - x) : 0;
+    }
+
+    if (wrap) {
+        words[0] |= overflow;
+    }
+}
+
+// Dxyn on every selected plane, each taking its own sprite data in turn.
+// Dxy0 draws 16x16 sprites. SUPER-CHIP cuts sprites off at the edges,
+// XO-CHIP wraps them around.
+static void draw(struct context *context, const struct instruction *ins)
+{
+    struct chip8 *chip8 = context->chip8;
+    struct chip8_extended *extended = context->extended;
+    int width = extended->hires ? CHIP8_HIRES_WIDTH : CHIP8_WIDTH;
+    int rows = height(extended);
+    unsigned int x = chip8->cpu.V[ins->x] % width;
+    unsigned int y = chip8->cpu.V[ins->y] % rows;
+    int lines = ins->n != 0 ? ins->n : 16;
+    int bytes = ins->n != 0 ? 1 : 2;
+    uint16_t address = chip8->cpu.I;
+    uint64_t collision = 0;
+    uint32_t length = 0;
+
+    for (int plane = 0; plane < CHIP8_PLANE_COUNT; plane++) {
+        if (extended->plane_mask & (1 << plane)) {
+            length += lines * bytes;
+        }
+    }
+
+    if (!check_range(context, length)) {
+        return;
+    }
+
+    for (int plane = 0; plane < CHIP8_PLANE_COUNT; plane++) {
+        if (!(extended->plane_mask & (1 << plane))) {
+            continue;
+        }
+
+        for (int i = 0; i < lines; i++) {
+            uint64_t line = (uint64_t)context->memory[address & context->mask] << 56;
+
+            if (bytes == 2) {
+                line |= (uint64_t)context->memory[(address + 1) & context->mask] << 48;
+            }
+
+            address += bytes;
+
+            if (y + i >= (unsigned int)rows && !context->xo) {
+                continue;
+            }
+
+            uint64_t words[CHIP8_ROW_WORDS];
+            uint64_t *row = extended->planes[plane][(y + i) % rows];
+
+            place(line, x, extended->hires, context->xo, words);
+
+            for (int word = 0; word < CHIP8_ROW_WORDS; word++) {
+                collision |= row[word] & words[word];
+                row[word] ^= words[word];
+            }
+        }
+    }
+
+    chip8->cpu.V[0xf] = collision != 0;
+    chip8->draw = true;
+    chip8->cpu.pc += 2;
+}
+
+static void bcd(struct context *context, uint8_t value)
+{
+    struct chip8 *chip8 = context->chip8;
+    uint16_t address = chip8->cpu.I;
+
+    if (!check_range(context, 3)) {
+        return;
+    }
+
+    context->memory[address & context->mask] = value / 100;
+    context->memory[(address + 1) & context->mask] = value / 10 % 10;
+    context->memory[(address + 2) & context->mask] = value % 10;
+    written(context, address, 3);
+    chip8->cpu.pc += 2;
+}
+
+// Fx55 and Fx65, XO-CHIP leaves I after the registers and SUPER-CHIP
+// leaves it where it was
+static void transfer_registers(struct context *context, uint8_t last, bool store)
+{
+    struct chip8 *chip8 = context->chip8;
+    uint16_t address = chip8->cpu.I;
+
+    if (!check_range(context, last + 1)) {
+        return;
+    }
+
+    for (int i = 0; i <= last; i++) {
+        uint8_t *cell = &context->memory[(address + i) & context->mask];
+
+        if (store) {
+            *cell = chip8->cpu.V[i];
+        } else {
+            chip8->cpu.V[i] = *cell;
+        }
+    }
+
+    if (store) {
+        written(context, address, last + 1);
+    }
+
+    if (context->xo) {
+        chip8->cpu.I += last + 1;
+    }
+
+    chip8->cpu.pc += 2;
+}
+
+// 5xy2 and 5xy3, Vx to Vy in either direction, I stays where it is
+static void transfer_range(struct context *context, uint8_t x, uint8_t y, bool store)
+{
+    struct chip8 *chip8 = context->chip8;
+    uint16_t address = chip8->cpu.I;
+    int step = x <= y ? 1 : -1;
+    int count = (x <= y ? y - x : x - y) + 1;
+
+    if (!check_range(context, count)) {
+        return;
+    }
+
+    for (int i = 0; i < count; i++) {
+        uint8_t *cell = &context->memory[(address + i) & context->mask];
+        uint8_t *v = &chip8->cpu.V[x + i * step];
+
+        if (store) {
+            *cell = *v;
+        } else {
+            *v = *cell;
+        }
+    }
+
+    if (store) {
+        written(context, address, count);
+    }
+
+    chip8->cpu.pc += 2;
+}
+
+// the Fx instructions the extensions add or change, false for the rest
+static bool misc_instruction(struct context *context, const struct instruction *ins)
+{
+    struct chip8 *chip8 = context->chip8;
+    struct chip8_extended *extended = context->extended;
+    uint8_t *V = chip8->cpu.V;
+
+    switch (ins->kk) {
+    case 0x00:
+        // F000 nnnn loads a 16 bit address from the next word
+        if (!context->xo || ins->x != 0) {
+            return false;
+        }
+        chip8->cpu.I = fetch(context, chip8->cpu.pc + 2);
+        chip8->cpu.pc += 4;
+        return true;
+    case 0x01:
+        if (!context->xo) {
+            return false;
+        }
+        extended->plane_mask = ins->x & ((1 << CHIP8_PLANE_COUNT) - 1);
+        break;
+    case 0x02:
+        if (!context->xo || ins->x != 0) {
+            return false;
+        }
+        if (!check_range(context, EXTENDED_PATTERN_SIZE)) {
+            return true;
+        }
+        for (int i = 0; i < EXTENDED_PATTERN_SIZE; i++) {
+            extended->pattern[i] = context->memory[(chip8->cpu.I + i) & context->mask];
+        }
+        break;
+    case 0x1e:
+        // I covers all of memory, so there is nothing to flag
+        if (!context->xo) {
+            return false;
+        }
+        chip8->cpu.I += V[ins->x];
+        break;
+    case 0x30:
+        chip8->cpu.I = EXTENDED_BIG_FONT + (V[ins->x] & 0xf) * 10;
+        break;
+    case 0x33:
+        bcd(context, V[ins->x]);
+        return true;
+    case 0x3a:
+        if (!context->xo) {
+            return false;
+        }
+        extended->pitch = V[ins->x];
+        break;
+    case 0x55:
+        transfer_registers(context, ins->x, true);
+        return true;
+    case 0x65:
+        transfer_registers(context, ins->x, false);
+        return true;
+    case 0x75:
+        memcpy(extended->flags, V, ins->x + 1);
+        break;
+    case 0x85:
+        memcpy(V, extended->flags, ins->x + 1);
+        break;
+    default:
+        return false;
+    }
+
+    chip8->cpu.pc += 2;
+    return true;
+}
+
+// the 00xx instructions the extensions add or change, false for the rest
+static bool display_instruction(struct context *context, uint16_t opcode)
+{
+    struct chip8 *chip8 = context->chip8;
+    struct chip8_extended *extended = context->extended;
+
+    if ((opcode & 0xfff0) == 0x00c0) {
+        scroll_down(extended, opcode & 0xf);
+    } else if (context->xo && (opcode & 0xfff0) == 0x00d0) {
+        scroll_up(extended, opcode & 0xf);
+    } else if (opcode == 0x00e0) {
+        clear(extended, extended->plane_mask);
+    } else if (opcode == 0x00fb) {
+        scroll_right(extended);
+    } else if (opcode == 0x00fc) {
+        scroll_left(extended);
+    } else if (opcode == 0x00fd) {
+        // exit, the machine stays on the instruction
+        chip8->halted = true;
+        return true;
+    } else if (opcode == 0x00fe || opcode == 0x00ff) {
+        extended->hires = opcode == 0x00ff;
+        clear(extended, (1 << CHIP8_PLANE_COUNT) - 1);
+    } else {
+        return false;
+    }
+
+    chip8->draw = true;
+    chip8->cpu.pc += 2;
+    return true;
+}
+
+static bool is_skip(uint8_t kind)
+{
+    return kind == OP_SKIP_EQUAL || kind == OP_SKIP_NOT_EQUAL
+        || kind == OP_SKIP_REGISTERS_EQUAL || kind == OP_SKIP_REGISTERS_NOT_EQUAL
+        || kind == OP_SKIP_KEY_PRESSED || kind == OP_SKIP_KEY_NOT_PRESSED;
+}
+
+static void step(struct context *context)
+{
+    struct chip8 *chip8 = context->chip8;
+    uint16_t pc = chip8->cpu.pc;
+    uint16_t opcode = fetch(context, pc);
+    struct instruction ins;
+
+    opcode_decode(opcode, &ins);
+
+    switch (opcode & 0xf000) {
+    case 0x0000:
+        if (display_instruction(context, opcode)) {
+            return;
+        }
+        break;
+    case 0x5000:
+        if (context->xo && (ins.n == 2 || ins.n == 3)) {
+            transfer_range(context, ins.x, ins.y, ins.n == 2);
+            return;
+        }
+        break;
+    case 0xb000:
+        // SUPER-CHIP jumps by Vx rather than V0
+        if (!context->xo) {
+            chip8->cpu.pc = ins.nnn + chip8->cpu.V[ins.x];
+            return;
+        }
+        break;
+    case 0xd000:
+        draw(context, &ins);
+        return;
+    case 0xf000:
+        if (misc_instruction(context, &ins)) {
+            return;
+        }
+        break;
+    }
+
+    if (ins.kind == OP_UNKNOWN) {
+        if (!chip8_trap(chip8, CHIP8_EVENT_ILLEGAL_OPCODE, opcode)) {
+            chip8->cpu.pc += 2;
+        }
+        return;
+    }
+
+    opcode_handlers[ins.kind](chip8, &ins);
+
+    // XO-CHIP skips step over all four bytes of F000 nnnn
+    if (context->xo && is_skip(ins.kind) && chip8->cpu.pc == (uint16_t)(pc + 4) && fetch(context, pc + 2) == 0xf000) {
+        chip8->cpu.pc += 2;
+    }
+}
+
+void extended_run(struct chip8 *chip8, unsigned long count)
+{
+    struct context context = {
+        .chip8 = chip8,
+        .extended = chip8->extended,
+        .xo = chip8->profile == CHIP8_PROFILE_XO_CHIP
+    };
+
+    context.memory = context.xo ? context.extended->ram : chip8->memory;
+    context.mask = (context.xo ? CHIP8_XO_MEMORY_SIZE : CHIP8_MEMORY_SIZE) - 1;
+
+    while (count > 0) {
+        step(&context);
+        count -= 1;
+
+        if (chip8->halted) {
+            return;
+        }
+    }
+}
+
+void extended_get_display(const struct chip8 *chip8, struct chip8_display *display)
+{
+    const struct chip8_extended *extended = chip8->extended;
+
+    display->width = extended->hires ? CHIP8_HIRES_WIDTH : CHIP8_WIDTH;
+    display->height = height(extended);
+    memcpy(display->planes, extended->planes, sizeof(display->planes));
+}
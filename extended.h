@@ -0,0 +1,32 @@
+#ifndef EXTENDED_H
+#define EXTENDED_H
+
+#include "chip8.h"
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#define EXTENDED_BIG_FONT 0x50 // Address of the 8x10 digits, after the small font
+#define EXTENDED_FLAG_COUNT 16
+#define EXTENDED_PATTERN_SIZE 16
+
+// State of SUPER-CHIP and XO-CHIP machines on top of struct chip8, which
+// keeps the registers, stack, timers and keypad. SUPER-CHIP runs in the
+// machine's own memory, XO-CHIP in ram, which is allocated along with it.
+struct chip8_extended {
+    uint64_t planes[CHIP8_PLANE_COUNT][CHIP8_HIRES_HEIGHT][CHIP8_ROW_WORDS]; // As in struct chip8_display
+    bool hires;
+    uint8_t plane_mask; // Planes drawn, cleared and scrolled (Fn01)
+    uint8_t flags[EXTENDED_FLAG_COUNT]; // Saved by Fx75 and restored by Fx85
+    uint8_t pattern[EXTENDED_PATTERN_SIZE]; // Audio pattern loaded by F002
+    uint8_t pitch; // Set by Fx3A
+    uint8_t ram[]; // CHIP8_XO_MEMORY_SIZE bytes for XO-CHIP, absent otherwise
+};
+
+bool extended_enable(struct chip8 *chip8, enum chip8_profile profile);
+void extended_disable(struct chip8 *chip8);
+bool extended_load(struct chip8 *chip8, const uint8_t *program, size_t size);
+void extended_run(struct chip8 *chip8, unsigned long count);
+void extended_get_display(const struct chip8 *chip8, struct chip8_display *display);
+
+#endif
@@ -0,0 +1,198 @@
+#define _POSIX_C_SOURCE 200809L
+
+#include "chip8.h"
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+// Fuzz target for the core, see make fuzz. An input is a ROM plus how to
+// run it, and every part of it is taken as it comes:
+//
+//     byte 0    machine: profile in bits 0-1 (modulo 3), quirk set in
+//               bits 2-3 (CHIP-8 only)
+//     byte 1    frames to run, 1 + the low 6 bits
+//     byte 2    instructions per frame, 1 + the low 5 bits
+//     byte 3    key changes that follow, the low 4 bits
+//     2 each    key change: frame, then key in the low nibble and pressed
+//               in bit 4
+//     the rest  the ROM
+//
+// so a run is a few thousand instructions at most. Machines start from a
+// copy of the memory chip8_init leaves rather than from chip8_init itself,
+// which keeps a run in the microseconds.
+
+#define USAGE "Usage: chip8-fuzz [-n runs] [-s seed] [file...]"
+
+#define HEADER_SIZE 4
+#define KEY_CHANGE_SIZE 2
+#define MAX_RANDOM_SIZE 512 // Largest input the standalone driver makes up
+
+static struct chip8 chip8;
+static uint8_t pristine[CHIP8_MEMORY_SIZE]; // Memory after chip8_init
+static bool started;
+
+int LLVMFuzzerTestOneInput(const uint8_t *data, size_t size)
+{
+    if (size < HEADER_SIZE) {
+        return 0;
+    }
+
+    if (!started) {
+        chip8_init(&chip8);
+        memcpy(pristine, chip8.memory, sizeof(pristine));
+        started = true;
+    }
+
+    enum chip8_profile profile = (data[0] & 3) % CHIP8_PROFILE_COUNT;
+    enum chip8_quirks quirks = (data[0] >> 2) & 3;
+    int frames = 1 + (data[1] & 63);
+    int instructions_per_frame = 1 + (data[2] & 31);
+    size_t key_changes = data[3] & 15;
+    const uint8_t *keys = data + HEADER_SIZE;
+
+    if (size < HEADER_SIZE + key_changes * KEY_CHANGE_SIZE) {
+        return 0;
+    }
+
+    const uint8_t *program = keys + key_changes * KEY_CHANGE_SIZE;
+    size_t program_size = size - (program - data);
+
+    // the previous run's cache and extended state are freed before reset
+    // forgets them
+    chip8_release(&chip8);
+    chip8_init_image(&chip8, pristine);
+
+    if (!chip8_set_profile(&chip8, profile) || !chip8_load(&chip8, program, program_size)) {
+        return 0;
+    }
+
+    if (profile == CHIP8_PROFILE_CHIP8) {
+        chip8_set_quirks(&chip8, quirks);
+    }
+
+    chip8.instructions_per_frame = instructions_per_frame;
+
+    for (int frame = 0; frame < frames; frame++) {
+        for (size_t i = 0; i < key_changes; i++) {
+            if (keys[i * KEY_CHANGE_SIZE] == frame) {
+                uint8_t change = keys[i * KEY_CHANGE_SIZE + 1];
+
+                chip8_set_key(&chip8, change & 0xF, (change & 0x10) != 0);
+            }
+        }
+
+        chip8_emulate_frame(&chip8);
+
+        struct chip8_event event;
+
+        while (chip8_poll_event(&chip8, &event)) {
+        }
+    }
+
+    struct chip8_display display;
+
+    chip8_get_display(&chip8, &display);
+    return 0;
+}
+
+// libFuzzer brings its own main; this one is for compilers without it. It
+// runs the files given, to reproduce a crash, then as many random inputs
+// as asked for and reports how fast they went.
+#ifndef CHIP8_LIBFUZZER
+
+static uint64_t next_random(uint64_t *state)
+{
+    *state ^= *state >> 12;
+    *state ^= *state << 25;
+    *state ^= *state >> 27;
+    return *state * 0x2545F4914F6CDD1DULL;
+}
+
+static bool run_file(const char *path)
+{
+    FILE *file = fopen(path, "rb");
+
+    if (file == NULL) {
+        return false;
+    }
+
+    static uint8_t data[CHIP8_XO_MEMORY_SIZE];
+    size_t size = fread(data, 1, sizeof(data), file);
+    bool read = !ferror(file);
+
+    fclose(file);
+
+    if (read) {
+        LLVMFuzzerTestOneInput(data, size);
+    }
+
+    return read;
+}
+
+int main(int argc, char *argv[])
+{
+    unsigned long runs = 0;
+    uint64_t seed = 1;
+    int opt;
+
+    while ((opt = getopt(argc, argv, "n:s:")) != -1) {
+        switch (opt) {
+        case 'n':
+            runs = strtoul(optarg, NULL, 10);
+            break;
+        case 's':
+            seed = strtoull(optarg, NULL, 0);
+            break;
+        default:
+            puts(USAGE);
+            return 0;
+        }
+    }
+
+    if (optind >= argc && runs == 0) {
+        puts(USAGE);
+        return 0;
+    }
+
+    for (int i = optind; i < argc; i++) {
+        if (!run_file(argv[i])) {
+            fprintf(stderr, "Could not read input: %s\n", argv[i]);
+            return -1;
+        }
+    }
+
+    if (runs == 0) {
+        return 0;
+    }
+
+    // xorshift never leaves zero
+    uint64_t state = seed != 0 ? seed : 1;
+    uint8_t data[MAX_RANDOM_SIZE];
+    struct timespec start;
+    struct timespec end;
+
+    clock_gettime(CLOCK_MONOTONIC, &start);
+
+    for (unsigned long run = 0; run < runs; run++) {
+        size_t size = next_random(&state) % sizeof(data);
+
+        for (size_t i = 0; i < size; i++) {
+            data[i] = next_random(&state);
+        }
+
+        LLVMFuzzerTestOneInput(data, size);
+    }
+
+    clock_gettime(CLOCK_MONOTONIC, &end);
+
+    double seconds = (end.tv_sec - start.tv_sec) + (end.tv_nsec - start.tv_nsec) / 1e9;
+
+    printf("%lu runs in %.2f s, %.0f per second\n", runs, seconds, runs / seconds);
+    return 0;
+}
+
+#endif
@@ -0,0 +1,160 @@
+#include "handoff.h"
+#include <string.h>
+
+#define FRESH 0x4 // Middle slot holds a frame the reader has not taken
+#define SLOT_MASK 0x3
+
+void frame_buffer_init(struct frame_buffer *buffer)
+{
+    memset(buffer->frames, 0, sizeof(buffer->frames));
+    buffer->back = 0;
+    atomic_init(&buffer->middle, 1);
+    buffer->front = 2;
+}
+
+// writer only, the slot to draw the next frame into
+struct chip8_display *frame_buffer_back(struct frame_buffer *buffer)
+{
+    return &buffer->frames[buffer->back];
+}
+
+// writer only, hand the back slot over and take the middle one in exchange
+void frame_buffer_publish(struct frame_buffer *buffer)
+{
+    unsigned int old = atomic_exchange_explicit(&buffer->middle, buffer->back | FRESH, memory_order_acq_rel);
+    buffer->back = old & SLOT_MASK;
+}
+
+// reader only, the newest frame if one arrived since the last call
+const struct chip8_display *frame_buffer_acquire(struct frame_buffer *buffer)
+{
+    if (!(atomic_load_explicit(&buffer->middle, memory_order_relaxed) & FRESH)) {
+        return NULL;
+    }
+
+    unsigned int old = atomic_exchange_explicit(&buffer->middle, buffer->front, memory_order_acq_rel);
+    buffer->front = old & SLOT_MASK;
+    return &buffer->frames[buffer->front];
+}
+
+void key_queue_init(struct key_queue *queue)
+{
+    atomic_init(&queue->head, 0);
+    atomic_init(&queue->tail, 0);
+    atomic_init(&queue->waiting, false);
+    pthread_mutex_init(&queue->lock, NULL);
+    pthread_cond_init(&queue->changed, NULL);
+    queue->closed = false;
+}
+
+void key_queue_destroy(struct key_queue *queue)
+{
+    pthread_cond_destroy(&queue->changed);
+    pthread_mutex_destroy(&queue->lock);
+}
+
+// producer only, fails when the consumer has fallen a whole queue behind
+bool key_queue_push(struct key_queue *queue, uint64_t time, uint8_t key, bool pressed)
+{
+    size_t tail = atomic_load_explicit(&queue->tail, memory_order_relaxed);
+
+    if (tail - atomic_load_explicit(&queue->head, memory_order_acquire) == KEY_QUEUE_SIZE) {
+        return false;
+    }
+
+    queue->events[tail % KEY_QUEUE_SIZE] = (struct key_event) {
+        .time = time,
+        .key = key,
+        .pressed = pressed
+    };
+
+    atomic_store_explicit(&queue->tail, tail + 1, memory_order_release);
+
+    // either the consumer sees the new tail before it sleeps, or this sees
+    // it waiting; it holds the lock until it sleeps, so the signal lands
+    atomic_thread_fence(memory_order_seq_cst);
+
+    if (atomic_load_explicit(&queue->waiting, memory_order_relaxed)) {
+        pthread_mutex_lock(&queue->lock);
+        pthread_cond_signal(&queue->changed);
+        pthread_mutex_unlock(&queue->lock);
+    }
+    return true;
+}
+
+// consumer only
+bool key_queue_pop(struct key_queue *queue, struct key_event *event)
+{
+    size_t head = atomic_load_explicit(&queue->head, memory_order_relaxed);
+
+    if (head == atomic_load_explicit(&queue->tail, memory_order_acquire)) {
+        return false;
+    }
+
+    *event = queue->events[head % KEY_QUEUE_SIZE];
+    atomic_store_explicit(&queue->head, head + 1, memory_order_release);
+    return true;
+}
+
+// consumer only, sleep until there is an event to pop or the queue closes
+void key_queue_wait(struct key_queue *queue)
+{
+    pthread_mutex_lock(&queue->lock);
+    atomic_store_explicit(&queue->waiting, true, memory_order_relaxed);
+    atomic_thread_fence(memory_order_seq_cst);
+
+    while (!queue->closed
+        && atomic_load_explicit(&queue->head, memory_order_relaxed) == atomic_load_explicit(&queue->tail, memory_order_acquire)) {
+        pthread_cond_wait(&queue->changed, &queue->lock);
+    }
+
+    atomic_store_explicit(&queue->waiting, false, memory_order_relaxed);
+    pthread_mutex_unlock(&queue->lock);
+}
+
+// wake the consumer for good, it stops waiting from now on
+void key_queue_close(struct key_queue *queue)
+{
+    pthread_mutex_lock(&queue->lock);
+    queue->closed = true;
+    pthread_cond_broadcast(&queue->changed);
+    pthread_mutex_unlock(&queue->lock);
+}
+
+void tone_queue_init(struct tone_queue *queue)
+{
+    atomic_init(&queue->head, 0);
+    atomic_init(&queue->tail, 0);
+}
+
+// producer only, fails when the consumer has fallen a whole queue behind
+bool tone_queue_push(struct tone_queue *queue, uint64_t time, bool on)
+{
+    size_t tail = atomic_load_explicit(&queue->tail, memory_order_relaxed);
+
+    if (tail - atomic_load_explicit(&queue->head, memory_order_acquire) == TONE_QUEUE_SIZE) {
+        return false;
+    }
+
+    queue->edges[tail % TONE_QUEUE_SIZE] = (struct tone_edge) {
+        .time = time,
+        .on = on
+    };
+
+    atomic_store_explicit(&queue->tail, tail + 1, memory_order_release);
+    return true;
+}
+
+// consumer only
+bool tone_queue_pop(struct tone_queue *queue, struct tone_edge *edge)
+{
+    size_t head = atomic_load_explicit(&queue->head, memory_order_relaxed);
+
+    if (head == atomic_load_explicit(&queue->tail, memory_order_acquire)) {
+        return false;
+    }
+
+    *edge = queue->edges[head % TONE_QUEUE_SIZE];
+    atomic_store_explicit(&queue->head, head + 1, memory_order_release);
+    return true;
+}
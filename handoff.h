@@ -0,0 +1,76 @@
+#ifndef HANDOFF_H
+#define HANDOFF_H
+
+#include "chip8.h"
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stdint.h>
+
+#define KEY_QUEUE_SIZE 64 // Power of two
+#define TONE_QUEUE_SIZE 64 // Power of two
+#define HANDOFF_CACHE_LINE 64
+
+// Triple buffer passing finished displays from the emulation thread to the
+// render thread. The writer always has a slot of its own to fill and never
+// waits, the reader always gets the newest complete frame.
+struct frame_buffer {
+    struct chip8_display frames[3];
+    _Alignas(HANDOFF_CACHE_LINE) atomic_uint middle; // Slot being handed over, plus the fresh bit
+    _Alignas(HANDOFF_CACHE_LINE) unsigned int back; // Writer's slot
+    _Alignas(HANDOFF_CACHE_LINE) unsigned int front; // Reader's slot
+};
+
+// A key changing state
+struct key_event {
+    uint64_t time; // When it happened, on the scheduler's clock (ns)
+    uint8_t key;
+    bool pressed;
+};
+
+// Single producer, single consumer queue of key events from the render
+// thread to the emulation thread. Pushing and popping never wait, the lock
+// is only there for a consumer with nothing to do to sleep on, and the
+// producer only takes it when the consumer says it is asleep.
+struct key_queue {
+    struct key_event events[KEY_QUEUE_SIZE];
+    _Alignas(HANDOFF_CACHE_LINE) atomic_size_t head; // Next event to read
+    _Alignas(HANDOFF_CACHE_LINE) atomic_size_t tail; // Next slot to write
+    atomic_bool waiting; // Consumer is in key_queue_wait
+    pthread_mutex_t lock;
+    pthread_cond_t changed; // Signalled on a push while waiting, and on close
+    bool closed;
+};
+
+// The tone starting or stopping
+struct tone_edge {
+    uint64_t time; // When it happened, on the scheduler's clock (ns)
+    bool on;
+};
+
+// Single producer, single consumer queue of tone edges from the emulation
+// thread to the audio callback. Neither side ever waits, locks or
+// allocates, the callback runs on a thread that must not be held up.
+struct tone_queue {
+    struct tone_edge edges[TONE_QUEUE_SIZE];
+    _Alignas(HANDOFF_CACHE_LINE) atomic_size_t head; // Next edge to read
+    _Alignas(HANDOFF_CACHE_LINE) atomic_size_t tail; // Next slot to write
+};
+
+void frame_buffer_init(struct frame_buffer *buffer);
+struct chip8_display *frame_buffer_back(struct frame_buffer *buffer);
+void frame_buffer_publish(struct frame_buffer *buffer);
+const struct chip8_display *frame_buffer_acquire(struct frame_buffer *buffer);
+
+void key_queue_init(struct key_queue *queue);
+void key_queue_destroy(struct key_queue *queue);
+bool key_queue_push(struct key_queue *queue, uint64_t time, uint8_t key, bool pressed);
+bool key_queue_pop(struct key_queue *queue, struct key_event *event);
+void key_queue_wait(struct key_queue *queue);
+void key_queue_close(struct key_queue *queue);
+
+void tone_queue_init(struct tone_queue *queue);
+bool tone_queue_push(struct tone_queue *queue, uint64_t time, bool on);
+bool tone_queue_pop(struct tone_queue *queue, struct tone_edge *edge);
+
+#endif
@@ -0,0 +1,335 @@
+#define _POSIX_C_SOURCE 200809L
+
+#include "capture.h"
+#include "chip8.h"
+#include "input.h"
+#include "profile.h"
+#include "stats.h"
+#include <stdbool.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+
+#define USAGE "Usage: chip8-headless [-j] [-T] [-x] [-m chip8|schip|xochip] [-q modern|vip|chip48|schip] [-f frames] [-i instructions per frame] [-s seed] [-r input log] [-S statistics] [-p profile] [-P sample interval] [-y symbols] [-c capture.y4m|capture.c8v] file"
+
+#define DEFAULT_FRAMES 600
+#define STATS_INTERVAL 600 // Frames between statistics dumps
+
+void report_events(struct chip8 *chip8, long frame);
+void dump_state(const struct chip8 *chip8, unsigned long frames);
+
+int main(int argc, char *argv[])
+{
+    bool jit = false;
+    bool specialized = false;
+    bool halt_on_fault = false;
+    enum chip8_profile machine = CHIP8_PROFILE_CHIP8;
+    enum chip8_quirks quirks = CHIP8_QUIRKS_MODERN;
+    long frames = DEFAULT_FRAMES;
+    long instructions_per_frame = CHIP8_DEFAULT_INSTRUCTIONS_PER_FRAME;
+    unsigned long long seed = CHIP8_DEFAULT_SEED;
+    const char *log_path = NULL;
+    const char *stats_path = NULL;
+    const char *profile_path = NULL;
+    const char *symbols_path = NULL;
+    const char *capture_path = NULL;
+    long sample_interval = PROFILE_DEFAULT_INTERVAL;
+    bool frames_set = false;
+    bool clock_set = false;
+    bool seed_set = false;
+    int opt;
+
+    while ((opt = getopt(argc, argv, "jTxm:q:f:i:s:r:S:p:P:y:c:")) != -1) {
+        switch (opt) {
+        case 'j':
+            jit = true;
+            break;
+        case 'T':
+            specialized = true;
+            break;
+        case 'x':
+            halt_on_fault = true;
+            break;
+        case 'm':
+            if (!chip8_find_profile(optarg, &machine)) {
+                puts(USAGE);
+                return 0;
+            }
+            break;
+        case 'q':
+            if (!chip8_find_quirks(optarg, &quirks)) {
+                puts(USAGE);
+                return 0;
+            }
+            break;
+        case 'f':
+            frames = strtol(optarg, NULL, 10);
+            frames_set = true;
+            break;
+        case 'i':
+            instructions_per_frame = strtol(optarg, NULL, 10);
+            clock_set = true;
+            break;
+        case 's':
+            seed = strtoull(optarg, NULL, 0);
+            seed_set = true;
+            break;
+        case 'r':
+            log_path = optarg;
+            break;
+        case 'S':
+            stats_path = optarg;
+            break;
+        case 'p':
+            profile_path = optarg;
+            break;
+        case 'P':
+            sample_interval = strtol(optarg, NULL, 10);
+            break;
+        case 'y':
+            symbols_path = optarg;
+            break;
+        case 'c':
+            capture_path = optarg;
+            break;
+        default:
+            puts(USAGE);
+            return 0;
+        }
+    }
+
+    // a recorded session replays with the settings it was recorded with,
+    // unless they are given explicitly
+    struct input_script log;
+
+    input_script_init(&log, seed, 0);
+
+    if (log_path != NULL) {
+        if (!input_script_load(&log, log_path)) {
+            fprintf(stderr, "Could not load input log: %s\n", log_path);
+            return -1;
+        }
+
+        if (!seed_set) {
+            seed = log.seed;
+        }
+
+        if (!clock_set && log.instructions_per_frame != 0) {
+            instructions_per_frame = log.instructions_per_frame;
+        }
+
+        if (!frames_set && log.frames != 0) {
+            frames = log.frames;
+        }
+    }
+
+    if (optind >= argc || frames < 0 || instructions_per_frame < 1 || instructions_per_frame > UINT16_MAX || sample_interval < 1 || sample_interval > UINT32_MAX) {
+        puts(USAGE);
+        input_script_free(&log);
+        return 0;
+    }
+
+    const char *path = argv[optind];
+
+    // create chip8 emulator
+    static struct chip8 chip8;
+    chip8_init(&chip8);
+
+    if (!chip8_set_profile(&chip8, machine)) {
+        fputs("Could not allocate the machine\n", stderr);
+        return -1;
+    }
+
+    if (!chip8_load_file(&chip8, path)) {
+        fprintf(stderr, "Could not load file: %s\n", path);
+        return -1;
+    }
+
+    chip8.instructions_per_frame = instructions_per_frame;
+    chip8_seed(&chip8, seed);
+
+    if (quirks != CHIP8_QUIRKS_MODERN && !chip8_set_quirks(&chip8, quirks)) {
+        fputs("Quirk sets only cover CHIP-8, running the machine's own behaviour instead\n", stderr);
+        quirks = CHIP8_QUIRKS_MODERN;
+    }
+
+    if (machine != CHIP8_PROFILE_CHIP8 && (jit || specialized || stats_path != NULL)) {
+        fputs("The JIT, specialized handlers and statistics only cover CHIP-8, interpreting instead\n", stderr);
+        jit = false;
+        specialized = false;
+        stats_path = NULL;
+    }
+
+    if (quirks != CHIP8_QUIRKS_MODERN && (jit || specialized)) {
+        fputs("The JIT and specialized handlers only run the modern quirks, interpreting instead\n", stderr);
+        jit = false;
+        specialized = false;
+    }
+
+    if (jit && !chip8_enable_jit(&chip8)) {
+        fputs("JIT is not supported on this platform, interpreting instead\n", stderr);
+    }
+
+    if (specialized && !chip8_enable_specialized(&chip8)) {
+        fputs("Specialized handlers are not compiled in, build with make SPECIALIZED=1\n", stderr);
+    }
+
+    if (stats_path != NULL && !stats_enable(&chip8)) {
+        fputs("Statistics are not compiled in, build with make STATS=1\n", stderr);
+        stats_path = NULL;
+    }
+
+    // stop where the ROM goes wrong rather than carrying on past it
+    if (halt_on_fault) {
+        chip8_set_trap_policy(&chip8, CHIP8_EVENT_ILLEGAL_OPCODE, CHIP8_TRAP_HALT);
+        chip8_set_trap_policy(&chip8, CHIP8_EVENT_STACK_OVERFLOW, CHIP8_TRAP_HALT);
+        chip8_set_trap_policy(&chip8, CHIP8_EVENT_STACK_UNDERFLOW, CHIP8_TRAP_HALT);
+        chip8_set_trap_policy(&chip8, CHIP8_EVENT_MEMORY_RANGE, CHIP8_TRAP_HALT);
+        chip8_set_trap_policy(&chip8, CHIP8_EVENT_KEY_RANGE, CHIP8_TRAP_HALT);
+    }
+
+    struct profile *profile = NULL;
+
+    if (profile_path != NULL) {
+        profile = profile_create(sample_interval);
+
+        if (profile == NULL) {
+            fputs("Could not start the profiler\n", stderr);
+            return -1;
+        }
+
+        if (symbols_path != NULL && !profile_load_symbols(profile, symbols_path)) {
+            fprintf(stderr, "Could not load symbols: %s\n", symbols_path);
+            return -1;
+        }
+    }
+
+    // a .y4m file gets video an encoder can read, anything else the
+    // smaller native format chip8-y4m converts
+    struct capture *capture = NULL;
+
+    if (capture_path != NULL) {
+        size_t length = strlen(capture_path);
+        bool y4m = length >= 4 && strcmp(capture_path + length - 4, ".y4m") == 0;
+
+        capture = capture_open(capture_path, y4m ? CAPTURE_Y4M : CAPTURE_NATIVE, &chip8);
+
+        if (capture == NULL) {
+            fprintf(stderr, "Could not open capture: %s\n", capture_path);
+            return -1;
+        }
+    }
+
+    // run as fast as possible, no display or pacing
+    size_t next_event = 0;
+    long frame;
+
+    for (frame = 0; frame < frames && !chip8.halted; frame++) {
+        next_event = input_script_apply(&log, next_event, frame, &chip8);
+
+        if (profile != NULL) {
+            profile_emulate_frame(profile, &chip8);
+        } else {
+            chip8_emulate_frame(&chip8);
+        }
+
+        report_events(&chip8, frame);
+
+        if (capture != NULL) {
+            capture_frame(capture, &chip8);
+        }
+
+        // keep the file current for long runs
+        if (stats_path != NULL && (frame + 1) % STATS_INTERVAL == 0) {
+            stats_dump(chip8.stats, stats_path);
+        }
+    }
+
+    dump_state(&chip8, frame);
+
+    if (capture != NULL && !capture_close(capture)) {
+        fprintf(stderr, "Could not write capture: %s\n", capture_path);
+    }
+
+    chip8_release(&chip8);
+    input_script_free(&log);
+
+    if (stats_path != NULL) {
+        if (!stats_dump(chip8.stats, stats_path)) {
+            fprintf(stderr, "Could not write statistics: %s\n", stats_path);
+        }
+
+        stats_disable(&chip8);
+    }
+
+    if (profile != NULL) {
+        FILE *file = fopen(profile_path, "w");
+
+        if (file == NULL || !profile_write_folded(profile, file) || fclose(file) != 0) {
+            fprintf(stderr, "Could not write profile: %s\n", profile_path);
+        }
+
+        profile_destroy(profile);
+    }
+
+    return 0;
+}
+
+// print the events raised during a frame, sound is of no interest here
+void report_events(struct chip8 *chip8, long frame)
+{
+    struct chip8_event event;
+
+    while (chip8_poll_event(chip8, &event)) {
+        if (event.kind != CHIP8_EVENT_SOUND_START && event.kind != CHIP8_EVENT_SOUND_STOP) {
+            fprintf(stderr, "frame %ld: %s at %03X (%X)\n", frame, chip8_event_name(event.kind), event.pc, event.detail);
+        }
+    }
+}
+
+// print the machine state after the run in a stable, diffable format
+void dump_state(const struct chip8 *chip8, unsigned long frames)
+{
+    const struct cpu *cpu = &chip8->cpu;
+
+    printf("frames %lu\n", frames);
+
+    if (chip8->halted) {
+        printf("halted\n");
+    }
+
+    printf("pc %03X\n", cpu->pc);
+    printf("I %03X\n", cpu->I);
+    printf("sp %X\n", cpu->sp);
+    printf("delay %u\n", chip8->delay_timer);
+    printf("sound %u\n", chip8->sound_timer);
+
+    printf("V");
+    for (int i = 0; i < 16; i++) {
+        printf(" %02X", cpu->V[i]);
+    }
+    printf("\n");
+
+    printf("stack");
+    for (int i = 0; i < 16; i++) {
+        printf(" %03X", cpu->stack[i]);
+    }
+    printf("\n");
+
+    // one character per pixel for the planes lit, at the current resolution
+    static const char shades[1 << CHIP8_PLANE_COUNT] = { '.', '#', '+', '@' };
+    struct chip8_display display;
+
+    chip8_get_display(chip8, &display);
+
+    for (int y = 0; y < display.height; y++) {
+        char row[CHIP8_HIRES_WIDTH + 1];
+
+        for (int x = 0; x < display.width; x++) {
+            row[x] = shades[chip8_pixel(chip8, x, y)];
+        }
+        row[display.width] = '\0';
+
+        puts(row);
+    }
+}
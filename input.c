@@ -0,0 +1,278 @@
+#include "input.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define MAX_LINE 256
+
+// Recorded sessions are stored as a binary log: the magic, a version byte,
+// the seed (8 bytes), frame count (4) and clock (2), all little endian, then
+// one entry per key change: the frames since the previous change as a
+// varint, and a byte holding the key with bit 4 set when pressed. A typical
+// change takes two bytes.
+#define LOG_MAGIC "C8IN"
+#define LOG_VERSION 1
+#define LOG_HEADER_SIZE 19
+#define LOG_PRESSED 0x10
+
+// parse one "<frame> <key> <down|up>" line, keys are hexadecimal
+static bool parse_event(const char *line, struct input_event *event)
+{
+    unsigned long frame;
+    unsigned int key;
+    char action[8];
+
+    if (sscanf(line, "%lu %x %7s", &frame, &key, action) != 3 || key > 0xf || frame > UINT32_MAX) {
+        return false;
+    }
+
+    if (strcmp(action, "down") == 0) {
+        event->pressed = true;
+    } else if (strcmp(action, "up") == 0) {
+        event->pressed = false;
+    } else {
+        return false;
+    }
+
+    event->frame = frame;
+    event->key = key;
+    return true;
+}
+
+void input_script_init(struct input_script *script, uint64_t seed, uint16_t instructions_per_frame)
+{
+    script->events = NULL;
+    script->count = 0;
+    script->capacity = 0;
+    script->seed = seed;
+    script->frames = 0;
+    script->instructions_per_frame = instructions_per_frame;
+}
+
+// room for one more event at the end
+static struct input_event *append_event(struct input_script *script)
+{
+    if (script->count == script->capacity) {
+        size_t capacity = script->capacity ? script->capacity * 2 : 64;
+        struct input_event *events = realloc(script->events, capacity * sizeof(*events));
+
+        if (events == NULL) {
+            return NULL;
+        }
+
+        script->events = events;
+        script->capacity = capacity;
+    }
+
+    return &script->events[script->count++];
+}
+
+// blank lines and lines starting with '#' are skipped
+static bool read_text(struct input_script *script, FILE *file)
+{
+    char line[MAX_LINE];
+
+    while (fgets(line, sizeof(line), file) != NULL) {
+        const char *start = line + strspn(line, " \t");
+
+        if (*start == '#' || *start == '\n' || *start == '\0') {
+            continue;
+        }
+
+        struct input_event *event = append_event(script);
+
+        // events must be listed in frame order
+        if (event == NULL || !parse_event(start, event)
+            || (script->count > 1 && event->frame < event[-1].frame)) {
+            return false;
+        }
+    }
+
+    return true;
+}
+
+static uint64_t get_le(const uint8_t *in, int size)
+{
+    uint64_t value = 0;
+
+    for (int i = size - 1; i >= 0; i--) {
+        value = value << 8 | in[i];
+    }
+
+    return value;
+}
+
+static uint8_t *put_le(uint8_t *out, uint64_t value, int size)
+{
+    for (int i = 0; i < size; i++) {
+        *out++ = value >> (8 * i);
+    }
+
+    return out;
+}
+
+// the magic has already been read
+static bool read_log(struct input_script *script, FILE *file)
+{
+    uint8_t header[LOG_HEADER_SIZE - 4];
+
+    if (fread(header, 1, sizeof(header), file) != sizeof(header) || header[0] != LOG_VERSION) {
+        return false;
+    }
+
+    script->seed = get_le(header + 1, 8);
+    script->frames = get_le(header + 9, 4);
+    script->instructions_per_frame = get_le(header + 13, 2);
+
+    uint64_t frame = 0;
+    int c;
+
+    while ((c = getc(file)) != EOF) {
+        uint64_t delta = 0;
+        int shift = 0;
+
+        // frames since the previous change
+        for (;;) {
+            if (c == EOF || shift > 28) {
+                return false;
+            }
+
+            delta |= (uint64_t)(c & 0x7f) << shift;
+            shift += 7;
+
+            if (!(c & 0x80)) {
+                break;
+            }
+
+            c = getc(file);
+        }
+
+        frame += delta;
+        c = getc(file);
+
+        if (c == EOF || (c & ~(LOG_PRESSED | 0xf)) || frame > UINT32_MAX) {
+            return false;
+        }
+
+        struct input_event *event = append_event(script);
+
+        if (event == NULL) {
+            return false;
+        }
+
+        event->frame = frame;
+        event->key = c & 0xf;
+        event->pressed = c & LOG_PRESSED;
+    }
+
+    return true;
+}
+
+// read a script, either text written by hand or a log recorded from a
+// session, telling them apart by the log's magic
+bool input_script_load(struct input_script *script, const char *path)
+{
+    FILE *file = fopen(path, "rb");
+
+    if (file == NULL) {
+        return false;
+    }
+
+    input_script_init(script, CHIP8_DEFAULT_SEED, 0);
+
+    char magic[4];
+    bool failed;
+
+    if (fread(magic, 1, sizeof(magic), file) == sizeof(magic) && memcmp(magic, LOG_MAGIC, sizeof(magic)) == 0) {
+        failed = !read_log(script, file);
+    } else {
+        rewind(file);
+        failed = !read_text(script, file);
+    }
+
+    failed |= ferror(file);
+    fclose(file);
+
+    if (failed) {
+        input_script_free(script);
+        return false;
+    }
+
+    return true;
+}
+
+// write a script as a binary log
+bool input_script_save(const struct input_script *script, const char *path)
+{
+    FILE *file = fopen(path, "wb");
+
+    if (file == NULL) {
+        return false;
+    }
+
+    uint8_t header[LOG_HEADER_SIZE];
+    uint8_t *out = header;
+
+    memcpy(out, LOG_MAGIC, 4);
+    out += 4;
+    *out++ = LOG_VERSION;
+    out = put_le(out, script->seed, 8);
+    out = put_le(out, script->frames, 4);
+    put_le(out, script->instructions_per_frame, 2);
+
+    fwrite(header, 1, sizeof(header), file);
+
+    uint32_t frame = 0;
+
+    for (size_t i = 0; i < script->count; i++) {
+        const struct input_event *event = &script->events[i];
+        uint32_t delta = event->frame - frame;
+
+        while (delta >= 0x80) {
+            putc(delta | 0x80, file);
+            delta >>= 7;
+        }
+
+        putc(delta, file);
+        putc(event->key | (event->pressed ? LOG_PRESSED : 0), file);
+        frame = event->frame;
+    }
+
+    bool failed = ferror(file);
+    return !(fclose(file) != 0 || failed);
+}
+
+void input_script_free(struct input_script *script)
+{
+    free(script->events);
+    script->events = NULL;
+    script->count = 0;
+    script->capacity = 0;
+}
+
+// add a key change at the end, frames must not go backwards
+bool input_script_record(struct input_script *script, uint32_t frame, uint8_t key, bool pressed)
+{
+    struct input_event *event = append_event(script);
+
+    if (event == NULL) {
+        return false;
+    }
+
+    event->frame = frame;
+    event->key = key & 0xf;
+    event->pressed = pressed;
+    return true;
+}
+
+// apply the events due before this frame starting from index next,
+// returns the index of the first event still pending
+size_t input_script_apply(const struct input_script *script, size_t next, uint32_t frame, struct chip8 *chip8)
+{
+    while (next < script->count && script->events[next].frame <= frame) {
+        chip8_set_key(chip8, script->events[next].key, script->events[next].pressed);
+        next += 1;
+    }
+
+    return next;
+}
@@ -0,0 +1,34 @@
+#ifndef INPUT_H
+#define INPUT_H
+
+#include "chip8.h"
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+// A key changing state at the start of a frame
+struct input_event {
+    uint32_t frame; // Frame the change applies before
+    uint8_t key; // Key 0x0-0xF
+    bool pressed; // New state
+};
+
+// Key changes to replay during a run, ordered by frame. Recorded sessions
+// also carry what else is needed to reproduce them exactly.
+struct input_script {
+    struct input_event *events;
+    size_t count;
+    size_t capacity;
+    uint64_t seed; // Random number seed the session started from
+    uint32_t frames; // Length of the session, 0 when not known
+    uint16_t instructions_per_frame; // Clock of the session, 0 when not known
+};
+
+void input_script_init(struct input_script *script, uint64_t seed, uint16_t instructions_per_frame);
+bool input_script_load(struct input_script *script, const char *path);
+bool input_script_save(const struct input_script *script, const char *path);
+void input_script_free(struct input_script *script);
+bool input_script_record(struct input_script *script, uint32_t frame, uint8_t key, bool pressed);
+size_t input_script_apply(const struct input_script *script, size_t next, uint32_t frame, struct chip8 *chip8);
+
+#endif
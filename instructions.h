@@ -0,0 +1,648 @@
+#ifndef INSTRUCTIONS_H
+#define INSTRUCTIONS_H
+
+#include "chip8.h"
+#include "opcodes.h"
+#include "quirks.h"
+#include <stdbool.h>
+#include <stdint.h>
+#include <string.h>
+
+// Decoding and the effect of every instruction, inline so that each core
+// can build its handlers from them: opcodes.c wraps them as the op_*
+// functions, interpret.c once per quirk set (see quirks.h), specialized.c
+// compiles them once per opcode.
+
+// The decoder is written as constant expressions, so that the specialized
+// core can resolve an opcode's kind while it is being compiled
+
+#define ARITHMETIC_KIND(n)                  \
+    ((n) == 0x0   ? OP_LOAD_FROM_REGISTER   \
+        : (n) == 0x1 ? OP_OR                \
+        : (n) == 0x2 ? OP_AND               \
+        : (n) == 0x3 ? OP_XOR               \
+        : (n) == 0x4 ? OP_ADD_REGISTERS     \
+        : (n) == 0x5 ? OP_SUBTRACT_X_Y      \
+        : (n) == 0x6 ? OP_SHIFT_RIGHT       \
+        : (n) == 0x7 ? OP_SUBTRACT_Y_X      \
+        : (n) == 0xe ? OP_SHIFT_LEFT        \
+                     : OP_UNKNOWN)
+
+#define MISC_KIND(kk)                        \
+    ((kk) == 0x07   ? OP_LOAD_DELAY_TIMER    \
+        : (kk) == 0x0a ? OP_WAIT_FOR_KEY     \
+        : (kk) == 0x15 ? OP_SET_DELAY_TIMER  \
+        : (kk) == 0x18 ? OP_SET_SOUND_TIMER  \
+        : (kk) == 0x1e ? OP_ADD_I            \
+        : (kk) == 0x29 ? OP_LOAD_SPRITE      \
+        : (kk) == 0x33 ? OP_BCD              \
+        : (kk) == 0x55 ? OP_REGISTER_DUMP    \
+        : (kk) == 0x65 ? OP_REGISTER_LOAD    \
+                       : OP_UNKNOWN)
+
+// handler for an opcode, by its first digit
+#define INSTRUCTION_KIND(opcode)                                                                      \
+    (((opcode) & 0xf000) == 0x0000   ? ((opcode) == 0x00e0 ? OP_CLEAR_SCREEN                          \
+                                           : (opcode) == 0x00ee ? OP_RETURN                          \
+                                                                : OP_UNKNOWN)                        \
+        : ((opcode) & 0xf000) == 0x1000 ? OP_JUMP                                                     \
+        : ((opcode) & 0xf000) == 0x2000 ? OP_CALL                                                     \
+        : ((opcode) & 0xf000) == 0x3000 ? OP_SKIP_EQUAL                                               \
+        : ((opcode) & 0xf000) == 0x4000 ? OP_SKIP_NOT_EQUAL                                           \
+        : ((opcode) & 0xf000) == 0x5000 ? OP_SKIP_REGISTERS_EQUAL                                     \
+        : ((opcode) & 0xf000) == 0x6000 ? OP_LOAD                                                     \
+        : ((opcode) & 0xf000) == 0x7000 ? OP_ADD                                                      \
+        : ((opcode) & 0xf000) == 0x8000 ? ARITHMETIC_KIND((opcode) & 0x000f)                          \
+        : ((opcode) & 0xf000) == 0x9000 ? OP_SKIP_REGISTERS_NOT_EQUAL                                 \
+        : ((opcode) & 0xf000) == 0xa000 ? OP_LOAD_I                                                   \
+        : ((opcode) & 0xf000) == 0xb000 ? OP_JUMP_OFFSET                                              \
+        : ((opcode) & 0xf000) == 0xc000 ? OP_RANDOM                                                   \
+        : ((opcode) & 0xf000) == 0xd000 ? OP_DRAW                                                     \
+        : ((opcode) & 0xf000) == 0xe000 ? (((opcode) & 0x00ff) == 0x9e ? OP_SKIP_KEY_PRESSED          \
+                                              : ((opcode) & 0x00ff) == 0xa1 ? OP_SKIP_KEY_NOT_PRESSED \
+                                                                            : OP_UNKNOWN)             \
+                                        : MISC_KIND((opcode) & 0x00ff))
+
+// split an opcode into its handler and operands
+#define INSTRUCTION(opcode)                        \
+    ((struct instruction) {                        \
+        .kind = INSTRUCTION_KIND(opcode),          \
+        .x = ((opcode) & 0x0f00) >> 8,             \
+        .y = ((opcode) & 0x00f0) >> 4,             \
+        .n = (opcode) & 0x000f,                    \
+        .kk = (opcode) & 0x00ff,                   \
+        .nnn = (opcode) & 0x0fff                   \
+    })
+
+static inline void instruction_decode(uint16_t opcode, struct instruction *ins)
+{
+    *ins = INSTRUCTION(opcode);
+}
+
+static inline void instruction_unknown(struct chip8 *chip8, const struct instruction *ins)
+{
+    uint16_t pc = chip8->cpu.pc;
+    uint16_t opcode = chip8->memory[pc % CHIP8_MEMORY_SIZE] << 8 | chip8->memory[(pc + 1) % CHIP8_MEMORY_SIZE];
+
+    if (chip8_trap(chip8, CHIP8_EVENT_ILLEGAL_OPCODE, opcode)) {
+        return;
+    }
+
+    chip8->cpu.pc += 2;
+}
+
+static inline void instruction_clear_screen(struct chip8 *chip8, const struct instruction *ins)
+{
+    memset(chip8->graphics, 0x0, sizeof(chip8->graphics));
+    chip8->draw = true;
+    chip8->cpu.pc += 2;
+}
+
+static inline void instruction_return(struct chip8 *chip8, const struct instruction *ins)
+{
+    // nothing to return to, carry on with the next instruction
+    if (chip8->cpu.sp == 0 || chip8->cpu.sp > CHIP8_STACK_SIZE) {
+        if (!chip8_trap(chip8, CHIP8_EVENT_STACK_UNDERFLOW, chip8->cpu.sp)) {
+            chip8->cpu.pc += 2;
+        }
+        return;
+    }
+
+    // remove from stack
+    chip8->cpu.sp -= 1;
+
+    // set pc to address on stack
+    chip8->cpu.pc = chip8->cpu.stack[chip8->cpu.sp];
+
+    // move along
+    chip8->cpu.pc += 2;
+}
+
+static inline void instruction_jump(struct chip8 *chip8, const struct instruction *ins)
+{
+    uint16_t address = ins->nnn;
+    chip8->cpu.pc = address;
+}
+
+static inline void instruction_call(struct chip8 *chip8, const struct instruction *ins)
+{
+    // decode address
+    uint16_t address = ins->nnn;
+
+    // no room to return, the call is not made
+    if (chip8->cpu.sp >= CHIP8_STACK_SIZE) {
+        if (!chip8_trap(chip8, CHIP8_EVENT_STACK_OVERFLOW, address)) {
+            chip8->cpu.pc += 2;
+        }
+        return;
+    }
+
+    // store current address on stack
+    chip8->cpu.stack[chip8->cpu.sp] = chip8->cpu.pc;
+    chip8->cpu.sp += 1;
+
+    // set current address to new address
+    chip8->cpu.pc = address;
+}
+
+// skip equal
+static inline void instruction_skip_equal(struct chip8 *chip8, const struct instruction *ins)
+{
+    uint16_t index = ins->x;
+    uint16_t value = ins->kk;
+
+    // skip next instruction if equal
+    if (chip8->cpu.V[index] == value) {
+        chip8->cpu.pc += 4;
+    } else {
+        chip8->cpu.pc += 2;
+    }
+}
+
+// skip not equal
+static inline void instruction_skip_not_equal(struct chip8 *chip8, const struct instruction *ins)
+{
+    uint16_t index = ins->x;
+    uint16_t value = ins->kk;
+
+    // skip next instruction if not equal
+    if (chip8->cpu.V[index] != value) {
+        chip8->cpu.pc += 4;
+    } else {
+        chip8->cpu.pc += 2;
+    }
+}
+
+// skip registers equal
+static inline void instruction_skip_registers_equal(struct chip8 *chip8, const struct instruction *ins)
+{
+    uint16_t x = ins->x;
+    uint16_t y = ins->y;
+
+    if (chip8->cpu.V[x] == chip8->cpu.V[y]) {
+        chip8->cpu.pc += 4;
+    } else {
+        chip8->cpu.pc += 2;
+    }
+}
+
+// load
+static inline void instruction_load(struct chip8 *chip8, const struct instruction *ins)
+{
+    uint16_t dest = ins->x;
+    uint16_t value = ins->kk;
+
+    chip8->cpu.V[dest] = value;
+    chip8->cpu.pc += 2;
+}
+
+// add
+static inline void instruction_add(struct chip8 *chip8, const struct instruction *ins)
+{
+    uint16_t dest = ins->x;
+    uint16_t value = ins->kk;
+
+    chip8->cpu.V[dest] += value;
+    chip8->cpu.pc += 2;
+}
+
+// load from register
+static inline void instruction_load_from_register(struct chip8 *chip8, const struct instruction *ins)
+{
+    uint16_t dest = ins->x;
+    uint16_t source = ins->y;
+
+    chip8->cpu.V[dest] = chip8->cpu.V[source];
+    chip8->cpu.pc += 2;
+}
+
+// bitwise or between registers
+static inline void instruction_or(struct chip8 *chip8, const struct instruction *ins)
+{
+    uint16_t x = ins->x;
+    uint16_t y = ins->y;
+
+    chip8->cpu.V[x] = chip8->cpu.V[x] | chip8->cpu.V[y];
+
+    if (QUIRK_LOGIC_RESETS_VF) {
+        chip8->cpu.V[0xf] = 0;
+    }
+
+    chip8->cpu.pc += 2;
+}
+
+// bitwise and between registers
+static inline void instruction_and(struct chip8 *chip8, const struct instruction *ins)
+{
+    uint16_t x = ins->x;
+    uint16_t y = ins->y;
+
+    chip8->cpu.V[x] = chip8->cpu.V[x] & chip8->cpu.V[y];
+
+    if (QUIRK_LOGIC_RESETS_VF) {
+        chip8->cpu.V[0xf] = 0;
+    }
+
+    chip8->cpu.pc += 2;
+}
+
+// bitwise xor between registers
+static inline void instruction_xor(struct chip8 *chip8, const struct instruction *ins)
+{
+    uint16_t x = ins->x;
+    uint16_t y = ins->y;
+
+    chip8->cpu.V[x] = chip8->cpu.V[x] ^ chip8->cpu.V[y];
+
+    if (QUIRK_LOGIC_RESETS_VF) {
+        chip8->cpu.V[0xf] = 0;
+    }
+
+    chip8->cpu.pc += 2;
+}
+
+// add register values
+static inline void instruction_add_registers(struct chip8 *chip8, const struct instruction *ins)
+{
+    uint16_t x = ins->x;
+    uint16_t y = ins->y;
+
+    uint16_t result = chip8->cpu.V[x] + chip8->cpu.V[y];
+
+    // set VF if result is > 8 bits and only keep 8 bits
+    chip8->cpu.V[0xf] = result > 255;
+    chip8->cpu.V[x] = result & 0xff;
+    chip8->cpu.pc += 2;
+}
+
+// subtract y from x
+static inline void instruction_subtract_x_y(struct chip8 *chip8, const struct instruction *ins)
+{
+    uint16_t x = ins->x;
+    uint16_t y = ins->y;
+
+    // set VF to 1 if result is not negative
+    chip8->cpu.V[0xf] = chip8->cpu.V[x] > chip8->cpu.V[y];
+    chip8->cpu.V[x] = chip8->cpu.V[x] - chip8->cpu.V[y];
+    chip8->cpu.pc += 2;
+}
+
+// shift right
+static inline void instruction_shift_right(struct chip8 *chip8, const struct instruction *ins)
+{
+    uint16_t x = ins->x;
+    uint16_t source = QUIRK_SHIFT_VY ? ins->y : x;
+
+    // set VF to least significant bit of the source
+    chip8->cpu.V[0xf] = chip8->cpu.V[source] & 0x1;
+    chip8->cpu.V[x] = chip8->cpu.V[source] >> 1; // shift right by 1
+    chip8->cpu.pc += 2;
+}
+
+// subtract x from y
+static inline void instruction_subtract_y_x(struct chip8 *chip8, const struct instruction *ins)
+{
+    uint16_t x = ins->x;
+    uint16_t y = ins->y;
+
+    // set VF to 1 if result is not negative
+    chip8->cpu.V[0xf] = chip8->cpu.V[y] > chip8->cpu.V[x];
+    chip8->cpu.V[x] = chip8->cpu.V[y] - chip8->cpu.V[x];
+    chip8->cpu.pc += 2;
+}
+
+// shift left
+static inline void instruction_shift_left(struct chip8 *chip8, const struct instruction *ins)
+{
+    uint16_t x = ins->x;
+    uint16_t source = QUIRK_SHIFT_VY ? ins->y : x;
+
+    // set VF to most significant bit of the source
+    chip8->cpu.V[0xf] = (chip8->cpu.V[source] & 0x80) >> 7;
+    chip8->cpu.V[x] = chip8->cpu.V[source] << 1; // shift left by 1
+    chip8->cpu.pc += 2;
+}
+
+// skip registers not equal
+static inline void instruction_skip_registers_not_equal(struct chip8 *chip8, const struct instruction *ins)
+{
+    uint16_t x = ins->x;
+    uint16_t y = ins->y;
+
+    if (chip8->cpu.V[x] != chip8->cpu.V[y]) {
+        chip8->cpu.pc += 4;
+    } else {
+        chip8->cpu.pc += 2;
+    }
+}
+
+// load address into I
+static inline void instruction_load_i(struct chip8 *chip8, const struct instruction *ins)
+{
+    uint16_t address = ins->nnn;
+    chip8->cpu.I = address;
+    chip8->cpu.pc += 2;
+}
+
+// jump to address + offset
+static inline void instruction_jump_offset(struct chip8 *chip8, const struct instruction *ins)
+{
+    uint8_t offset = chip8->cpu.V[QUIRK_JUMP_VX ? ins->x : 0];
+    uint16_t address = ins->nnn + offset;
+
+    chip8->cpu.pc = address;
+}
+
+// generate random number and AND with value
+static inline void instruction_random(struct chip8 *chip8, const struct instruction *ins)
+{
+    uint16_t dest = ins->x;
+    uint8_t value = ins->kk;
+    uint8_t number = chip8_random(chip8);
+
+    chip8->cpu.V[dest] = number & value;
+    chip8->cpu.pc += 2;
+}
+
+// accesses that run past the end of memory wrap around after reporting it
+static inline bool check_range(struct chip8 *chip8, uint16_t length)
+{
+    return chip8->cpu.I + length <= CHIP8_MEMORY_SIZE || !chip8_trap(chip8, CHIP8_EVENT_MEMORY_RANGE, chip8->cpu.I);
+}
+
+// draw to screen
+static inline void instruction_draw(struct chip8 *chip8, const struct instruction *ins)
+{
+    uint8_t x = chip8->cpu.V[ins->x] % CHIP8_WIDTH;
+    uint8_t y = chip8->cpu.V[ins->y] % CHIP8_HEIGHT;
+    uint8_t height = ins->n;
+    uint64_t collision = 0;
+
+    // the position always wraps, the sprite itself may be cut off
+    if (QUIRK_CLIP_SPRITES && height > CHIP8_HEIGHT - y) {
+        height = CHIP8_HEIGHT - y;
+    }
+
+    if (!check_range(chip8, height)) {
+        return;
+    }
+
+    for (uint8_t yIndex = 0; yIndex < height; yIndex++) {
+        // line of the sprite placed at the left edge, then shifted into
+        // place, or rotated so pixels past the right edge wrap around
+        uint64_t line = (uint64_t)chip8->memory[(chip8->cpu.I + yIndex) % CHIP8_MEMORY_SIZE] << 56;
+        line = QUIRK_CLIP_SPRITES ? line >> x : (line >> x) | (line << ((CHIP8_WIDTH - x) % CHIP8_WIDTH));
+
+        uint64_t *row = &chip8->graphics[(y + yIndex) % CHIP8_HEIGHT];
+
+        // pixels that are on in both get switched off
+        collision |= *row & line;
+        *row ^= line;
+    }
+
+    chip8->cpu.V[0xF] = collision != 0;
+    chip8->draw = true;
+    chip8->cpu.pc += 2;
+}
+
+// keys past F wrap around after reporting it
+static inline bool check_key(struct chip8 *chip8, uint8_t key)
+{
+    return key <= 0xf || !chip8_trap(chip8, CHIP8_EVENT_KEY_RANGE, key);
+}
+
+// skip if key in Vx is pressed
+static inline void instruction_skip_key_pressed(struct chip8 *chip8, const struct instruction *ins)
+{
+    uint8_t key = chip8->cpu.V[ins->x];
+
+    if (!check_key(chip8, key)) {
+        return;
+    }
+
+    if (chip8->keypad[key & 0xf] == true) {
+        chip8->cpu.pc += 4;
+    } else {
+        chip8->cpu.pc += 2;
+    }
+}
+
+// skip if key in Vx is not pressed
+static inline void instruction_skip_key_not_pressed(struct chip8 *chip8, const struct instruction *ins)
+{
+    uint8_t key = chip8->cpu.V[ins->x];
+
+    if (!check_key(chip8, key)) {
+        return;
+    }
+
+    if (chip8->keypad[key & 0xf] == false) {
+        chip8->cpu.pc += 4;
+    } else {
+        chip8->cpu.pc += 2;
+    }
+}
+
+static inline void instruction_load_delay_timer(struct chip8 *chip8, const struct instruction *ins)
+{
+    uint8_t index = ins->x;
+    chip8->cpu.V[index] = chip8->delay_timer;
+    chip8->cpu.pc += 2;
+}
+
+static inline void instruction_wait_for_key(struct chip8 *chip8, const struct instruction *ins)
+{
+    uint8_t index = ins->x;
+
+    bool pressed = false;
+
+    for (uint8_t i = 0; i < 16; i++) {
+        if (chip8->keypad[i] != 0) {
+            chip8->cpu.V[index] = i;
+            pressed = true;
+        }
+    }
+
+    // don't move on in the program until we got something
+    if (pressed) {
+        chip8->cpu.pc += 2;
+    }
+}
+
+// load delay timer
+static inline void instruction_set_delay_timer(struct chip8 *chip8, const struct instruction *ins)
+{
+    uint8_t index = ins->x;
+    chip8->delay_timer = chip8->cpu.V[index];
+    chip8->cpu.pc += 2;
+}
+
+// load sound timer
+static inline void instruction_set_sound_timer(struct chip8 *chip8, const struct instruction *ins)
+{
+    uint8_t index = ins->x;
+    chip8->sound_timer = chip8->cpu.V[index];
+    chip8->cpu.pc += 2;
+}
+
+// add Vx to I
+static inline void instruction_add_i(struct chip8 *chip8, const struct instruction *ins)
+{
+    uint8_t index = ins->x;
+    chip8->cpu.I += chip8->cpu.V[index];
+
+    if (chip8->cpu.I > 0xfff) {
+        chip8->cpu.V[0xf] = 1;
+    } else {
+       chip8->cpu.V[0xf] = 0;
+    }
+
+    chip8->cpu.pc += 2;
+}
+
+// set I to location of sprite in Vx
+static inline void instruction_load_sprite(struct chip8 *chip8, const struct instruction *ins)
+{
+    uint8_t index = ins->x;
+    chip8->cpu.I = chip8->cpu.V[index] * 0x5;
+    chip8->cpu.pc += 2;
+}
+
+// bcd craziness
+static inline void instruction_bcd(struct chip8 *chip8, const struct instruction *ins)
+{
+    uint8_t index = ins->x;
+    uint8_t value = chip8->cpu.V[index];
+
+    if (!check_range(chip8, 3)) {
+        return;
+    }
+
+    uint8_t h = value - (value % 100);
+    uint8_t t = (value - h) - ((value - h) % 10);
+    uint8_t u = value - h - t;
+
+    chip8->memory[chip8->cpu.I % CHIP8_MEMORY_SIZE] = h / 100;
+    chip8->memory[(chip8->cpu.I + 1) % CHIP8_MEMORY_SIZE] = t / 10;
+    chip8->memory[(chip8->cpu.I + 2) % CHIP8_MEMORY_SIZE] = u;
+    chip8_invalidate(chip8, chip8->cpu.I, 3);
+
+    chip8->cpu.pc += 2;
+}
+
+// dump V0-Vx in memory starting from I
+static inline void instruction_register_dump(struct chip8 *chip8, const struct instruction *ins)
+{
+    uint8_t index = ins->x;
+
+    if (!check_range(chip8, index + 1)) {
+        return;
+    }
+
+    chip8_invalidate(chip8, chip8->cpu.I, index + 1);
+
+    for (uint8_t i = 0; i <= index; i++) {
+        chip8->memory[(chip8->cpu.I + i) % CHIP8_MEMORY_SIZE] = chip8->cpu.V[i];
+    }
+
+    chip8->cpu.I += QUIRK_INDEX_ADVANCE(index);
+    chip8->cpu.pc += 2;
+}
+
+// load registers from memory
+static inline void instruction_register_load(struct chip8 *chip8, const struct instruction *ins)
+{
+    uint8_t index = ins->x;
+
+    if (!check_range(chip8, index + 1)) {
+        return;
+    }
+
+    for (uint8_t i = 0; i <= index; i++) {
+        chip8->cpu.V[i] = chip8->memory[(chip8->cpu.I + i) % CHIP8_MEMORY_SIZE];
+    }
+
+    chip8->cpu.I += QUIRK_INDEX_ADVANCE(index);
+    chip8->cpu.pc += 2;
+}
+
+// The rest of a sequence is looked up again as it runs: memory may have
+// been rewritten since it was fused, by the sequence itself or otherwise,
+// and a rewritten instruction is no longer decoded. The sequence stops at
+// the first instruction that is not what it expects, to be run by the
+// interpreter. Each returns how many instructions it ran.
+static inline const struct instruction *upcoming(const struct chip8 *chip8)
+{
+    return &chip8->decoded[chip8->cpu.pc % CHIP8_MEMORY_SIZE];
+}
+
+// set up and draw a sprite
+static inline unsigned int instruction_fused_sprite(struct chip8 *chip8, const struct instruction *ins)
+{
+    instruction_load(chip8, ins);
+
+    if ((ins = upcoming(chip8))->kind != OP_LOAD_I) {
+        return 1;
+    }
+
+    instruction_load_i(chip8, ins);
+
+    if ((ins = upcoming(chip8))->kind != OP_DRAW) {
+        return 2;
+    }
+
+    instruction_draw(chip8, ins);
+    return 3;
+}
+
+// step a counter and jump back unless it reached its limit
+static inline unsigned int instruction_fused_counted_loop(struct chip8 *chip8, const struct instruction *ins)
+{
+    instruction_add(chip8, ins);
+    ins = upcoming(chip8);
+
+    if (ins->kind == OP_SKIP_EQUAL) {
+        instruction_skip_equal(chip8, ins);
+    } else if (ins->kind == OP_SKIP_NOT_EQUAL) {
+        instruction_skip_not_equal(chip8, ins);
+    } else {
+        return 1;
+    }
+
+    // a skip taken lands past the jump, on whatever comes next
+    if ((ins = upcoming(chip8))->kind != OP_JUMP) {
+        return 2;
+    }
+
+    instruction_jump(chip8, ins);
+    return 3;
+}
+
+// draw the font digit for a register
+static inline unsigned int instruction_fused_digit(struct chip8 *chip8, const struct instruction *ins)
+{
+    instruction_load_sprite(chip8, ins);
+
+    if ((ins = upcoming(chip8))->kind != OP_DRAW) {
+        return 1;
+    }
+
+    instruction_draw(chip8, ins);
+    return 2;
+}
+
+// split a register into decimal digits and load them back
+static inline unsigned int instruction_fused_score(struct chip8 *chip8, const struct instruction *ins)
+{
+    instruction_bcd(chip8, ins);
+
+    // the digits may have overwritten the load
+    if (chip8->halted || (ins = upcoming(chip8))->kind != OP_REGISTER_LOAD) {
+        return 1;
+    }
+
+    instruction_register_load(chip8, ins);
+    return 2;
+}
+
+#endif
@@ -0,0 +1,363 @@
+#include "interpret.h"
+#include "chip8.h"
+#include "instructions.h"
+#include "opcodes.h"
+
+// The interpreter for one quirk set. The Makefile compiles this file once
+// per set, with QUIRKS naming it and QUIRKS_<set> selecting its behaviour
+// in quirks.h, so the handlers have the set's quirks compiled in and the
+// loop never checks which one is in use.
+
+#ifndef QUIRKS
+#define QUIRKS modern
+#define QUIRKS_modern
+#endif
+
+#define ADDRESS_MASK (CHIP8_MEMORY_SIZE - 1)
+
+// interpreter_<set>, the name has to be expanded before pasting
+#define PASTE(prefix, name) prefix##name
+#define INTERPRETER_NAME(name) PASTE(interpreter_, name)
+
+#define HANDLER(name)                                                          \
+    static void handle_##name(struct chip8 *chip8, const struct instruction *ins) \
+    {                                                                          \
+        instruction_##name(chip8, ins);                                        \
+    }
+
+HANDLER(unknown)
+HANDLER(clear_screen)
+HANDLER(return)
+HANDLER(jump)
+HANDLER(call)
+HANDLER(skip_equal)
+HANDLER(skip_not_equal)
+HANDLER(skip_registers_equal)
+HANDLER(load)
+HANDLER(add)
+HANDLER(load_from_register)
+HANDLER(or)
+HANDLER(and)
+HANDLER(xor)
+HANDLER(add_registers)
+HANDLER(subtract_x_y)
+HANDLER(shift_right)
+HANDLER(subtract_y_x)
+HANDLER(shift_left)
+HANDLER(skip_registers_not_equal)
+HANDLER(load_i)
+HANDLER(jump_offset)
+HANDLER(random)
+HANDLER(draw)
+HANDLER(skip_key_pressed)
+HANDLER(skip_key_not_pressed)
+HANDLER(load_delay_timer)
+HANDLER(wait_for_key)
+HANDLER(set_delay_timer)
+HANDLER(set_sound_timer)
+HANDLER(add_i)
+HANDLER(load_sprite)
+HANDLER(bcd)
+HANDLER(register_dump)
+HANDLER(register_load)
+
+#undef HANDLER
+
+#define FUSED_HANDLER(name)                                                              \
+    static unsigned int handle_fused_##name(struct chip8 *chip8, const struct instruction *ins) \
+    {                                                                                    \
+        return instruction_fused_##name(chip8, ins);                                     \
+    }
+
+FUSED_HANDLER(sprite)
+FUSED_HANDLER(counted_loop)
+FUSED_HANDLER(digit)
+FUSED_HANDLER(score)
+
+#undef FUSED_HANDLER
+
+static const opcode_handler handlers[INSTRUCTION_KIND_COUNT] = {
+    [OP_UNDECODED] = NULL,
+    [OP_UNKNOWN] = &handle_unknown,
+
+    [OP_CLEAR_SCREEN] = &handle_clear_screen,
+    [OP_RETURN] = &handle_return,
+    [OP_JUMP] = &handle_jump,
+    [OP_CALL] = &handle_call,
+    [OP_SKIP_EQUAL] = &handle_skip_equal,
+    [OP_SKIP_NOT_EQUAL] = &handle_skip_not_equal,
+    [OP_SKIP_REGISTERS_EQUAL] = &handle_skip_registers_equal,
+    [OP_LOAD] = &handle_load,
+    [OP_ADD] = &handle_add,
+
+    [OP_LOAD_FROM_REGISTER] = &handle_load_from_register,
+    [OP_OR] = &handle_or,
+    [OP_AND] = &handle_and,
+    [OP_XOR] = &handle_xor,
+    [OP_ADD_REGISTERS] = &handle_add_registers,
+    [OP_SUBTRACT_X_Y] = &handle_subtract_x_y,
+    [OP_SHIFT_RIGHT] = &handle_shift_right,
+    [OP_SUBTRACT_Y_X] = &handle_subtract_y_x,
+    [OP_SHIFT_LEFT] = &handle_shift_left,
+
+    [OP_SKIP_REGISTERS_NOT_EQUAL] = &handle_skip_registers_not_equal,
+    [OP_LOAD_I] = &handle_load_i,
+    [OP_JUMP_OFFSET] = &handle_jump_offset,
+    [OP_RANDOM] = &handle_random,
+    [OP_DRAW] = &handle_draw,
+    [OP_SKIP_KEY_PRESSED] = &handle_skip_key_pressed,
+    [OP_SKIP_KEY_NOT_PRESSED] = &handle_skip_key_not_pressed,
+
+    [OP_LOAD_DELAY_TIMER] = &handle_load_delay_timer,
+    [OP_WAIT_FOR_KEY] = &handle_wait_for_key,
+    [OP_SET_DELAY_TIMER] = &handle_set_delay_timer,
+    [OP_SET_SOUND_TIMER] = &handle_set_sound_timer,
+    [OP_ADD_I] = &handle_add_i,
+    [OP_LOAD_SPRITE] = &handle_load_sprite,
+    [OP_BCD] = &handle_bcd,
+    [OP_REGISTER_DUMP] = &handle_register_dump,
+    [OP_REGISTER_LOAD] = &handle_register_load
+};
+
+// decode, and fuse with the instructions that follow where they form a
+// common sequence
+static struct instruction *decode_fused(struct chip8 *chip8, uint16_t pc)
+{
+    struct instruction *ins = &chip8->decoded[pc];
+
+    opcode_decode(chip8->memory[pc] << 8 | chip8->memory[(pc + 1) & ADDRESS_MASK], ins);
+    opcode_fuse(chip8, pc);
+    return ins;
+}
+
+#if defined(__GNUC__)
+
+// Direct-threaded interpreter: every handler jumps straight to the next
+// instruction's label instead of returning to a central loop.
+static void interpret(struct chip8 *chip8, unsigned long count)
+{
+    static const void *labels[FUSED_KIND_END] = {
+        [OP_UNDECODED] = &&undecoded,
+        [OP_UNKNOWN] = &&unknown,
+
+        [OP_CLEAR_SCREEN] = &&clear_screen,
+        [OP_RETURN] = &&return_,
+        [OP_JUMP] = &&jump,
+        [OP_CALL] = &&call,
+        [OP_SKIP_EQUAL] = &&skip_equal,
+        [OP_SKIP_NOT_EQUAL] = &&skip_not_equal,
+        [OP_SKIP_REGISTERS_EQUAL] = &&skip_registers_equal,
+        [OP_LOAD] = &&load,
+        [OP_ADD] = &&add,
+
+        [OP_LOAD_FROM_REGISTER] = &&load_from_register,
+        [OP_OR] = &&or,
+        [OP_AND] = &&and,
+        [OP_XOR] = &&xor,
+        [OP_ADD_REGISTERS] = &&add_registers,
+        [OP_SUBTRACT_X_Y] = &&subtract_x_y,
+        [OP_SHIFT_RIGHT] = &&shift_right,
+        [OP_SUBTRACT_Y_X] = &&subtract_y_x,
+        [OP_SHIFT_LEFT] = &&shift_left,
+
+        [OP_SKIP_REGISTERS_NOT_EQUAL] = &&skip_registers_not_equal,
+        [OP_LOAD_I] = &&load_i,
+        [OP_JUMP_OFFSET] = &&jump_offset,
+        [OP_RANDOM] = &&random,
+        [OP_DRAW] = &&draw,
+        [OP_SKIP_KEY_PRESSED] = &&skip_key_pressed,
+        [OP_SKIP_KEY_NOT_PRESSED] = &&skip_key_not_pressed,
+
+        [OP_LOAD_DELAY_TIMER] = &&load_delay_timer,
+        [OP_WAIT_FOR_KEY] = &&wait_for_key,
+        [OP_SET_DELAY_TIMER] = &&set_delay_timer,
+        [OP_SET_SOUND_TIMER] = &&set_sound_timer,
+        [OP_ADD_I] = &&add_i,
+        [OP_LOAD_SPRITE] = &&load_sprite,
+        [OP_BCD] = &&bcd,
+        [OP_REGISTER_DUMP] = &&register_dump,
+        [OP_REGISTER_LOAD] = &&register_load,
+
+        [OP_FUSED_SPRITE] = &&fused_sprite,
+        [OP_FUSED_COUNTED_LOOP] = &&fused_counted_loop,
+        [OP_FUSED_DIGIT] = &&fused_digit,
+        [OP_FUSED_SCORE] = &&fused_score
+    };
+
+    struct instruction *ins;
+
+#define DISPATCH()                                                 \
+    do {                                                           \
+        if (count == 0) {                                          \
+            return;                                                \
+        }                                                          \
+        count -= 1;                                                \
+        ins = &chip8->decoded[chip8->cpu.pc & ADDRESS_MASK];       \
+        goto *labels[ins->kind];                                   \
+    } while (0)
+
+#define EXECUTE(handler)                                           \
+    handler(chip8, ins);                                           \
+    DISPATCH()
+
+    // for handlers that can trap, which may halt the machine
+#define EXECUTE_CHECKED(handler)                                   \
+    handler(chip8, ins);                                           \
+    if (chip8->halted) {                                           \
+        return;                                                    \
+    }                                                              \
+    DISPATCH()
+
+    // a superinstruction runs its first instruction alone when the count
+    // runs out part way through; it may run fewer than all of them anyway
+#define EXECUTE_FUSED(handler, head, length)                       \
+    if (count + 1 < length) {                                      \
+        head(chip8, ins);                                          \
+    } else {                                                       \
+        count -= handler(chip8, ins) - 1;                          \
+    }                                                              \
+    if (chip8->halted) {                                           \
+        return;                                                    \
+    }                                                              \
+    DISPATCH()
+
+    DISPATCH();
+
+undecoded:
+    ins = decode_fused(chip8, chip8->cpu.pc & ADDRESS_MASK);
+    goto *labels[ins->kind];
+unknown:
+    EXECUTE_CHECKED(handle_unknown);
+
+clear_screen:
+    EXECUTE(handle_clear_screen);
+return_:
+    EXECUTE_CHECKED(handle_return);
+jump:
+    EXECUTE(handle_jump);
+call:
+    EXECUTE_CHECKED(handle_call);
+skip_equal:
+    EXECUTE(handle_skip_equal);
+skip_not_equal:
+    EXECUTE(handle_skip_not_equal);
+skip_registers_equal:
+    EXECUTE(handle_skip_registers_equal);
+load:
+    EXECUTE(handle_load);
+add:
+    EXECUTE(handle_add);
+
+load_from_register:
+    EXECUTE(handle_load_from_register);
+or:
+    EXECUTE(handle_or);
+and:
+    EXECUTE(handle_and);
+xor:
+    EXECUTE(handle_xor);
+add_registers:
+    EXECUTE(handle_add_registers);
+subtract_x_y:
+    EXECUTE(handle_subtract_x_y);
+shift_right:
+    EXECUTE(handle_shift_right);
+subtract_y_x:
+    EXECUTE(handle_subtract_y_x);
+shift_left:
+    EXECUTE(handle_shift_left);
+
+skip_registers_not_equal:
+    EXECUTE(handle_skip_registers_not_equal);
+load_i:
+    EXECUTE(handle_load_i);
+jump_offset:
+    EXECUTE(handle_jump_offset);
+random:
+    EXECUTE(handle_random);
+draw:
+    EXECUTE(handle_draw);
+skip_key_pressed:
+    EXECUTE_CHECKED(handle_skip_key_pressed);
+skip_key_not_pressed:
+    EXECUTE_CHECKED(handle_skip_key_not_pressed);
+
+load_delay_timer:
+    EXECUTE(handle_load_delay_timer);
+wait_for_key:
+    EXECUTE(handle_wait_for_key);
+set_delay_timer:
+    EXECUTE(handle_set_delay_timer);
+set_sound_timer:
+    EXECUTE(handle_set_sound_timer);
+add_i:
+    EXECUTE(handle_add_i);
+load_sprite:
+    EXECUTE(handle_load_sprite);
+bcd:
+    EXECUTE_CHECKED(handle_bcd);
+register_dump:
+    EXECUTE_CHECKED(handle_register_dump);
+register_load:
+    EXECUTE_CHECKED(handle_register_load);
+
+fused_sprite:
+    EXECUTE_FUSED(handle_fused_sprite, handle_load, 3);
+fused_counted_loop:
+    EXECUTE_FUSED(handle_fused_counted_loop, handle_add, 3);
+fused_digit:
+    EXECUTE_FUSED(handle_fused_digit, handle_load_sprite, 2);
+fused_score:
+    EXECUTE_FUSED(handle_fused_score, handle_bcd, 2);
+
+#undef EXECUTE_FUSED
+#undef EXECUTE_CHECKED
+#undef EXECUTE
+#undef DISPATCH
+}
+
+#else
+
+static const struct fused_instruction fused_handlers[FUSED_KIND_COUNT] = {
+    [OP_FUSED_SPRITE - INSTRUCTION_KIND_COUNT] = { &handle_fused_sprite, OP_LOAD, 3 },
+    [OP_FUSED_COUNTED_LOOP - INSTRUCTION_KIND_COUNT] = { &handle_fused_counted_loop, OP_ADD, 3 },
+    [OP_FUSED_DIGIT - INSTRUCTION_KIND_COUNT] = { &handle_fused_digit, OP_LOAD_SPRITE, 2 },
+    [OP_FUSED_SCORE - INSTRUCTION_KIND_COUNT] = { &handle_fused_score, OP_BCD, 2 }
+};
+
+// Portable fallback for compilers without computed goto
+static void interpret(struct chip8 *chip8, unsigned long count)
+{
+    while (count > 0) {
+        struct instruction *ins = &chip8->decoded[chip8->cpu.pc & ADDRESS_MASK];
+
+        if (ins->kind == OP_UNDECODED) {
+            ins = decode_fused(chip8, chip8->cpu.pc & ADDRESS_MASK);
+        }
+
+        if (ins->kind < INSTRUCTION_KIND_COUNT) {
+            handlers[ins->kind](chip8, ins);
+            count -= 1;
+        } else {
+            const struct fused_instruction *fused = &fused_handlers[ins->kind - INSTRUCTION_KIND_COUNT];
+
+            if (count < fused->length) {
+                handlers[fused->head](chip8, ins);
+                count -= 1;
+            } else {
+                count -= fused->handler(chip8, ins);
+            }
+        }
+
+        if (chip8->halted) {
+            return;
+        }
+    }
+}
+
+#endif
+
+const struct interpreter INTERPRETER_NAME(QUIRKS) = {
+    .run = interpret,
+    .handlers = handlers
+};
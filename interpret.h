@@ -0,0 +1,18 @@
+#ifndef INTERPRET_H
+#define INTERPRET_H
+
+#include "chip8.h"
+#include "opcodes.h"
+
+// The interpreter and its handlers for one quirk set (see interpret.c)
+struct interpreter {
+    void (*run)(struct chip8 *chip8, unsigned long count);
+    const opcode_handler *handlers; // By instruction kind, like opcode_handlers
+};
+
+extern const struct interpreter interpreter_modern;
+extern const struct interpreter interpreter_cosmac_vip;
+extern const struct interpreter interpreter_chip48;
+extern const struct interpreter interpreter_schip;
+
+#endif
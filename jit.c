@@ -0,0 +1,1126 @@
+#define _DEFAULT_SOURCE
+
+#include "jit.h"
+#include "chip8.h"
+#include "opcodes.h"
+#include <stddef.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#if defined(__x86_64__) && defined(__unix__)
+
+#include <sys/mman.h>
+
+#define ADDRESS_MASK (CHIP8_MEMORY_SIZE - 1)
+
+#define CODE_SIZE (1 << 20) // native code buffer
+#define HOT_THRESHOLD 32 // interpreted visits before a block is compiled
+#define MAX_RECOMPILES 4 // blocks thrown away at an address before it is left to the interpreter
+#define VOLATILE_REWRITES 2 // writes into compiled code at an address before it is compiled as volatile
+#define MAX_BLOCK_INSTRUCTIONS 64
+#define MAX_BLOCK_BYTES (MAX_BLOCK_INSTRUCTIONS * 2)
+#define MAX_BLOCK_CODE 32768 // generous upper bound for one block
+
+// Runs at most budget guest instructions, chaining into other compiled blocks
+// while the budget allows, and returns how many it executed
+typedef uint32_t (*jit_block)(struct chip8 *chip8, uint32_t budget);
+
+#define CHAIN_OFFSET 24 // bytes of prologue skipped when chaining into a block
+
+struct jit {
+    struct jit_coverage coverage; // First, see jit.h
+    uint8_t *code;
+    size_t code_used;
+
+    jit_block blocks[CHIP8_MEMORY_SIZE]; // compiled block starting at each address
+    uint8_t block_bytes[CHIP8_MEMORY_SIZE]; // guest bytes covered by the block
+    uint8_t block_instructions[CHIP8_MEMORY_SIZE]; // most instructions one run executes
+    uint16_t heat[CHIP8_MEMORY_SIZE];
+    uint8_t invalidations[CHIP8_MEMORY_SIZE]; // blocks at each address thrown away, kept across flushes
+    uint8_t rewrites[CHIP8_MEMORY_SIZE]; // writes to each byte that threw compiled code away, likewise
+    uint64_t block_volatile[CHIP8_MEMORY_SIZE]; // instructions of the block read from memory as it runs
+
+    // operands handed to op_* handlers for instructions the JIT does not translate
+    struct instruction instructions[CHIP8_MEMORY_SIZE];
+};
+
+enum {
+    RAX = 0,
+    RCX = 1,
+    RDX = 2,
+    RBX = 3,
+    RSP = 4,
+    RBP = 5,
+    RSI = 6,
+    RDI = 7,
+    R8 = 8,
+    R9 = 9,
+    R10 = 10,
+    R11 = 11,
+    R12 = 12,
+    R13 = 13,
+    R14 = 14,
+    R15 = 15
+};
+
+// host registers that can hold guest V registers for the length of a block
+static const uint8_t register_pool[] = { RBP, R12, R13, R14, RSI, RDI, R8, R9, R10, R11 };
+
+#define POOL_SIZE (sizeof(register_pool) / sizeof(register_pool[0]))
+
+// rbx holds the struct chip8 pointer and r15 holds I
+#define NO_REGISTER 0xff
+
+#define OFFSET_V(i) ((int32_t)(offsetof(struct chip8, cpu.V) + (i)))
+#define OFFSET_I ((int32_t)offsetof(struct chip8, cpu.I))
+#define OFFSET_PC ((int32_t)offsetof(struct chip8, cpu.pc))
+#define OFFSET_DELAY_TIMER ((int32_t)offsetof(struct chip8, delay_timer))
+#define OFFSET_SOUND_TIMER ((int32_t)offsetof(struct chip8, sound_timer))
+#define OFFSET_HALTED ((int32_t)offsetof(struct chip8, halted))
+#define OFFSET_MEMORY(address) ((int32_t)(offsetof(struct chip8, memory) + (address)))
+
+// condition codes for setcc/jcc
+#define CC_EQUAL 0x4
+#define CC_NOT_EQUAL 0x5
+#define CC_BELOW 0x2 // carry
+#define CC_ABOVE 0x7
+
+struct emitter {
+    uint8_t *p;
+    uint8_t *end;
+    bool overflow;
+};
+
+// where a guest register lives while a block runs
+struct location {
+    uint8_t reg; // host register, or NO_REGISTER for [rbx + disp]
+    int32_t disp;
+};
+
+struct block_state {
+    struct jit *jit;
+    struct emitter e;
+    uint8_t mapping[16]; // host register for each V, or NO_REGISTER
+    bool written[16]; // V registers the native code stores to
+    bool uses_i;
+    bool writes_i;
+    uint64_t volatile_instructions; // bit n set when instruction n is read from memory as it runs
+};
+
+static void emit8(struct emitter *e, uint8_t value)
+{
+    if (e->p >= e->end) {
+        e->overflow = true;
+        return;
+    }
+    *e->p++ = value;
+}
+
+static void emit16(struct emitter *e, uint16_t value)
+{
+    emit8(e, value & 0xff);
+    emit8(e, value >> 8);
+}
+
+static void emit32(struct emitter *e, uint32_t value)
+{
+    emit16(e, value & 0xffff);
+    emit16(e, value >> 16);
+}
+
+static void emit64(struct emitter *e, uint64_t value)
+{
+    emit32(e, value & 0xffffffff);
+    emit32(e, value >> 32);
+}
+
+static struct location memory_location(int32_t disp)
+{
+    struct location loc = { .reg = NO_REGISTER, .disp = disp };
+    return loc;
+}
+
+static struct location register_location(uint8_t reg)
+{
+    struct location loc = { .reg = reg, .disp = 0 };
+    return loc;
+}
+
+static struct location v_location(struct block_state *state, uint8_t index)
+{
+    if (state->mapping[index] != NO_REGISTER) {
+        return register_location(state->mapping[index]);
+    }
+    return memory_location(OFFSET_V(index));
+}
+
+// <opcode> with an 8-bit reg field and an r/m operand. The REX prefix is always
+// present so spl/bpl/sil/dil and r8b-r15b can be addressed.
+static void emit_rm8(struct emitter *e, uint8_t opcode, uint8_t reg, struct location rm)
+{
+    uint8_t rex = 0x40 | ((reg >> 3) << 2);
+
+    if (rm.reg != NO_REGISTER) {
+        emit8(e, rex | (rm.reg >> 3));
+        emit8(e, opcode);
+        emit8(e, 0xc0 | ((reg & 7) << 3) | (rm.reg & 7));
+    } else {
+        emit8(e, rex);
+        emit8(e, opcode);
+        emit8(e, 0x80 | ((reg & 7) << 3) | RBX);
+        emit32(e, rm.disp);
+    }
+}
+
+// mov reg8, r/m8
+static void emit_load8(struct emitter *e, uint8_t reg, struct location src)
+{
+    emit_rm8(e, 0x8a, reg, src);
+}
+
+// mov r/m8, reg8
+static void emit_store8(struct emitter *e, struct location dst, uint8_t reg)
+{
+    emit_rm8(e, 0x88, reg, dst);
+}
+
+// mov r/m8, imm8
+static void emit_store_imm8(struct emitter *e, struct location dst, uint8_t value)
+{
+    emit_rm8(e, 0xc6, 0, dst);
+    emit8(e, value);
+}
+
+// <group 1 op> r/m8, imm8 (0 add, 4 and, 7 cmp)
+static void emit_alu_imm8(struct emitter *e, uint8_t digit, struct location dst, uint8_t value)
+{
+    emit_rm8(e, 0x80, digit, dst);
+    emit8(e, value);
+}
+
+// setcc reg8
+static void emit_setcc(struct emitter *e, uint8_t cc, uint8_t reg)
+{
+    emit8(e, 0x40 | (reg >> 3));
+    emit8(e, 0x0f);
+    emit8(e, 0x90 | cc);
+    emit8(e, 0xc0 | (reg & 7));
+}
+
+// jcc rel32, returns the offset to patch
+static uint8_t *emit_jcc(struct emitter *e, uint8_t cc)
+{
+    emit8(e, 0x0f);
+    emit8(e, 0x80 | cc);
+    uint8_t *patch = e->p;
+    emit32(e, 0);
+    return patch;
+}
+
+static void patch_jump(struct emitter *e, uint8_t *patch)
+{
+    if (e->overflow) {
+        return;
+    }
+    int32_t rel = (int32_t)(e->p - (patch + 4));
+    memcpy(patch, &rel, sizeof(rel));
+}
+
+// call an absolute address through rax
+static void emit_call(struct emitter *e, void *function)
+{
+    emit8(e, 0x48); // mov rax, imm64
+    emit8(e, 0xb8);
+    emit64(e, (uint64_t)(uintptr_t)function);
+    emit8(e, 0xff); // call rax
+    emit8(e, 0xd0);
+}
+
+// mov rdi, rbx
+static void emit_first_argument(struct emitter *e)
+{
+    emit8(e, 0x48);
+    emit8(e, 0x89);
+    emit8(e, 0xdf);
+}
+
+// mov word [rbx + pc], imm16
+static void emit_store_pc(struct emitter *e, uint16_t pc)
+{
+    emit8(e, 0x66);
+    emit8(e, 0xc7);
+    emit8(e, 0x83);
+    emit32(e, OFFSET_PC);
+    emit16(e, pc & ADDRESS_MASK);
+}
+
+static void emit_load_registers(struct block_state *state)
+{
+    for (uint8_t i = 0; i < 16; i++) {
+        if (state->mapping[i] != NO_REGISTER) {
+            emit_load8(&state->e, state->mapping[i], memory_location(OFFSET_V(i)));
+        }
+    }
+
+    if (state->uses_i) {
+        // movzx r15d, word [rbx + I]
+        emit8(&state->e, 0x44);
+        emit8(&state->e, 0x0f);
+        emit8(&state->e, 0xb7);
+        emit8(&state->e, 0xbb);
+        emit32(&state->e, OFFSET_I);
+    }
+}
+
+static void emit_store_registers(struct block_state *state)
+{
+    for (uint8_t i = 0; i < 16; i++) {
+        if (state->mapping[i] != NO_REGISTER && state->written[i]) {
+            emit_store8(&state->e, memory_location(OFFSET_V(i)), state->mapping[i]);
+        }
+    }
+
+    if (state->writes_i) {
+        // mov word [rbx + I], r15w
+        emit8(&state->e, 0x66);
+        emit8(&state->e, 0x44);
+        emit8(&state->e, 0x89);
+        emit8(&state->e, 0xbb);
+        emit32(&state->e, OFFSET_I);
+    }
+}
+
+static void emit_prologue(struct block_state *state)
+{
+    struct emitter *e = &state->e;
+    uint8_t *start = e->p;
+
+    emit8(e, 0x53); // push rbx
+    emit8(e, 0x55); // push rbp
+    emit8(e, 0x41); // push r12
+    emit8(e, 0x54);
+    emit8(e, 0x41); // push r13
+    emit8(e, 0x55);
+    emit8(e, 0x41); // push r14
+    emit8(e, 0x56);
+    emit8(e, 0x41); // push r15
+    emit8(e, 0x57);
+    emit8(e, 0x48); // sub rsp, 8 (keep calls 16-byte aligned)
+    emit8(e, 0x83);
+    emit8(e, 0xec);
+    emit8(e, 0x08);
+    emit8(e, 0x48); // mov rbx, rdi
+    emit8(e, 0x89);
+    emit8(e, 0xfb);
+    emit8(e, 0x89); // mov [rsp], esi (budget left)
+    emit8(e, 0x34);
+    emit8(e, 0x24);
+    emit8(e, 0x89); // mov [rsp + 4], esi (budget on entry)
+    emit8(e, 0x74);
+    emit8(e, 0x24);
+    emit8(e, 0x04);
+
+    // blocks jumping straight into this one enter here
+    if (!e->overflow && e->p - start != CHAIN_OFFSET) {
+        e->overflow = true;
+    }
+
+    emit_load_registers(state);
+}
+
+// continue in the block compiled for pc when there is one and the budget
+// covers it, otherwise fall through
+static void emit_chain(struct block_state *state, uint16_t pc)
+{
+    struct emitter *e = &state->e;
+    struct jit *jit = state->jit;
+
+    pc &= ADDRESS_MASK;
+
+    emit8(e, 0x48); // mov rcx, imm64
+    emit8(e, 0xb9);
+    emit64(e, (uint64_t)(uintptr_t)&jit->block_instructions[pc]);
+    emit8(e, 0x0f); // movzx ecx, byte [rcx]
+    emit8(e, 0xb6);
+    emit8(e, 0x09);
+    emit8(e, 0x39); // cmp [rsp], ecx
+    emit8(e, 0x0c);
+    emit8(e, 0x24);
+    uint8_t *short_budget = emit_jcc(e, CC_BELOW);
+
+    emit8(e, 0x48); // mov rax, imm64
+    emit8(e, 0xb8);
+    emit64(e, (uint64_t)(uintptr_t)&jit->blocks[pc]);
+    emit8(e, 0x48); // mov rax, [rax]
+    emit8(e, 0x8b);
+    emit8(e, 0x00);
+    emit8(e, 0x48); // test rax, rax
+    emit8(e, 0x85);
+    emit8(e, 0xc0);
+    uint8_t *not_compiled = emit_jcc(e, CC_EQUAL);
+
+    emit8(e, 0x48); // add rax, CHAIN_OFFSET
+    emit8(e, 0x83);
+    emit8(e, 0xc0);
+    emit8(e, CHAIN_OFFSET);
+    emit8(e, 0xff); // jmp rax
+    emit8(e, 0xe0);
+
+    patch_jump(e, short_budget);
+    patch_jump(e, not_compiled);
+}
+
+static void emit_epilogue(struct emitter *e);
+
+// the same after a handler stored the pc, which is only known at run time,
+// unless the handler halted the machine
+static void emit_chain_dynamic(struct block_state *state)
+{
+    struct emitter *e = &state->e;
+    struct jit *jit = state->jit;
+
+    emit8(e, 0x80); // cmp byte [rbx + halted], 0
+    emit8(e, 0xbb);
+    emit32(e, OFFSET_HALTED);
+    emit8(e, 0);
+    uint8_t *halted = emit_jcc(e, CC_NOT_EQUAL);
+
+    emit8(e, 0x0f); // movzx ecx, word [rbx + pc]
+    emit8(e, 0xb7);
+    emit8(e, 0x8b);
+    emit32(e, OFFSET_PC);
+    emit8(e, 0x81); // and ecx, ADDRESS_MASK
+    emit8(e, 0xe1);
+    emit32(e, ADDRESS_MASK);
+
+    emit8(e, 0x48); // mov rdx, imm64
+    emit8(e, 0xba);
+    emit64(e, (uint64_t)(uintptr_t)jit->block_instructions);
+    emit8(e, 0x0f); // movzx eax, byte [rdx + rcx]
+    emit8(e, 0xb6);
+    emit8(e, 0x04);
+    emit8(e, 0x0a);
+    emit8(e, 0x39); // cmp [rsp], eax
+    emit8(e, 0x04);
+    emit8(e, 0x24);
+    uint8_t *short_budget = emit_jcc(e, CC_BELOW);
+
+    emit8(e, 0x48); // mov rdx, imm64
+    emit8(e, 0xba);
+    emit64(e, (uint64_t)(uintptr_t)jit->blocks);
+    emit8(e, 0x48); // mov rax, [rdx + rcx * 8]
+    emit8(e, 0x8b);
+    emit8(e, 0x04);
+    emit8(e, 0xca);
+    emit8(e, 0x48); // test rax, rax
+    emit8(e, 0x85);
+    emit8(e, 0xc0);
+    uint8_t *not_compiled = emit_jcc(e, CC_EQUAL);
+
+    emit8(e, 0x48); // add rax, CHAIN_OFFSET
+    emit8(e, 0x83);
+    emit8(e, 0xc0);
+    emit8(e, CHAIN_OFFSET);
+    emit8(e, 0xff); // jmp rax
+    emit8(e, 0xe0);
+
+    patch_jump(e, halted);
+    patch_jump(e, short_budget);
+    patch_jump(e, not_compiled);
+}
+
+// Leave the block. pc < 0 means a handler already stored the new pc and the
+// guest registers in memory are current.
+static void emit_exit(struct block_state *state, int32_t pc, uint32_t executed)
+{
+    struct emitter *e = &state->e;
+
+    if (pc >= 0) {
+        emit_store_registers(state);
+        emit_store_pc(e, pc);
+    }
+
+    emit8(e, 0x81); // sub dword [rsp], imm32
+    emit8(e, 0x2c);
+    emit8(e, 0x24);
+    emit32(e, executed);
+
+    if (pc >= 0) {
+        emit_chain(state, pc);
+    } else {
+        emit_chain_dynamic(state);
+    }
+
+    emit_epilogue(e);
+}
+
+// return the instructions executed, budget on entry less budget left
+static void emit_epilogue(struct emitter *e)
+{
+    emit8(e, 0x8b); // mov eax, [rsp + 4]
+    emit8(e, 0x44);
+    emit8(e, 0x24);
+    emit8(e, 0x04);
+    emit8(e, 0x2b); // sub eax, [rsp]
+    emit8(e, 0x04);
+    emit8(e, 0x24);
+
+    emit8(e, 0x48); // add rsp, 8
+    emit8(e, 0x83);
+    emit8(e, 0xc4);
+    emit8(e, 0x08);
+    emit8(e, 0x41); // pop r15
+    emit8(e, 0x5f);
+    emit8(e, 0x41); // pop r14
+    emit8(e, 0x5e);
+    emit8(e, 0x41); // pop r13
+    emit8(e, 0x5d);
+    emit8(e, 0x41); // pop r12
+    emit8(e, 0x5c);
+    emit8(e, 0x5d); // pop rbp
+    emit8(e, 0x5b); // pop rbx
+    emit8(e, 0xc3); // ret
+}
+
+// run one instruction through its op_* handler with the guest registers spilled
+static void emit_fallback(struct block_state *state, uint16_t pc, const struct instruction *ins)
+{
+    struct emitter *e = &state->e;
+
+    state->jit->instructions[pc] = *ins;
+
+    emit_store_registers(state);
+    emit_store_pc(e, pc);
+    emit_first_argument(e);
+    emit8(e, 0x48); // mov rsi, imm64
+    emit8(e, 0xbe);
+    emit64(e, (uint64_t)(uintptr_t)&state->jit->instructions[pc]);
+    emit_call(e, (void *)opcode_handlers[ins->kind]);
+}
+
+// Vx = Vx <op> Vy for or/and/xor (op r/m8, r8 encodings)
+static void emit_logic(struct block_state *state, uint8_t opcode, const struct instruction *ins)
+{
+    emit_load8(&state->e, RAX, v_location(state, ins->y));
+    emit_rm8(&state->e, opcode, RAX, v_location(state, ins->x));
+}
+
+// VF = <a> > <b>; Vx = <a> - <b>, re-reading operands after VF is written
+// exactly like the handlers do
+static void emit_subtract(struct block_state *state, uint8_t a, uint8_t b, uint8_t x)
+{
+    struct emitter *e = &state->e;
+
+    emit_load8(e, RAX, v_location(state, a));
+    emit_rm8(e, 0x3a, RAX, v_location(state, b)); // cmp al, b
+    emit_setcc(e, CC_ABOVE, RCX);
+    emit_store8(e, v_location(state, 0xf), RCX);
+    emit_load8(e, RAX, v_location(state, a));
+    emit_rm8(e, 0x2a, RAX, v_location(state, b)); // sub al, b
+    emit_store8(e, v_location(state, x), RAX);
+}
+
+// skip the next instruction when the flags match cc
+static void emit_skip(struct block_state *state, uint8_t cc, uint16_t pc, uint32_t executed)
+{
+    uint8_t *patch = emit_jcc(&state->e, cc);
+
+    emit_exit(state, pc + 2, executed);
+    patch_jump(&state->e, patch);
+    emit_exit(state, pc + 4, executed);
+}
+
+// movzx eax, al
+static void emit_zero_extend_al(struct emitter *e)
+{
+    emit8(e, 0x0f);
+    emit8(e, 0xb6);
+    emit8(e, 0xc0);
+}
+
+static bool is_native(uint8_t kind)
+{
+    switch (kind) {
+    case OP_JUMP:
+    case OP_SKIP_EQUAL:
+    case OP_SKIP_NOT_EQUAL:
+    case OP_SKIP_REGISTERS_EQUAL:
+    case OP_SKIP_REGISTERS_NOT_EQUAL:
+    case OP_LOAD:
+    case OP_ADD:
+    case OP_LOAD_FROM_REGISTER:
+    case OP_OR:
+    case OP_AND:
+    case OP_XOR:
+    case OP_ADD_REGISTERS:
+    case OP_SUBTRACT_X_Y:
+    case OP_SHIFT_RIGHT:
+    case OP_SUBTRACT_Y_X:
+    case OP_SHIFT_LEFT:
+    case OP_LOAD_I:
+    case OP_LOAD_DELAY_TIMER:
+    case OP_SET_DELAY_TIMER:
+    case OP_SET_SOUND_TIMER:
+    case OP_ADD_I:
+    case OP_LOAD_SPRITE:
+        return true;
+    default:
+        return false;
+    }
+}
+
+// instructions after which the block cannot continue in a straight line
+static bool ends_block(uint8_t kind)
+{
+    switch (kind) {
+    case OP_UNKNOWN:
+    case OP_RETURN:
+    case OP_JUMP:
+    case OP_CALL:
+    case OP_SKIP_EQUAL:
+    case OP_SKIP_NOT_EQUAL:
+    case OP_SKIP_REGISTERS_EQUAL:
+    case OP_SKIP_REGISTERS_NOT_EQUAL:
+    case OP_JUMP_OFFSET:
+    case OP_DRAW:
+    case OP_SKIP_KEY_PRESSED:
+    case OP_SKIP_KEY_NOT_PRESSED:
+    case OP_WAIT_FOR_KEY:
+    case OP_BCD: // memory writes may land inside this block
+    case OP_REGISTER_DUMP:
+    case OP_REGISTER_LOAD: // may trap and halt
+        return true;
+    default:
+        return false;
+    }
+}
+
+static void count_use(uint32_t uses[16], bool written[16], const struct instruction *ins)
+{
+    switch (ins->kind) {
+    case OP_SKIP_EQUAL:
+    case OP_SKIP_NOT_EQUAL:
+    case OP_ADD_I:
+    case OP_LOAD_SPRITE:
+    case OP_SET_DELAY_TIMER:
+    case OP_SET_SOUND_TIMER:
+        uses[ins->x] += 1;
+        break;
+    case OP_SKIP_REGISTERS_EQUAL:
+    case OP_SKIP_REGISTERS_NOT_EQUAL:
+        uses[ins->x] += 1;
+        uses[ins->y] += 1;
+        break;
+    case OP_LOAD:
+    case OP_ADD:
+    case OP_LOAD_DELAY_TIMER:
+        uses[ins->x] += 1;
+        written[ins->x] = true;
+        break;
+    case OP_LOAD_FROM_REGISTER:
+    case OP_OR:
+    case OP_AND:
+    case OP_XOR:
+        uses[ins->x] += 1;
+        uses[ins->y] += 1;
+        written[ins->x] = true;
+        break;
+    case OP_ADD_REGISTERS:
+    case OP_SUBTRACT_X_Y:
+    case OP_SHIFT_RIGHT:
+    case OP_SUBTRACT_Y_X:
+    case OP_SHIFT_LEFT:
+        uses[ins->x] += 1;
+        uses[ins->y] += 1;
+        uses[0xf] += 1;
+        written[ins->x] = true;
+        written[0xf] = true;
+        break;
+    }
+
+    if (ins->kind == OP_ADD_I) {
+        uses[0xf] += 1;
+        written[0xf] = true;
+    }
+}
+
+// give the most used V registers a host register for the whole block
+static void allocate_registers(struct block_state *state, const uint32_t uses[16])
+{
+    bool taken[16] = { false };
+
+    memset(state->mapping, NO_REGISTER, sizeof(state->mapping));
+
+    for (size_t slot = 0; slot < POOL_SIZE; slot++) {
+        int best = -1;
+
+        for (int i = 0; i < 16; i++) {
+            if (!taken[i] && uses[i] > 0 && (best < 0 || uses[i] > uses[best])) {
+                best = i;
+            }
+        }
+
+        if (best < 0) {
+            break;
+        }
+
+        taken[best] = true;
+        state->mapping[best] = register_pool[slot];
+    }
+}
+
+static void emit_instruction(struct block_state *state, uint16_t pc, const struct instruction *ins, uint32_t executed)
+{
+    struct emitter *e = &state->e;
+
+    if (!is_native(ins->kind)) {
+        emit_fallback(state, pc, ins);
+
+        if (ends_block(ins->kind)) {
+            emit_exit(state, -1, executed);
+        } else {
+            emit_load_registers(state);
+        }
+        return;
+    }
+
+    switch (ins->kind) {
+    case OP_JUMP:
+        emit_exit(state, ins->nnn, executed);
+        break;
+    case OP_SKIP_EQUAL:
+        emit_alu_imm8(e, 7, v_location(state, ins->x), ins->kk);
+        emit_skip(state, CC_EQUAL, pc, executed);
+        break;
+    case OP_SKIP_NOT_EQUAL:
+        emit_alu_imm8(e, 7, v_location(state, ins->x), ins->kk);
+        emit_skip(state, CC_NOT_EQUAL, pc, executed);
+        break;
+    case OP_SKIP_REGISTERS_EQUAL:
+        emit_load8(e, RAX, v_location(state, ins->x));
+        emit_rm8(e, 0x3a, RAX, v_location(state, ins->y));
+        emit_skip(state, CC_EQUAL, pc, executed);
+        break;
+    case OP_SKIP_REGISTERS_NOT_EQUAL:
+        emit_load8(e, RAX, v_location(state, ins->x));
+        emit_rm8(e, 0x3a, RAX, v_location(state, ins->y));
+        emit_skip(state, CC_NOT_EQUAL, pc, executed);
+        break;
+    case OP_LOAD:
+        emit_store_imm8(e, v_location(state, ins->x), ins->kk);
+        break;
+    case OP_ADD:
+        emit_alu_imm8(e, 0, v_location(state, ins->x), ins->kk);
+        break;
+    case OP_LOAD_FROM_REGISTER:
+        emit_load8(e, RAX, v_location(state, ins->y));
+        emit_store8(e, v_location(state, ins->x), RAX);
+        break;
+    case OP_OR:
+        emit_logic(state, 0x08, ins);
+        break;
+    case OP_AND:
+        emit_logic(state, 0x20, ins);
+        break;
+    case OP_XOR:
+        emit_logic(state, 0x30, ins);
+        break;
+    case OP_ADD_REGISTERS:
+        emit_load8(e, RAX, v_location(state, ins->x));
+        emit_rm8(e, 0x02, RAX, v_location(state, ins->y)); // add al, Vy
+        emit_setcc(e, CC_BELOW, RCX);
+        emit_store8(e, v_location(state, 0xf), RCX);
+        emit_store8(e, v_location(state, ins->x), RAX);
+        break;
+    case OP_SUBTRACT_X_Y:
+        emit_subtract(state, ins->x, ins->y, ins->x);
+        break;
+    case OP_SUBTRACT_Y_X:
+        emit_subtract(state, ins->y, ins->x, ins->x);
+        break;
+    case OP_SHIFT_RIGHT:
+        emit_load8(e, RAX, v_location(state, ins->x));
+        emit_alu_imm8(e, 4, register_location(RAX), 0x1); // and al, 1
+        emit_store8(e, v_location(state, 0xf), RAX);
+        emit_load8(e, RAX, v_location(state, ins->x));
+        emit_rm8(e, 0xd0, 5, register_location(RAX)); // shr al, 1
+        emit_store8(e, v_location(state, ins->x), RAX);
+        break;
+    case OP_SHIFT_LEFT:
+        emit_load8(e, RAX, v_location(state, ins->x));
+        emit_rm8(e, 0xc0, 5, register_location(RAX)); // shr al, 7
+        emit8(e, 7);
+        emit_store8(e, v_location(state, 0xf), RAX);
+        emit_load8(e, RAX, v_location(state, ins->x));
+        emit_rm8(e, 0xd0, 4, register_location(RAX)); // shl al, 1
+        emit_store8(e, v_location(state, ins->x), RAX);
+        break;
+    case OP_LOAD_I:
+        emit8(e, 0x41); // mov r15d, imm32
+        emit8(e, 0xbf);
+        emit32(e, ins->nnn);
+        break;
+    case OP_ADD_I:
+        emit_load8(e, RAX, v_location(state, ins->x));
+        emit_zero_extend_al(e);
+        emit8(e, 0x41); // add r15d, eax
+        emit8(e, 0x01);
+        emit8(e, 0xc7);
+        emit8(e, 0x45); // movzx r15d, r15w
+        emit8(e, 0x0f);
+        emit8(e, 0xb7);
+        emit8(e, 0xff);
+        emit8(e, 0x41); // cmp r15d, 0xfff
+        emit8(e, 0x81);
+        emit8(e, 0xff);
+        emit32(e, 0xfff);
+        emit_setcc(e, CC_ABOVE, RCX);
+        emit_store8(e, v_location(state, 0xf), RCX);
+        break;
+    case OP_LOAD_SPRITE:
+        emit_load8(e, RAX, v_location(state, ins->x));
+        emit_zero_extend_al(e);
+        emit8(e, 0x44); // lea r15d, [rax + rax * 4]
+        emit8(e, 0x8d);
+        emit8(e, 0x3c);
+        emit8(e, 0x80);
+        break;
+    case OP_LOAD_DELAY_TIMER:
+        emit_load8(e, RAX, memory_location(OFFSET_DELAY_TIMER));
+        emit_store8(e, v_location(state, ins->x), RAX);
+        break;
+    case OP_SET_DELAY_TIMER:
+    case OP_SET_SOUND_TIMER:
+        emit_load8(e, RAX, v_location(state, ins->x));
+        emit_store8(e, memory_location(ins->kind == OP_SET_DELAY_TIMER ? OFFSET_DELAY_TIMER : OFFSET_SOUND_TIMER), RAX);
+        break;
+    }
+}
+
+// whether the instruction at pc keeps being rewritten
+static bool is_volatile(const struct jit *jit, uint16_t pc)
+{
+    return jit->rewrites[pc] >= VOLATILE_REWRITES || jit->rewrites[pc + 1] >= VOLATILE_REWRITES;
+}
+
+// the kinds whose second byte is all operand, which a volatile instruction
+// then reads from memory
+static uint8_t operand_class(uint8_t kind)
+{
+    switch (kind) {
+    case OP_SKIP_EQUAL:
+        return 0x30;
+    case OP_SKIP_NOT_EQUAL:
+        return 0x40;
+    case OP_LOAD:
+        return 0x60;
+    case OP_ADD:
+        return 0x70;
+    default:
+        return 0;
+    }
+}
+
+// An instruction that keeps being rewritten, usually a counter or constant
+// kept in its own kk: its first byte is checked, and kk is read from
+// memory, as the block runs, so writes to it need not throw the block
+// away. When the first byte has changed the block is left before it.
+static void emit_volatile(struct block_state *state, uint16_t pc, const struct instruction *ins, uint32_t executed)
+{
+    struct emitter *e = &state->e;
+
+    emit8(e, 0x80); // cmp byte [rbx + memory + pc], imm8
+    emit8(e, 0xbb);
+    emit32(e, OFFSET_MEMORY(pc));
+    emit8(e, operand_class(ins->kind) | ins->x);
+    uint8_t *unchanged = emit_jcc(e, CC_EQUAL);
+
+    // leave without chaining, which could come straight back here
+    emit_store_registers(state);
+    emit_store_pc(e, pc);
+    emit8(e, 0x81); // sub dword [rsp], imm32
+    emit8(e, 0x2c);
+    emit8(e, 0x24);
+    emit32(e, executed - 1);
+    emit_epilogue(e);
+    patch_jump(e, unchanged);
+
+    emit_load8(e, RAX, memory_location(OFFSET_MEMORY(pc + 1)));
+
+    switch (ins->kind) {
+    case OP_SKIP_EQUAL:
+        emit_rm8(e, 0x38, RAX, v_location(state, ins->x)); // cmp Vx, al
+        emit_skip(state, CC_EQUAL, pc, executed);
+        break;
+    case OP_SKIP_NOT_EQUAL:
+        emit_rm8(e, 0x38, RAX, v_location(state, ins->x)); // cmp Vx, al
+        emit_skip(state, CC_NOT_EQUAL, pc, executed);
+        break;
+    case OP_LOAD:
+        emit_store8(e, v_location(state, ins->x), RAX);
+        break;
+    case OP_ADD:
+        emit_rm8(e, 0x00, RAX, v_location(state, ins->x)); // add Vx, al
+        break;
+    }
+}
+
+static bool compile(struct jit *jit, struct chip8 *chip8, uint16_t start)
+{
+    struct instruction instructions[MAX_BLOCK_INSTRUCTIONS];
+    uint32_t uses[16] = { 0 };
+    struct block_state state = { .jit = jit };
+    uint32_t count = 0;
+    uint16_t pc = start;
+
+    // find the extent of the block
+    while (count < MAX_BLOCK_INSTRUCTIONS && pc + 1 < CHIP8_MEMORY_SIZE) {
+        struct instruction *ins = &instructions[count];
+
+        opcode_decode(chip8->memory[pc] << 8 | chip8->memory[pc + 1], ins);
+
+        // anything but a kk operand rewritten again and again is left to
+        // the interpreter, the block ends before it
+        if (is_volatile(jit, pc)) {
+            if (operand_class(ins->kind) == 0) {
+                break;
+            }
+            state.volatile_instructions |= 1ULL << count;
+        }
+
+        count_use(uses, state.written, ins);
+
+        if (ins->kind == OP_LOAD_I || ins->kind == OP_ADD_I || ins->kind == OP_LOAD_SPRITE) {
+            state.uses_i = true;
+            state.writes_i = true;
+        }
+
+        count += 1;
+        pc += 2;
+
+        if (ends_block(ins->kind)) {
+            break;
+        }
+    }
+
+    if (count == 0) {
+        return false;
+    }
+
+    allocate_registers(&state, uses);
+
+    state.e.p = jit->code + jit->code_used;
+    state.e.end = state.e.p + MAX_BLOCK_CODE;
+
+    uint8_t *entry = state.e.p;
+    emit_prologue(&state);
+
+    pc = start;
+    for (uint32_t i = 0; i < count; i++) {
+        if (state.volatile_instructions >> i & 1) {
+            emit_volatile(&state, pc, &instructions[i], i + 1);
+        } else {
+            emit_instruction(&state, pc, &instructions[i], i + 1);
+        }
+        pc += 2;
+    }
+
+    // ran out of instructions without a jump, continue after the block
+    if (!ends_block(instructions[count - 1].kind)) {
+        emit_exit(&state, pc, count);
+    }
+
+    if (state.e.overflow) {
+        return false;
+    }
+
+    jit->code_used += state.e.p - entry;
+    jit->blocks[start] = (jit_block)(void *)entry;
+    jit->block_bytes[start] = count * 2;
+    jit->block_instructions[start] = count;
+    jit->block_volatile[start] = state.volatile_instructions;
+
+    // writes to volatile instructions are checked for as the block runs
+    for (uint32_t i = 0; i < count * 2; i++) {
+        if (!(state.volatile_instructions >> (i / 2) & 1)) {
+            jit->coverage.bytes[start + i] += 1;
+        }
+    }
+    return true;
+}
+
+static void drop_block(struct jit *jit, uint16_t start)
+{
+    for (uint32_t i = 0; i < jit->block_bytes[start]; i++) {
+        if (!(jit->block_volatile[start] >> (i / 2) & 1)) {
+            jit->coverage.bytes[start + i] -= 1;
+        }
+    }
+
+    jit->blocks[start] = NULL;
+    jit->block_bytes[start] = 0;
+
+    if (jit->invalidations[start] < MAX_RECOMPILES) {
+        jit->invalidations[start] += 1;
+    }
+}
+
+static void flush(struct jit *jit)
+{
+    memset(jit->blocks, 0, sizeof(jit->blocks));
+    memset(jit->block_bytes, 0, sizeof(jit->block_bytes));
+    memset(jit->heat, 0, sizeof(jit->heat));
+    memset(&jit->coverage, 0, sizeof(jit->coverage));
+    jit->code_used = 0;
+}
+
+struct jit *jit_create(void)
+{
+    struct jit *jit = calloc(1, sizeof(struct jit));
+
+    if (jit == NULL) {
+        return NULL;
+    }
+
+    jit->code = mmap(NULL, CODE_SIZE, PROT_READ | PROT_WRITE | PROT_EXEC, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+
+    if (jit->code == MAP_FAILED) {
+        free(jit);
+        return NULL;
+    }
+
+    return jit;
+}
+
+void jit_destroy(struct jit *jit)
+{
+    if (jit == NULL) {
+        return;
+    }
+
+    munmap(jit->code, CODE_SIZE);
+    free(jit);
+}
+
+// instructions the interpreter can run from pc before reaching a compiled
+// block or leaving the straight line, at most count. Classes that may jump,
+// skip, wait or write memory end the run; cheaper than decoding for
+// ends_block, and as good for finding where the next block may start.
+static unsigned long interpreted_run(const struct jit *jit, const struct chip8 *chip8, uint16_t pc, unsigned long count)
+{
+    static const bool straight[16] = {
+        [0x6] = true, [0x7] = true, [0x8] = true, [0xA] = true, [0xC] = true
+    };
+    unsigned long run = 0;
+
+    while (run < count && run < MAX_BLOCK_INSTRUCTIONS) {
+        bool ends = !straight[chip8->memory[pc] >> 4];
+
+        run += 1;
+        pc = (pc + 2) & ADDRESS_MASK;
+
+        if (ends || jit->blocks[pc] != NULL) {
+            break;
+        }
+    }
+
+    return run;
+}
+
+void jit_run(struct chip8 *chip8, unsigned long count)
+{
+    struct jit *jit = chip8->jit;
+
+    while (count > 0 && !chip8->halted) {
+        uint16_t pc = chip8->cpu.pc & ADDRESS_MASK;
+        jit_block block = jit->blocks[pc];
+
+        // code rewritten again and again is compiled less and less often,
+        // then not at all, rather than filling the buffer with dead blocks
+        if (block == NULL && jit->invalidations[pc] < MAX_RECOMPILES
+            && ++jit->heat[pc] >= HOT_THRESHOLD << jit->invalidations[pc]) {
+            jit->heat[pc] = 0;
+
+            if (CODE_SIZE - jit->code_used < MAX_BLOCK_CODE) {
+                flush(jit);
+            }
+            if (compile(jit, chip8, pc)) {
+                block = jit->blocks[pc];
+            }
+        }
+
+        if (block != NULL && jit->block_instructions[pc] <= count) {
+            uint32_t executed = block(chip8, count > UINT32_MAX ? UINT32_MAX : count);
+
+            // a volatile first instruction was rewritten into another kind
+            if (executed == 0) {
+                drop_block(jit, pc);
+            }
+            count -= executed;
+        } else {
+            // code that keeps being rewritten is usually in a loop with the
+            // code rewriting it, so the rest of the budget is interpreted
+            // rather than entering and leaving blocks on every pass
+            unsigned long run = count;
+
+            if (jit->invalidations[pc] < MAX_RECOMPILES) {
+                run = interpreted_run(jit, chip8, pc, count);
+            }
+
+            chip8_interpret(chip8, run);
+            count -= run;
+        }
+    }
+}
+
+// drop every block that covers any of the written bytes, called only for
+// ranges jit_covers
+void jit_invalidate(struct jit *jit, uint16_t address, uint16_t length)
+{
+    int32_t first = (int32_t)address - MAX_BLOCK_BYTES;
+    int32_t last = (int32_t)address + length;
+
+    if (first < 0) {
+        first = 0;
+    }
+    if (last > CHIP8_MEMORY_SIZE) {
+        last = CHIP8_MEMORY_SIZE;
+    }
+
+    for (int32_t i = address; i < last; i++) {
+        if (jit->coverage.bytes[i] != 0 && jit->rewrites[i] < VOLATILE_REWRITES) {
+            jit->rewrites[i] += 1;
+        }
+    }
+
+    for (int32_t start = first; start < last; start++) {
+        if (jit->blocks[start] != NULL && start + jit->block_bytes[start] > address) {
+            drop_block(jit, start);
+        }
+    }
+}
+
+#else
+
+// no native backend for this host, chip8_enable_jit() reports failure
+
+struct jit *jit_create(void)
+{
+    return NULL;
+}
+
+void jit_destroy(struct jit *jit)
+{
+}
+
+void jit_run(struct chip8 *chip8, unsigned long count)
+{
+    chip8_interpret(chip8, count);
+}
+
+void jit_invalidate(struct jit *jit, uint16_t address, uint16_t length)
+{
+}
+
+#endif
@@ -0,0 +1,33 @@
+#ifndef JIT_H
+#define JIT_H
+
+#include "chip8.h"
+
+struct jit;
+
+// The part of the JIT looked at on every write to memory, the first member
+// of struct jit so that writes to data need no call into it
+struct jit_coverage {
+    uint8_t bytes[CHIP8_MEMORY_SIZE]; // Compiled blocks covering each byte
+};
+
+struct jit *jit_create(void);
+void jit_destroy(struct jit *jit);
+void jit_run(struct chip8 *chip8, unsigned long count);
+void jit_invalidate(struct jit *jit, uint16_t address, uint16_t length);
+
+// whether any compiled block covers the range, which wraps at the end of
+// memory
+static inline bool jit_covers(const struct jit *jit, uint16_t address, uint16_t length)
+{
+    const struct jit_coverage *coverage = (const struct jit_coverage *)jit;
+
+    for (uint32_t i = 0; i < length; i++) {
+        if (coverage->bytes[(address + i) % CHIP8_MEMORY_SIZE] != 0) {
+            return true;
+        }
+    }
+    return false;
+}
+
+#endif
@@ -0,0 +1,524 @@
+#include "lockstep.h"
+#include "opcodes.h"
+#include <stdlib.h>
+#include <string.h>
+
+// Many machines running the same ROM, stepped together. The register files
+// are stored as one array per register with an entry per lane, so lanes that
+// reach the same instruction execute it as a handful of SIMD operations.
+// Memory, display and keypad stay in a struct chip8 per lane and are only
+// touched by the instructions that run one lane at a time.
+
+#if defined(__GNUC__) && (defined(__clang__) || __GNUC__ >= 9)
+
+// Lanes per block. 8-bit registers fill an SSE vector and 16-bit ones an
+// AVX2 vector, wider blocks make GCC split comparisons into scalar code.
+#define LANE_BLOCK 16
+#define ADDRESS_MASK (CHIP8_MEMORY_SIZE - 1)
+
+typedef uint8_t lane_u8 __attribute__((vector_size(LANE_BLOCK), may_alias));
+typedef int8_t lane_s8 __attribute__((vector_size(LANE_BLOCK), may_alias));
+typedef uint16_t lane_u16 __attribute__((vector_size(LANE_BLOCK * 2), may_alias));
+typedef int16_t lane_s16 __attribute__((vector_size(LANE_BLOCK * 2), may_alias));
+
+// build AVX2 variants of the vector loops next to the baseline ones and pick
+// one at load time
+#if defined(__x86_64__) && !defined(__clang__)
+#define VECTOR_CLONES __attribute__((target_clones("avx2", "default")))
+#else
+#define VECTOR_CLONES
+#endif
+
+struct lockstep {
+    size_t lanes; // Rounded up to a whole number of blocks
+    size_t used; // Lanes asked for, the rest idle
+    uint16_t instructions_per_frame;
+
+    // One entry per lane, each array 64-byte aligned
+    uint8_t *V[16];
+    uint16_t *I;
+    uint16_t *pc;
+    uint16_t *sp;
+    uint8_t *delay_timer;
+    uint8_t *sound_timer;
+
+    uint8_t *dirty; // Lane has written to its memory, so its code may differ
+    size_t dirty_count;
+    uint8_t *idle; // 0xff for padding lanes
+    uint8_t *done; // Lanes that already ran this step
+    uint8_t *group; // Lanes running the current instruction
+
+    struct chip8 *machines; // Memory, stack, display and keypad of each lane
+
+    // Memory shared by every lane that has not written to its own
+    uint8_t image[CHIP8_MEMORY_SIZE];
+    struct instruction decoded[CHIP8_MEMORY_SIZE];
+};
+
+// whether any lane in the block starting here is set
+static bool any(const uint8_t *lanes)
+{
+    uint64_t words[LANE_BLOCK / 8];
+    uint64_t merged = 0;
+
+    memcpy(words, lanes, sizeof(words));
+
+    for (int i = 0; i < LANE_BLOCK / 8; i++) {
+        merged |= words[i];
+    }
+
+    return merged != 0;
+}
+
+// masks are 0xff in true lanes and 0x00 in false ones, as comparisons produce
+#define WIDEN_MASK(mask) ((lane_u16)__builtin_convertvector((lane_s8)(mask), lane_s16))
+#define NARROW_MASK(mask) ((lane_u8)__builtin_convertvector((lane_s16)(mask), lane_s8))
+#define SELECT(mask, value, old) (((value) & (mask)) | ((old) & ~(mask)))
+
+#define LANES8(array, b) (*(lane_u8 *)&(array)[(b)])
+#define LANES16(array, b) (*(lane_u16 *)&(array)[(b)])
+
+static void *allocate_lanes(size_t lanes, size_t size)
+{
+    void *lane_array = aligned_alloc(64, lanes * size);
+
+    if (lane_array != NULL) {
+        memset(lane_array, 0, lanes * size);
+    }
+
+    return lane_array;
+}
+
+struct lockstep *lockstep_create(size_t lanes, const uint8_t *program, size_t size, uint16_t instructions_per_frame)
+{
+    if (lanes == 0 || size > MAX_PROGRAM_SIZE) {
+        return NULL;
+    }
+
+    struct lockstep *lockstep = calloc(1, sizeof(*lockstep));
+
+    if (lockstep == NULL) {
+        return NULL;
+    }
+
+    lockstep->used = lanes;
+    lockstep->lanes = (lanes + LANE_BLOCK - 1) / LANE_BLOCK * LANE_BLOCK;
+    lockstep->instructions_per_frame = instructions_per_frame;
+
+    size_t count = lockstep->lanes;
+    bool failed = false;
+
+    for (int i = 0; i < 16; i++) {
+        lockstep->V[i] = allocate_lanes(count, sizeof(uint8_t));
+        failed |= lockstep->V[i] == NULL;
+    }
+
+    lockstep->I = allocate_lanes(count, sizeof(uint16_t));
+    lockstep->pc = allocate_lanes(count, sizeof(uint16_t));
+    lockstep->sp = allocate_lanes(count, sizeof(uint16_t));
+    lockstep->delay_timer = allocate_lanes(count, sizeof(uint8_t));
+    lockstep->sound_timer = allocate_lanes(count, sizeof(uint8_t));
+    lockstep->dirty = allocate_lanes(count, sizeof(uint8_t));
+    lockstep->idle = allocate_lanes(count, sizeof(uint8_t));
+    lockstep->done = allocate_lanes(count, sizeof(uint8_t));
+    lockstep->group = allocate_lanes(count, sizeof(uint8_t));
+    lockstep->machines = malloc(lanes * sizeof(struct chip8));
+
+    failed |= lockstep->I == NULL || lockstep->pc == NULL || lockstep->sp == NULL
+        || lockstep->delay_timer == NULL || lockstep->sound_timer == NULL
+        || lockstep->dirty == NULL || lockstep->idle == NULL || lockstep->done == NULL
+        || lockstep->group == NULL || lockstep->machines == NULL;
+
+    if (failed) {
+        lockstep_destroy(lockstep);
+        return NULL;
+    }
+
+    for (size_t lane = 0; lane < lanes; lane++) {
+        struct chip8 *chip8 = &lockstep->machines[lane];
+
+        chip8_init(chip8);
+        chip8_load(chip8, program, size);
+        chip8->instructions_per_frame = instructions_per_frame;
+        lockstep->pc[lane] = chip8->cpu.pc;
+    }
+
+    memset(lockstep->idle + lanes, 0xff, count - lanes);
+    memcpy(lockstep->image, lockstep->machines[0].memory, CHIP8_MEMORY_SIZE);
+
+    return lockstep;
+}
+
+void lockstep_destroy(struct lockstep *lockstep)
+{
+    if (lockstep == NULL) {
+        return;
+    }
+
+    for (int i = 0; i < 16; i++) {
+        free(lockstep->V[i]);
+    }
+
+    free(lockstep->I);
+    free(lockstep->pc);
+    free(lockstep->sp);
+    free(lockstep->delay_timer);
+    free(lockstep->sound_timer);
+    free(lockstep->dirty);
+    free(lockstep->idle);
+    free(lockstep->done);
+    free(lockstep->group);
+    free(lockstep->machines);
+    free(lockstep);
+}
+
+void lockstep_set_key(struct lockstep *lockstep, size_t lane, uint8_t key, bool pressed)
+{
+    chip8_set_key(&lockstep->machines[lane], key, pressed);
+}
+
+// copy a lane's registers into its machine
+static void export_lane(struct lockstep *lockstep, size_t lane)
+{
+    struct chip8 *chip8 = &lockstep->machines[lane];
+
+    for (int i = 0; i < 16; i++) {
+        chip8->cpu.V[i] = lockstep->V[i][lane];
+    }
+
+    chip8->cpu.I = lockstep->I[lane];
+    chip8->cpu.pc = lockstep->pc[lane];
+    chip8->cpu.sp = lockstep->sp[lane];
+    chip8->delay_timer = lockstep->delay_timer[lane];
+    chip8->sound_timer = lockstep->sound_timer[lane];
+}
+
+// copy a lane's registers back out of its machine
+static void import_lane(struct lockstep *lockstep, size_t lane)
+{
+    const struct chip8 *chip8 = &lockstep->machines[lane];
+
+    for (int i = 0; i < 16; i++) {
+        lockstep->V[i][lane] = chip8->cpu.V[i];
+    }
+
+    lockstep->I[lane] = chip8->cpu.I;
+    lockstep->pc[lane] = chip8->cpu.pc;
+    lockstep->sp[lane] = chip8->cpu.sp;
+    lockstep->delay_timer[lane] = chip8->delay_timer;
+    lockstep->sound_timer[lane] = chip8->sound_timer;
+}
+
+const struct chip8 *lockstep_lane(struct lockstep *lockstep, size_t lane)
+{
+    export_lane(lockstep, lane);
+    return &lockstep->machines[lane];
+}
+
+static uint16_t fetch(const struct lockstep *lockstep, size_t lane, uint16_t pc)
+{
+    const uint8_t *memory = lockstep->dirty[lane] ? lockstep->machines[lane].memory : lockstep->image;
+    return memory[pc & ADDRESS_MASK] << 8 | memory[(pc + 1) & ADDRESS_MASK];
+}
+
+// mark every pending lane at this pc as part of the group and as done
+VECTOR_CLONES
+static void gather_group(struct lockstep *lockstep, uint16_t pc)
+{
+    lane_u16 target = (lane_u16) {} + pc;
+
+    for (size_t b = 0; b < lockstep->lanes; b += LANE_BLOCK) {
+        lane_u8 done = LANES8(lockstep->done, b);
+        lane_u8 group = NARROW_MASK(LANES16(lockstep->pc, b) == target) & ~done;
+
+        LANES8(lockstep->group, b) = group;
+        LANES8(lockstep->done, b) = done | group;
+    }
+}
+
+// lanes that wrote over their code may hold a different instruction at the
+// same pc, send those back to be grouped on their own
+static void split_group(struct lockstep *lockstep, uint16_t pc, uint16_t opcode)
+{
+    for (size_t lane = 0; lane < lockstep->used; lane++) {
+        if (lockstep->group[lane] && fetch(lockstep, lane, pc) != opcode) {
+            lockstep->group[lane] = 0;
+            lockstep->done[lane] = 0;
+        }
+    }
+}
+
+// instructions that only touch registers, timers and pc
+static bool is_vector(uint8_t kind)
+{
+    switch (kind) {
+    case OP_JUMP:
+    case OP_SKIP_EQUAL:
+    case OP_SKIP_NOT_EQUAL:
+    case OP_SKIP_REGISTERS_EQUAL:
+    case OP_LOAD:
+    case OP_ADD:
+    case OP_LOAD_FROM_REGISTER:
+    case OP_OR:
+    case OP_AND:
+    case OP_XOR:
+    case OP_ADD_REGISTERS:
+    case OP_SUBTRACT_X_Y:
+    case OP_SHIFT_RIGHT:
+    case OP_SUBTRACT_Y_X:
+    case OP_SHIFT_LEFT:
+    case OP_SKIP_REGISTERS_NOT_EQUAL:
+    case OP_LOAD_I:
+    case OP_JUMP_OFFSET:
+    case OP_LOAD_DELAY_TIMER:
+    case OP_SET_DELAY_TIMER:
+    case OP_SET_SOUND_TIMER:
+    case OP_ADD_I:
+    case OP_LOAD_SPRITE:
+        return true;
+    default:
+        return false;
+    }
+}
+
+// run one instruction on every lane in the group. Each case mirrors its
+// op_* handler step by step, re-reading registers after VF is written so
+// instructions with x = F behave the same.
+VECTOR_CLONES
+static void execute_vector(struct lockstep *lockstep, const struct instruction *ins)
+{
+    uint8_t *vx = lockstep->V[ins->x];
+    uint8_t *vy = lockstep->V[ins->y];
+    uint8_t *vf = lockstep->V[0xf];
+
+    for (size_t b = 0; b < lockstep->lanes; b += LANE_BLOCK) {
+        if (!any(&lockstep->group[b])) {
+            continue;
+        }
+
+        lane_u8 group = LANES8(lockstep->group, b);
+        lane_u16 group16 = WIDEN_MASK(group);
+        lane_u16 next = (lane_u16) {} + 2; // pc increment
+        lane_u8 result;
+
+        switch (ins->kind) {
+        case OP_JUMP:
+            LANES16(lockstep->pc, b) = SELECT(group16, (lane_u16) {} + ins->nnn, LANES16(lockstep->pc, b));
+            continue;
+        case OP_JUMP_OFFSET:
+            result = LANES8(lockstep->V[0], b);
+            LANES16(lockstep->pc, b) = SELECT(group16,
+                __builtin_convertvector(result, lane_u16) + ins->nnn,
+                LANES16(lockstep->pc, b));
+            continue;
+        case OP_SKIP_EQUAL:
+            next += WIDEN_MASK((lane_u8)(LANES8(vx, b) == ins->kk)) & 2;
+            break;
+        case OP_SKIP_NOT_EQUAL:
+            next += WIDEN_MASK((lane_u8)(LANES8(vx, b) != ins->kk)) & 2;
+            break;
+        case OP_SKIP_REGISTERS_EQUAL:
+            next += WIDEN_MASK((lane_u8)(LANES8(vx, b) == LANES8(vy, b))) & 2;
+            break;
+        case OP_SKIP_REGISTERS_NOT_EQUAL:
+            next += WIDEN_MASK((lane_u8)(LANES8(vx, b) != LANES8(vy, b))) & 2;
+            break;
+        case OP_LOAD:
+            LANES8(vx, b) = SELECT(group, (lane_u8) {} + ins->kk, LANES8(vx, b));
+            break;
+        case OP_ADD:
+            LANES8(vx, b) = SELECT(group, LANES8(vx, b) + ins->kk, LANES8(vx, b));
+            break;
+        case OP_LOAD_FROM_REGISTER:
+            LANES8(vx, b) = SELECT(group, LANES8(vy, b), LANES8(vx, b));
+            break;
+        case OP_OR:
+            LANES8(vx, b) = SELECT(group, LANES8(vx, b) | LANES8(vy, b), LANES8(vx, b));
+            break;
+        case OP_AND:
+            LANES8(vx, b) = SELECT(group, LANES8(vx, b) & LANES8(vy, b), LANES8(vx, b));
+            break;
+        case OP_XOR:
+            LANES8(vx, b) = SELECT(group, LANES8(vx, b) ^ LANES8(vy, b), LANES8(vx, b));
+            break;
+        case OP_ADD_REGISTERS:
+            result = LANES8(vx, b) + LANES8(vy, b);
+            LANES8(vf, b) = SELECT(group, (lane_u8)(result < LANES8(vx, b)) & 1, LANES8(vf, b));
+            LANES8(vx, b) = SELECT(group, result, LANES8(vx, b));
+            break;
+        case OP_SUBTRACT_X_Y:
+            LANES8(vf, b) = SELECT(group, (lane_u8)(LANES8(vx, b) > LANES8(vy, b)) & 1, LANES8(vf, b));
+            LANES8(vx, b) = SELECT(group, LANES8(vx, b) - LANES8(vy, b), LANES8(vx, b));
+            break;
+        case OP_SUBTRACT_Y_X:
+            LANES8(vf, b) = SELECT(group, (lane_u8)(LANES8(vy, b) > LANES8(vx, b)) & 1, LANES8(vf, b));
+            LANES8(vx, b) = SELECT(group, LANES8(vy, b) - LANES8(vx, b), LANES8(vx, b));
+            break;
+        case OP_SHIFT_RIGHT:
+            LANES8(vf, b) = SELECT(group, LANES8(vx, b) & 1, LANES8(vf, b));
+            LANES8(vx, b) = SELECT(group, LANES8(vx, b) >> 1, LANES8(vx, b));
+            break;
+        case OP_SHIFT_LEFT:
+            LANES8(vf, b) = SELECT(group, LANES8(vx, b) >> 7, LANES8(vf, b));
+            LANES8(vx, b) = SELECT(group, LANES8(vx, b) << 1, LANES8(vx, b));
+            break;
+        case OP_LOAD_I:
+            LANES16(lockstep->I, b) = SELECT(group16, (lane_u16) {} + ins->nnn, LANES16(lockstep->I, b));
+            break;
+        case OP_ADD_I:
+            LANES16(lockstep->I, b) = SELECT(group16,
+                LANES16(lockstep->I, b) + __builtin_convertvector(LANES8(vx, b), lane_u16),
+                LANES16(lockstep->I, b));
+            LANES8(vf, b) = SELECT(group, NARROW_MASK((lane_u16)(LANES16(lockstep->I, b) > 0xfff)) & 1, LANES8(vf, b));
+            break;
+        case OP_LOAD_SPRITE:
+            LANES16(lockstep->I, b) = SELECT(group16,
+                __builtin_convertvector(LANES8(vx, b), lane_u16) * 5,
+                LANES16(lockstep->I, b));
+            break;
+        case OP_LOAD_DELAY_TIMER:
+            LANES8(vx, b) = SELECT(group, LANES8(lockstep->delay_timer, b), LANES8(vx, b));
+            break;
+        case OP_SET_DELAY_TIMER:
+            LANES8(lockstep->delay_timer, b) = SELECT(group, LANES8(vx, b), LANES8(lockstep->delay_timer, b));
+            break;
+        case OP_SET_SOUND_TIMER:
+            LANES8(lockstep->sound_timer, b) = SELECT(group, LANES8(vx, b), LANES8(lockstep->sound_timer, b));
+            break;
+        }
+
+        LANES16(lockstep->pc, b) += next & group16;
+    }
+}
+
+// run one instruction on every lane in the group, one lane at a time
+static void execute_scalar(struct lockstep *lockstep, const struct instruction *ins)
+{
+    for (size_t lane = 0; lane < lockstep->used; lane++) {
+        if (!lockstep->group[lane]) {
+            continue;
+        }
+
+        uint16_t *stack = lockstep->machines[lane].cpu.stack;
+        uint16_t sp = lockstep->sp[lane];
+
+        // calls and returns that would trap go through the handlers below
+        if (ins->kind == OP_CALL && sp < CHIP8_STACK_SIZE) {
+            // the stack lives with the lane's machine, only sp is shared
+            stack[sp] = lockstep->pc[lane];
+            lockstep->sp[lane] = sp + 1;
+            lockstep->pc[lane] = ins->nnn;
+        } else if (ins->kind == OP_RETURN && sp > 0 && sp <= CHIP8_STACK_SIZE) {
+            lockstep->sp[lane] = sp - 1;
+            lockstep->pc[lane] = stack[sp - 1] + 2;
+        } else {
+            export_lane(lockstep, lane);
+            opcode_handlers[ins->kind](&lockstep->machines[lane], ins);
+            import_lane(lockstep, lane);
+
+            if ((ins->kind == OP_BCD || ins->kind == OP_REGISTER_DUMP) && !lockstep->dirty[lane]) {
+                lockstep->dirty[lane] = 1;
+                lockstep->dirty_count += 1;
+            }
+        }
+    }
+}
+
+// run count instructions on every lane
+void lockstep_step(struct lockstep *lockstep, unsigned long count)
+{
+    while (count-- > 0) {
+        memcpy(lockstep->done, lockstep->idle, lockstep->lanes);
+
+        size_t leader = 0;
+
+        // lanes usually agree on pc, so this normally runs once per step
+        for (;;) {
+            const uint8_t *pending = memchr(lockstep->done + leader, 0, lockstep->lanes - leader);
+
+            if (pending == NULL) {
+                break;
+            }
+
+            leader = pending - lockstep->done;
+
+            uint16_t pc = lockstep->pc[leader];
+            uint16_t opcode = fetch(lockstep, leader, pc);
+            struct instruction fresh;
+            const struct instruction *ins = &fresh;
+
+            gather_group(lockstep, pc);
+
+            if (lockstep->dirty_count > 0) {
+                split_group(lockstep, pc, opcode);
+            }
+
+            if (lockstep->dirty[leader]) {
+                opcode_decode(opcode, &fresh);
+            } else {
+                struct instruction *cached = &lockstep->decoded[pc & ADDRESS_MASK];
+
+                if (cached->kind == OP_UNDECODED) {
+                    opcode_decode(opcode, cached);
+                }
+
+                ins = cached;
+            }
+
+            if (is_vector(ins->kind)) {
+                execute_vector(lockstep, ins);
+            } else {
+                execute_scalar(lockstep, ins);
+            }
+        }
+    }
+}
+
+// count down every lane's timers, without the host bell
+VECTOR_CLONES
+static void update_timers(struct lockstep *lockstep)
+{
+    for (size_t b = 0; b < lockstep->lanes; b += LANE_BLOCK) {
+        // a true comparison is 0xff, so adding it subtracts one
+        LANES8(lockstep->delay_timer, b) += (lane_u8)(LANES8(lockstep->delay_timer, b) != 0);
+        LANES8(lockstep->sound_timer, b) += (lane_u8)(LANES8(lockstep->sound_timer, b) != 0);
+    }
+}
+
+void lockstep_emulate_frame(struct lockstep *lockstep)
+{
+    lockstep_step(lockstep, lockstep->instructions_per_frame);
+    update_timers(lockstep);
+}
+
+#else
+
+// needs GCC or Clang vector extensions
+
+struct lockstep *lockstep_create(size_t lanes, const uint8_t *program, size_t size, uint16_t instructions_per_frame)
+{
+    return NULL;
+}
+
+void lockstep_destroy(struct lockstep *lockstep)
+{
+}
+
+void lockstep_set_key(struct lockstep *lockstep, size_t lane, uint8_t key, bool pressed)
+{
+}
+
+void lockstep_step(struct lockstep *lockstep, unsigned long count)
+{
+}
+
+void lockstep_emulate_frame(struct lockstep *lockstep)
+{
+}
+
+const struct chip8 *lockstep_lane(struct lockstep *lockstep, size_t lane)
+{
+    return NULL;
+}
+
+#endif
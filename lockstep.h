@@ -0,0 +1,18 @@
+#ifndef LOCKSTEP_H
+#define LOCKSTEP_H
+
+#include "chip8.h"
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+struct lockstep;
+
+struct lockstep *lockstep_create(size_t lanes, const uint8_t *program, size_t size, uint16_t instructions_per_frame);
+void lockstep_destroy(struct lockstep *lockstep);
+void lockstep_set_key(struct lockstep *lockstep, size_t lane, uint8_t key, bool pressed);
+void lockstep_step(struct lockstep *lockstep, unsigned long count);
+void lockstep_emulate_frame(struct lockstep *lockstep);
+const struct chip8 *lockstep_lane(struct lockstep *lockstep, size_t lane);
+
+#endif
@@ -1,43 +1,154 @@
+#define _POSIX_C_SOURCE 200809L
+
+#include "audio.h"
 #include "chip8.h"
+#include "handoff.h"
+#include "input.h"
+#include "render.h"
+#include "scheduler.h"
+#include "stats.h"
 #include <SDL2/SDL.h>
+#include <pthread.h>
+#include <stdatomic.h>
 #include <stdbool.h>
 #include <stdio.h>
+#include <unistd.h>
+
+#define USAGE "Usage: chip8 [-j] [-T] [-m chip8|schip|xochip] [-q modern|vip|chip48|schip] [-i instructions per frame] [-u] [-s seed] [-r input log] [-S statistics] [file]"
+
+#define STATS_INTERVAL 600 // Frames between statistics dumps
+
+// State shared between the render thread and the emulation thread
+struct emulator {
+    struct chip8 *chip8; // Only touched by the emulation thread once started
+    bool uncapped;
+    struct frame_buffer frames;
+    Uint32 frame_event; // SDL event type announcing a published frame
+    atomic_bool frame_posted; // A frame event is queued and not yet handled
+    struct key_queue keys;
+    struct audio *audio; // NULL when there is no audio device
+    struct input_script *log; // Key changes recorded for replay, NULL when not recording
+    const char *stats_path; // Where statistics are dumped, NULL when not collected
+    uint32_t frame_count; // Frames run so far
+    atomic_bool quit;
+};
 
-void update_key_state(struct chip8 *chip8, SDL_Keycode key, bool pressed);
-void render_frame(struct chip8 *chip8, SDL_Renderer *renderer);
+void *run_emulator(void *arg);
+void report_events(struct emulator *emulator, uint64_t time);
+void update_key_state(struct key_queue *keys, SDL_Keycode key, bool pressed, uint64_t time);
 
 int main(int argc, char *argv[])
 {
-    if (argc < 2) {
-        puts("Usage: chip8 [file]");
+    bool jit = false;
+    bool specialized = false;
+    enum chip8_profile profile = CHIP8_PROFILE_CHIP8;
+    enum chip8_quirks quirks = CHIP8_QUIRKS_MODERN;
+    bool uncapped = false;
+    long instructions_per_frame = CHIP8_DEFAULT_INSTRUCTIONS_PER_FRAME;
+    // a different game every run unless asked to repeat one
+    unsigned long long seed = scheduler_now() ^ getpid();
+    const char *log_path = NULL;
+    const char *stats_path = NULL;
+    int opt;
+
+    while ((opt = getopt(argc, argv, "jTm:q:i:us:r:S:")) != -1) {
+        switch (opt) {
+        case 'j':
+            jit = true;
+            break;
+        case 'T':
+            specialized = true;
+            break;
+        case 'm':
+            if (!chip8_find_profile(optarg, &profile)) {
+                puts(USAGE);
+                return 0;
+            }
+            break;
+        case 'q':
+            if (!chip8_find_quirks(optarg, &quirks)) {
+                puts(USAGE);
+                return 0;
+            }
+            break;
+        case 'i':
+            instructions_per_frame = strtol(optarg, NULL, 10);
+            break;
+        case 'u':
+            uncapped = true;
+            break;
+        case 's':
+            seed = strtoull(optarg, NULL, 0);
+            break;
+        case 'r':
+            log_path = optarg;
+            break;
+        case 'S':
+            stats_path = optarg;
+            break;
+        default:
+            puts(USAGE);
+            return 0;
+        }
+    }
+
+    if (optind >= argc || instructions_per_frame < 1 || instructions_per_frame > UINT16_MAX) {
+        puts(USAGE);
         return 0;
     }
 
-    // read file into memory
-    FILE *file = fopen(argv[1], "rb");
+    const char *path = argv[optind];
+
+    // create chip8 emulator
+    struct chip8 chip8;
+    chip8_init(&chip8);
+
+    if (!chip8_set_profile(&chip8, profile)) {
+        puts("Could not allocate the machine");
+        return -1;
+    }
 
-    if (file == NULL) {
-        printf("Could not open file: %s\n", argv[1]);
+    if (!chip8_load_file(&chip8, path)) {
+        printf("Could not load file: %s\n", path);
         return -1;
     }
 
-    uint8_t program[MAX_PROGRAM_SIZE];
-    size_t size = fread(program, 1, MAX_PROGRAM_SIZE, file);
+    chip8.instructions_per_frame = instructions_per_frame;
+    chip8_seed(&chip8, seed);
 
-    if (ferror(file)) {
-        printf("There was a problem reading file: %s\n", argv[1]);
-        return -1;
+    if (quirks != CHIP8_QUIRKS_MODERN && !chip8_set_quirks(&chip8, quirks)) {
+        puts("Quirk sets only cover CHIP-8, running the machine's own behaviour instead");
+        quirks = CHIP8_QUIRKS_MODERN;
     }
-    
-    fclose(file);
 
-    // create chip8 emulator
-    struct chip8 chip8;
-    chip8_init(&chip8);
-    chip8_load(&chip8, program, size);
+    if (profile != CHIP8_PROFILE_CHIP8 && (jit || specialized || stats_path != NULL)) {
+        puts("The JIT, specialized handlers and statistics only cover CHIP-8, interpreting instead");
+        jit = false;
+        specialized = false;
+        stats_path = NULL;
+    }
+
+    if (quirks != CHIP8_QUIRKS_MODERN && (jit || specialized)) {
+        puts("The JIT and specialized handlers only run the modern quirks, interpreting instead");
+        jit = false;
+        specialized = false;
+    }
+
+    if (jit && !chip8_enable_jit(&chip8)) {
+        puts("JIT is not supported on this platform, interpreting instead");
+    }
 
-    // set up video
-    SDL_Init(SDL_INIT_VIDEO);
+    if (specialized && !chip8_enable_specialized(&chip8)) {
+        puts("Specialized handlers are not compiled in, build with make SPECIALIZED=1");
+    }
+
+    if (stats_path != NULL && !stats_enable(&chip8)) {
+        puts("Statistics are not compiled in, build with make STATS=1");
+        stats_path = NULL;
+    }
+
+    // set up video and sound
+    SDL_Init(SDL_INIT_VIDEO | SDL_INIT_AUDIO);
 
     SDL_Window *window = SDL_CreateWindow("CHIP8",
         SDL_WINDOWPOS_UNDEFINED,
@@ -51,121 +162,278 @@ int main(int argc, char *argv[])
         return -1;
     }
 
-    SDL_Renderer *renderer = SDL_CreateRenderer(window, -1, SDL_RENDERER_ACCELERATED);
+    struct render render;
 
-    if (renderer == NULL) {
+    if (!render_init(&render, window)) {
         printf("%s", SDL_GetError());
+        return -1;
     }
 
     // clear screen
-    render_frame(&chip8, renderer);
+    render_present(&render);
+
+    // start emulating on a thread of its own, so presenting and waiting for
+    // the display never holds up the guest
+    static struct emulator emulator;
+
+    emulator.chip8 = &chip8;
+    emulator.uncapped = uncapped;
+
+    // record the session so chip8-headless can replay it
+    struct input_script log;
+
+    input_script_init(&log, seed, instructions_per_frame);
+    emulator.log = log_path != NULL ? &log : NULL;
+    emulator.frame_count = 0;
+    emulator.stats_path = stats_path;
+    frame_buffer_init(&emulator.frames);
+
+    // new frames wake the render thread through its event queue, so it
+    // only ever sleeps in one place
+    emulator.frame_event = SDL_RegisterEvents(1);
+
+    if (emulator.frame_event == (Uint32)-1) {
+        printf("%s", SDL_GetError());
+        return -1;
+    }
+
+    atomic_init(&emulator.frame_posted, false);
+    key_queue_init(&emulator.keys);
+
+    // the ROM still runs without sound
+    static struct audio audio;
+
+    emulator.audio = audio_init(&audio) ? &audio : NULL;
+
+    if (emulator.audio == NULL) {
+        printf("Could not open audio: %s\n", SDL_GetError());
+    }
+
+    atomic_init(&emulator.quit, false);
+
+    pthread_t thread;
+
+    if (pthread_create(&thread, NULL, run_emulator, &emulator) != 0) {
+        puts("Could not start emulation thread");
+        return -1;
+    }
 
-    // start emulating
     bool quit = false;
     SDL_Event e;
 
     while (!quit) {
-        while (SDL_PollEvent(&e)) {
-            if (e.type == SDL_QUIT) {
-                quit = true;
-            } else if (e.type == SDL_KEYDOWN) {
-                update_key_state(&chip8, e.key.keysym.sym, true);
-            } else if (e.type == SDL_KEYUP) {
-                update_key_state(&chip8, e.key.keysym.sym, false);
-            }
+        // sleep until there is input or a new frame, or until a frame held
+        // back for the display may be shown; with nothing to show there is
+        // no timeout at all
+        if (SDL_WaitEventTimeout(&e, render_timeout(&render))) {
+            do {
+                if (e.type == SDL_QUIT) {
+                    quit = true;
+                } else if (e.type == SDL_KEYDOWN) {
+                    update_key_state(&emulator.keys, e.key.keysym.sym, true, scheduler_now());
+                } else if (e.type == SDL_KEYUP) {
+                    update_key_state(&emulator.keys, e.key.keysym.sym, false, scheduler_now());
+                } else if (e.type == emulator.frame_event) {
+                    // cleared first, a frame published after the acquire
+                    // posts another event
+                    atomic_store(&emulator.frame_posted, false);
+
+                    const struct chip8_display *display = frame_buffer_acquire(&emulator.frames);
+
+                    if (display != NULL) {
+                        render_update(&render, display);
+                    }
+                } else if (e.type == SDL_WINDOWEVENT && e.window.event == SDL_WINDOWEVENT_EXPOSED) {
+                    render.stale = true;
+                }
+            } while (SDL_PollEvent(&e));
         }
 
-        chip8_emulate_cycle(&chip8);
+        render_present(&render);
+    }
+
+    atomic_store(&emulator.quit, true);
+    key_queue_close(&emulator.keys);
+    pthread_join(thread, NULL);
+    key_queue_destroy(&emulator.keys);
+
+    if (emulator.audio != NULL) {
+        audio_destroy(emulator.audio);
+    }
+
+    chip8_release(&chip8);
+
+    if (emulator.log != NULL) {
+        log.frames = emulator.frame_count;
 
-        if (chip8.draw == true) {
-            render_frame(&chip8, renderer);
-            chip8.draw = false;
+        if (!input_script_save(&log, log_path)) {
+            printf("Could not write input log: %s\n", log_path);
         }
 
-        SDL_Delay(16);
+        input_script_free(&log);
+    }
+
+    if (stats_path != NULL) {
+        if (!stats_dump(chip8.stats, stats_path)) {
+            printf("Could not write statistics: %s\n", stats_path);
+        }
+
+        stats_disable(&chip8);
     }
 
     // free SDL memory
-    SDL_DestroyRenderer(renderer);
+    render_destroy(&render);
     SDL_DestroyWindow(window);
 
     return 0;
 }
 
-void update_key_state(struct chip8 *chip8, SDL_Keycode key, bool pressed)
+// emulation thread: run paced frames, taking keys from the queue and
+// handing every changed display to the render thread
+void *run_emulator(void *arg)
+{
+    struct emulator *emulator = arg;
+    struct chip8 *chip8 = emulator->chip8;
+    struct scheduler scheduler;
+    struct key_event event;
+    bool held = false; // Event popped but left for a later frame
+
+    scheduler_init(&scheduler, emulator->uncapped);
+
+    while (!atomic_load_explicit(&emulator->quit, memory_order_relaxed)) {
+        uint64_t frame_time = scheduler_frame_time(&scheduler);
+        uint16_t pressed = 0; // Keys pressed in this frame
+
+        while (held || key_queue_pop(&emulator->keys, &event)) {
+            // an event waits for the frame it happened in when catching
+            // up, and a release for the frame after its press so that the
+            // guest sees even the shortest tap
+            held = event.time > frame_time || (!event.pressed && (pressed >> event.key & 1));
+
+            if (held) {
+                break;
+            }
+
+            // key repeats are not changes, keep them out of the log
+            if (emulator->log != NULL && chip8->keypad[event.key] != event.pressed) {
+                input_script_record(emulator->log, emulator->frame_count, event.key, event.pressed);
+            }
+
+            if (event.pressed) {
+                pressed |= 1 << event.key;
+            }
+
+            chip8_set_key(chip8, event.key, event.pressed);
+        }
+
+        chip8_emulate_frame(chip8);
+
+        // uncapped frames have no time of their own
+        report_events(emulator, scheduler.uncapped ? scheduler_now() : frame_time);
+        emulator->frame_count += 1;
+
+        if (emulator->stats_path != NULL && emulator->frame_count % STATS_INTERVAL == 0) {
+            stats_dump(chip8->stats, emulator->stats_path);
+        }
+
+        if (chip8->draw == true) {
+            chip8_get_display(chip8, frame_buffer_back(&emulator->frames));
+            frame_buffer_publish(&emulator->frames);
+            chip8->draw = false;
+
+            // one event in flight is enough, the render thread always
+            // takes the newest frame
+            if (!atomic_exchange(&emulator->frame_posted, true)) {
+                SDL_Event e = { .type = emulator->frame_event };
+                SDL_PushEvent(&e);
+            }
+        }
+
+        // waiting for a key with the timers stopped, nothing can change
+        // until one is pressed, so sleep instead of ticking
+        if (!held && (chip8->idle == CHIP8_IDLE_KEY || chip8->idle == CHIP8_IDLE_LOOP)
+            && chip8->delay_timer == 0 && chip8->sound_timer == 0) {
+            key_queue_wait(&emulator->keys);
+        }
+
+        scheduler_wait(&scheduler);
+    }
+
+    return NULL;
+}
+
+// emulation thread: act on the frame's events, outside the instructions
+// that raised them; time is when the frame was due
+void report_events(struct emulator *emulator, uint64_t time)
+{
+    struct chip8_event event;
+
+    while (chip8_poll_event(emulator->chip8, &event)) {
+        switch (event.kind) {
+        case CHIP8_EVENT_SOUND_START:
+        case CHIP8_EVENT_SOUND_STOP:
+            if (emulator->audio != NULL) {
+                audio_tone(emulator->audio, time, event.kind == CHIP8_EVENT_SOUND_START);
+            }
+            break;
+        default:
+            printf("%s at 0x%03X (0x%X)\n", chip8_event_name(event.kind), event.pc, event.detail);
+            break;
+        }
+    }
+}
+
+// render thread: queue the CHIP-8 key for a host key, if it has one
+void update_key_state(struct key_queue *keys, SDL_Keycode key, bool pressed, uint64_t time)
 {
     switch (key) {
     case SDLK_1:
-        chip8->keypad[0x1] = pressed;
+        key_queue_push(keys, time, 0x1, pressed);
         break;
     case SDLK_2:
-        chip8->keypad[0x2] = pressed;
+        key_queue_push(keys, time, 0x2, pressed);
         break;
     case SDLK_3:
-        chip8->keypad[0x3] = pressed;
+        key_queue_push(keys, time, 0x3, pressed);
         break;
     case SDLK_4:
-        chip8->keypad[0xc] = pressed;
+        key_queue_push(keys, time, 0xc, pressed);
         break;
     case SDLK_q:
-        chip8->keypad[0x4] = pressed;
+        key_queue_push(keys, time, 0x4, pressed);
         break;
     case SDLK_w:
-        chip8->keypad[0x5] = pressed;
+        key_queue_push(keys, time, 0x5, pressed);
         break;
     case SDLK_e:
-        chip8->keypad[0x6] = pressed;
+        key_queue_push(keys, time, 0x6, pressed);
         break;
     case SDLK_r:
-        chip8->keypad[0xd] = pressed;
+        key_queue_push(keys, time, 0xd, pressed);
         break;
     case SDLK_a:
-        chip8->keypad[0x7] = pressed;
+        key_queue_push(keys, time, 0x7, pressed);
         break;
     case SDLK_s:
-        chip8->keypad[0x8] = pressed;
+        key_queue_push(keys, time, 0x8, pressed);
         break;
     case SDLK_d:
-        chip8->keypad[0x9] = pressed;
+        key_queue_push(keys, time, 0x9, pressed);
         break;
     case SDLK_f:
-        chip8->keypad[0xe] = pressed;
+        key_queue_push(keys, time, 0xe, pressed);
         break;
     case SDLK_z:
-        chip8->keypad[0xa] = pressed;
+        key_queue_push(keys, time, 0xa, pressed);
         break;
     case SDLK_x:
-        chip8->keypad[0x0] = pressed;
+        key_queue_push(keys, time, 0x0, pressed);
         break;
     case SDLK_c:
-        chip8->keypad[0xb] = pressed;
+        key_queue_push(keys, time, 0xb, pressed);
         break;
     case SDLK_v:
-        chip8->keypad[0xf] = pressed;
+        key_queue_push(keys, time, 0xf, pressed);
         break;
     }
 }
-
-void render_frame(struct chip8 *chip8, SDL_Renderer *renderer)
-{
-    SDL_SetRenderDrawColor(renderer, 0, 0, 0, SDL_ALPHA_OPAQUE);
-    SDL_RenderClear(renderer);
-    SDL_SetRenderDrawColor(renderer, 255, 255, 255, SDL_ALPHA_OPAQUE);
-
-    for (int y = 0; y < 32; y++) {
-        for (int x = 0; x < 64; x++) {
-            if (chip8->graphics[(y * 64) + x] > 0) {
-                SDL_Rect rect = {
-                    .x = x * 10,
-                    .y = y * 10,
-                    .w = 10,
-                    .h = 10
-                };
-
-                SDL_RenderFillRect(renderer, &rect);
-            }
-        }
-    }
-
-    SDL_RenderPresent(renderer);
-}
@@ -3,45 +3,140 @@
 
 #include "chip8.h"
 
-void op_clear_or_return(struct chip8 *chip8);
-void op_clear_screen(struct chip8 *chip8);
-void op_return(struct chip8 *chip8);
-
-void op_jump(struct chip8 *chip8);
-void op_call(struct chip8 *chip8);
-void op_skip_equal(struct chip8 *chip8);
-void op_skip_not_equal(struct chip8 *chip8);
-void op_skip_registers_equal(struct chip8 *chip8);
-void op_load(struct chip8 *chip8);
-void op_add(struct chip8 *chip8);
-
-void op_arithmetic(struct chip8 *chip8);
-void op_load_from_register(struct chip8 *chip8);
-void op_or(struct chip8 *chip8);
-void op_and(struct chip8 *chip8);
-void op_xor(struct chip8 *chip8);
-void op_add_registers(struct chip8 *chip8);
-void op_subtract_x_y(struct chip8 *chip8);
-void op_shift_right(struct chip8 *chip8);
-void op_subtract_y_x(struct chip8 *chip8);
-void op_shift_left(struct chip8 *chip8);
-
-void op_skip_registers_not_equal(struct chip8 *chip8);
-void op_load_i(struct chip8 *chip8);
-void op_jump_offset(struct chip8 *chip8);
-void op_random(struct chip8 *chip8);
-void op_draw(struct chip8 *chip8);
-void op_skip_if_key(struct chip8 *chip8);
-
-void op_misc(struct chip8 *chip8);
-void op_load_delay_timer(struct chip8 *chip8);
-void op_wait_for_key(struct chip8 *chip8);
-void op_set_delay_timer(struct chip8 *chip8);
-void op_set_sound_timer(struct chip8 *chip8);
-void op_add_i(struct chip8 *chip8);
-void op_load_sprite(struct chip8 *chip8);
-void op_bcd(struct chip8 *chip8);
-void op_register_dump(struct chip8 *chip8);
-void op_register_load(struct chip8 *chip8);
+enum instruction_kind {
+    OP_UNDECODED = 0, // must stay zero so a cleared cache needs decoding
+    OP_UNKNOWN,
+
+    OP_CLEAR_SCREEN,
+    OP_RETURN,
+    OP_JUMP,
+    OP_CALL,
+    OP_SKIP_EQUAL,
+    OP_SKIP_NOT_EQUAL,
+    OP_SKIP_REGISTERS_EQUAL,
+    OP_LOAD,
+    OP_ADD,
+
+    OP_LOAD_FROM_REGISTER,
+    OP_OR,
+    OP_AND,
+    OP_XOR,
+    OP_ADD_REGISTERS,
+    OP_SUBTRACT_X_Y,
+    OP_SHIFT_RIGHT,
+    OP_SUBTRACT_Y_X,
+    OP_SHIFT_LEFT,
+
+    OP_SKIP_REGISTERS_NOT_EQUAL,
+    OP_LOAD_I,
+    OP_JUMP_OFFSET,
+    OP_RANDOM,
+    OP_DRAW,
+    OP_SKIP_KEY_PRESSED,
+    OP_SKIP_KEY_NOT_PRESSED,
+
+    OP_LOAD_DELAY_TIMER,
+    OP_WAIT_FOR_KEY,
+    OP_SET_DELAY_TIMER,
+    OP_SET_SOUND_TIMER,
+    OP_ADD_I,
+    OP_LOAD_SPRITE,
+    OP_BCD,
+    OP_REGISTER_DUMP,
+    OP_REGISTER_LOAD,
+
+    INSTRUCTION_KIND_COUNT
+};
+
+// Superinstructions, common sequences run by a single handler. The first
+// instruction of a sequence takes one of these kinds in the decoded cache,
+// the rest keep their own.
+enum fused_kind {
+    OP_FUSED_SPRITE = INSTRUCTION_KIND_COUNT, // 6xkk Annn Dxyn
+    OP_FUSED_COUNTED_LOOP, // 7xkk 3xkk/4xkk 1nnn
+    OP_FUSED_DIGIT, // Fx29 Dxyn
+    OP_FUSED_SCORE, // Fx33 Fx65
+
+    FUSED_KIND_END
+};
+
+#define FUSED_KIND_COUNT (FUSED_KIND_END - INSTRUCTION_KIND_COUNT)
+
+typedef void (*opcode_handler)(struct chip8 *chip8, const struct instruction *ins);
+
+// runs as much of a sequence as still matches, returns how many
+// instructions that was
+typedef unsigned int (*fused_handler)(struct chip8 *chip8, const struct instruction *ins);
+
+struct fused_instruction {
+    fused_handler handler;
+    uint8_t head; // Kind of the first instruction, to run it alone
+    uint8_t length; // Most instructions one call can run
+};
+
+// handler for every instruction kind (NULL for OP_UNDECODED)
+extern const opcode_handler opcode_handlers[INSTRUCTION_KIND_COUNT];
+
+// superinstructions, indexed by kind - INSTRUCTION_KIND_COUNT
+extern const struct fused_instruction fused_instructions[FUSED_KIND_COUNT];
+
+#ifdef CHIP8_SPECIALIZED
+#define SPECIALIZED_HANDLER_COUNT 0x10000
+
+// runs one particular opcode, its operands compiled in
+typedef void (*specialized_handler)(struct chip8 *chip8);
+
+// handler for every opcode, indexed by the opcode itself (specialized.c)
+extern const specialized_handler specialized_handlers[SPECIALIZED_HANDLER_COUNT];
+#endif
+
+void opcode_decode(uint16_t opcode, struct instruction *ins);
+void opcode_fuse(struct chip8 *chip8, uint16_t address);
+
+void op_unknown(struct chip8 *chip8, const struct instruction *ins);
+
+void op_clear_screen(struct chip8 *chip8, const struct instruction *ins);
+void op_return(struct chip8 *chip8, const struct instruction *ins);
+
+void op_jump(struct chip8 *chip8, const struct instruction *ins);
+void op_call(struct chip8 *chip8, const struct instruction *ins);
+void op_skip_equal(struct chip8 *chip8, const struct instruction *ins);
+void op_skip_not_equal(struct chip8 *chip8, const struct instruction *ins);
+void op_skip_registers_equal(struct chip8 *chip8, const struct instruction *ins);
+void op_load(struct chip8 *chip8, const struct instruction *ins);
+void op_add(struct chip8 *chip8, const struct instruction *ins);
+
+void op_load_from_register(struct chip8 *chip8, const struct instruction *ins);
+void op_or(struct chip8 *chip8, const struct instruction *ins);
+void op_and(struct chip8 *chip8, const struct instruction *ins);
+void op_xor(struct chip8 *chip8, const struct instruction *ins);
+void op_add_registers(struct chip8 *chip8, const struct instruction *ins);
+void op_subtract_x_y(struct chip8 *chip8, const struct instruction *ins);
+void op_shift_right(struct chip8 *chip8, const struct instruction *ins);
+void op_subtract_y_x(struct chip8 *chip8, const struct instruction *ins);
+void op_shift_left(struct chip8 *chip8, const struct instruction *ins);
+
+void op_skip_registers_not_equal(struct chip8 *chip8, const struct instruction *ins);
+void op_load_i(struct chip8 *chip8, const struct instruction *ins);
+void op_jump_offset(struct chip8 *chip8, const struct instruction *ins);
+void op_random(struct chip8 *chip8, const struct instruction *ins);
+void op_draw(struct chip8 *chip8, const struct instruction *ins);
+void op_skip_key_pressed(struct chip8 *chip8, const struct instruction *ins);
+void op_skip_key_not_pressed(struct chip8 *chip8, const struct instruction *ins);
+
+void op_load_delay_timer(struct chip8 *chip8, const struct instruction *ins);
+void op_wait_for_key(struct chip8 *chip8, const struct instruction *ins);
+void op_set_delay_timer(struct chip8 *chip8, const struct instruction *ins);
+void op_set_sound_timer(struct chip8 *chip8, const struct instruction *ins);
+void op_add_i(struct chip8 *chip8, const struct instruction *ins);
+void op_load_sprite(struct chip8 *chip8, const struct instruction *ins);
+void op_bcd(struct chip8 *chip8, const struct instruction *ins);
+void op_register_dump(struct chip8 *chip8, const struct instruction *ins);
+void op_register_load(struct chip8 *chip8, const struct instruction *ins);
+
+unsigned int op_fused_sprite(struct chip8 *chip8, const struct instruction *ins);
+unsigned int op_fused_counted_loop(struct chip8 *chip8, const struct instruction *ins);
+unsigned int op_fused_digit(struct chip8 *chip8, const struct instruction *ins);
+unsigned int op_fused_score(struct chip8 *chip8, const struct instruction *ins);
 
 #endif
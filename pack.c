@@ -0,0 +1,59 @@
+#define _POSIX_C_SOURCE 200809L
+
+#include "rompack.h"
+#include <stdbool.h>
+#include <stdio.h>
+#include <unistd.h>
+
+#define USAGE "Usage: chip8-pack pack rom...\n       chip8-pack -l pack"
+
+int main(int argc, char *argv[])
+{
+    bool list = false;
+    int opt;
+
+    while ((opt = getopt(argc, argv, "l")) != -1) {
+        switch (opt) {
+        case 'l':
+            list = true;
+            break;
+        default:
+            puts(USAGE);
+            return 0;
+        }
+    }
+
+    if (optind >= argc || (list && optind + 1 != argc) || (!list && optind + 1 >= argc)) {
+        puts(USAGE);
+        return 0;
+    }
+
+    const char *path = argv[optind];
+
+    if (!list) {
+        if (!rom_pack_write(path, (const char *const *)argv + optind + 1, argc - optind - 1)) {
+            fprintf(stderr, "Could not write ROM pack: %s\n", path);
+            return -1;
+        }
+
+        return 0;
+    }
+
+    struct rom_pack *pack = rom_pack_open(path);
+
+    if (pack == NULL) {
+        fprintf(stderr, "Could not open ROM pack: %s\n", path);
+        return -1;
+    }
+
+    // one line per ROM in hash order: <hash> <size> <name>
+    for (size_t i = 0; i < rom_pack_count(pack); i++) {
+        struct rom_pack_rom rom;
+
+        rom_pack_get(pack, i, &rom);
+        printf("%016llx %4u %s\n", (unsigned long long)rom.hash, rom.size, rom.name);
+    }
+
+    rom_pack_close(pack);
+    return 0;
+}
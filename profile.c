@@ -0,0 +1,281 @@
+#define _POSIX_C_SOURCE 200809L
+
+#include "profile.h"
+#include "stats.h"
+#include <stdlib.h>
+#include <string.h>
+
+// Guest profiler. Every few instructions it takes the subroutines on the
+// call stack, from the entry addresses their 2NNN calls jumped to, and
+// counts how often each distinct stack was seen. The counts are written
+// as folded stacks ("main;sub_2A0;sub_31C 400"), the input format of
+// flamegraph tools, weighted in instructions.
+
+#define MAX_LINE 256
+#define STACK_DEPTH CHIP8_STACK_SIZE
+#define ADDRESS_MASK (CHIP8_MEMORY_SIZE - 1)
+#define NOT_A_CALL 0x8000 // Return address whose call was overwritten, kept as the address
+
+// Subroutines active at a sample, outermost first
+struct call_stack {
+    uint16_t entries[STACK_DEPTH];
+    uint8_t depth;
+};
+
+// Hash table slot, empty while samples is zero
+struct bucket {
+    struct call_stack stack;
+    uint64_t samples;
+};
+
+struct profile {
+    unsigned int interval;
+    unsigned int until_sample; // Instructions left before the next sample
+
+    struct bucket *buckets;
+    size_t capacity; // Power of two
+    size_t count;
+
+    char *symbols[CHIP8_MEMORY_SIZE]; // Names of subroutines by entry address
+};
+
+struct profile *profile_create(unsigned int interval)
+{
+    if (interval == 0) {
+        return NULL;
+    }
+
+    struct profile *profile = calloc(1, sizeof(*profile));
+
+    if (profile == NULL) {
+        return NULL;
+    }
+
+    profile->capacity = 256;
+    profile->buckets = calloc(profile->capacity, sizeof(*profile->buckets));
+
+    if (profile->buckets == NULL) {
+        free(profile);
+        return NULL;
+    }
+
+    profile->interval = interval;
+    profile->until_sample = interval;
+    return profile;
+}
+
+void profile_destroy(struct profile *profile)
+{
+    if (profile == NULL) {
+        return;
+    }
+
+    for (int address = 0; address < CHIP8_MEMORY_SIZE; address++) {
+        free(profile->symbols[address]);
+    }
+
+    free(profile->buckets);
+    free(profile);
+}
+
+// read "<address> <name>" lines, addresses in hexadecimal, '#' starts a
+// comment line
+bool profile_load_symbols(struct profile *profile, const char *path)
+{
+    FILE *file = fopen(path, "r");
+
+    if (file == NULL) {
+        return false;
+    }
+
+    char line[MAX_LINE];
+    bool failed = false;
+
+    while (!failed && fgets(line, sizeof(line), file) != NULL) {
+        const char *start = line + strspn(line, " \t");
+        unsigned int address;
+        char name[MAX_LINE];
+
+        if (*start == '#' || *start == '\n' || *start == '\0') {
+            continue;
+        }
+
+        if (sscanf(start, "%x %255s", &address, name) != 2 || address >= CHIP8_MEMORY_SIZE) {
+            failed = true;
+            break;
+        }
+
+        free(profile->symbols[address]);
+        profile->symbols[address] = strdup(name);
+        failed = profile->symbols[address] == NULL;
+    }
+
+    failed |= ferror(file);
+    fclose(file);
+    return !failed;
+}
+
+static uint64_t hash_stack(const struct call_stack *stack)
+{
+    uint64_t hash = 0xcbf29ce484222325ULL ^ stack->depth;
+
+    for (int i = 0; i < stack->depth; i++) {
+        hash = (hash ^ stack->entries[i]) * 0x100000001b3ULL;
+    }
+
+    return hash;
+}
+
+static bool same_stack(const struct call_stack *a, const struct call_stack *b)
+{
+    return a->depth == b->depth && memcmp(a->entries, b->entries, a->depth * sizeof(a->entries[0])) == 0;
+}
+
+static struct bucket *find_bucket(struct bucket *buckets, size_t capacity, const struct call_stack *stack)
+{
+    size_t index = hash_stack(stack) & (capacity - 1);
+
+    while (buckets[index].samples != 0 && !same_stack(&buckets[index].stack, stack)) {
+        index = (index + 1) & (capacity - 1);
+    }
+
+    return &buckets[index];
+}
+
+// double the table once it is half full, false when out of memory
+static bool grow(struct profile *profile)
+{
+    size_t capacity = profile->capacity * 2;
+    struct bucket *buckets = calloc(capacity, sizeof(*buckets));
+
+    if (buckets == NULL) {
+        return false;
+    }
+
+    for (size_t i = 0; i < profile->capacity; i++) {
+        if (profile->buckets[i].samples != 0) {
+            *find_bucket(buckets, capacity, &profile->buckets[i].stack) = profile->buckets[i];
+        }
+    }
+
+    free(profile->buckets);
+    profile->buckets = buckets;
+    profile->capacity = capacity;
+    return true;
+}
+
+// record the machine's current call stack
+void profile_sample(struct profile *profile, const struct chip8 *chip8)
+{
+    struct call_stack stack;
+
+    memset(&stack, 0, sizeof(stack));
+    stack.depth = chip8->cpu.sp < STACK_DEPTH ? chip8->cpu.sp : STACK_DEPTH;
+
+    // each return address points at the call, which holds the entry
+    for (int i = 0; i < stack.depth; i++) {
+        uint16_t address = chip8->cpu.stack[i] & ADDRESS_MASK;
+        uint16_t opcode = chip8->memory[address] << 8 | chip8->memory[(address + 1) & ADDRESS_MASK];
+
+        stack.entries[i] = (opcode & 0xf000) == 0x2000 ? opcode & 0x0fff : address | NOT_A_CALL;
+    }
+
+    if (profile->count * 2 >= profile->capacity && !grow(profile)) {
+        return;
+    }
+
+    struct bucket *bucket = find_bucket(profile->buckets, profile->capacity, &stack);
+
+    if (bucket->samples == 0) {
+        bucket->stack = stack;
+        profile->count += 1;
+    }
+
+    bucket->samples += 1;
+}
+
+// chip8_emulate_frame, stopping to sample every interval instructions
+void profile_emulate_frame(struct profile *profile, struct chip8 *chip8)
+{
+    unsigned long left = chip8->instructions_per_frame;
+
+    while (left > 0) {
+        unsigned long run = left < profile->until_sample ? left : profile->until_sample;
+
+        chip8_emulate_cycles(chip8, run);
+        left -= run;
+        profile->until_sample -= run;
+
+        if (profile->until_sample == 0) {
+            profile_sample(profile, chip8);
+            profile->until_sample = profile->interval;
+        }
+    }
+
+    chip8_update_timers(chip8);
+
+    if (chip8->stats != NULL) {
+        stats_end_frame(chip8->stats);
+    }
+}
+
+static int compare_buckets(const void *a, const void *b)
+{
+    const struct call_stack *x = &(*(const struct bucket *const *)a)->stack;
+    const struct call_stack *y = &(*(const struct bucket *const *)b)->stack;
+
+    for (int i = 0; i < x->depth && i < y->depth; i++) {
+        if (x->entries[i] != y->entries[i]) {
+            return x->entries[i] < y->entries[i] ? -1 : 1;
+        }
+    }
+
+    return x->depth - y->depth;
+}
+
+static void write_entry(const struct profile *profile, uint16_t entry, FILE *file)
+{
+    if (entry & NOT_A_CALL) {
+        fprintf(file, ";call_%03X", entry & ADDRESS_MASK);
+    } else if (profile->symbols[entry] != NULL) {
+        fprintf(file, ";%s", profile->symbols[entry]);
+    } else {
+        fprintf(file, ";sub_%03X", entry);
+    }
+}
+
+// one line per distinct stack, sorted so runs can be diffed
+bool profile_write_folded(const struct profile *profile, FILE *file)
+{
+    const struct bucket **sorted = malloc((profile->count + 1) * sizeof(*sorted));
+
+    if (sorted == NULL) {
+        return false;
+    }
+
+    size_t count = 0;
+
+    for (size_t i = 0; i < profile->capacity; i++) {
+        if (profile->buckets[i].samples != 0) {
+            sorted[count++] = &profile->buckets[i];
+        }
+    }
+
+    qsort(sorted, count, sizeof(*sorted), compare_buckets);
+
+    // code outside any subroutine is named after the program's entry
+    const char *root = profile->symbols[PROGRAM_START] != NULL ? profile->symbols[PROGRAM_START] : "main";
+
+    for (size_t i = 0; i < count; i++) {
+        fputs(root, file);
+
+        for (int j = 0; j < sorted[i]->stack.depth; j++) {
+            write_entry(profile, sorted[i]->stack.entries[j], file);
+        }
+
+        fprintf(file, " %llu\n", (unsigned long long)(sorted[i]->samples * profile->interval));
+    }
+
+    free(sorted);
+    return !ferror(file);
+}
@@ -0,0 +1,20 @@
+#ifndef PROFILE_H
+#define PROFILE_H
+
+#include "chip8.h"
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+
+#define PROFILE_DEFAULT_INTERVAL 100 // Instructions between samples
+
+struct profile;
+
+struct profile *profile_create(unsigned int interval);
+void profile_destroy(struct profile *profile);
+bool profile_load_symbols(struct profile *profile, const char *path);
+void profile_sample(struct profile *profile, const struct chip8 *chip8);
+void profile_emulate_frame(struct profile *profile, struct chip8 *chip8);
+bool profile_write_folded(const struct profile *profile, FILE *file);
+
+#endif
@@ -0,0 +1,53 @@
+#ifndef QUIRKS_H
+#define QUIRKS_H
+
+// Behaviours CHIP-8 interpreters disagree on. instructions.h reads them as
+// constants, so a core compiled for one quirk set carries no checks for
+// the others. interpret.c is compiled once per set with QUIRKS_<set>
+// defined (see the Makefile); everything else gets the modern set.
+//
+// QUIRK_SHIFT_VY         8xy6 and 8xyE shift Vy into Vx instead of Vx itself
+// QUIRK_INDEX_ADVANCE(x) how far Fx55 and Fx65 move I
+// QUIRK_JUMP_VX          Bnnn adds Vx (x being the top digit of nnn), not V0
+// QUIRK_LOGIC_RESETS_VF  8xy1, 8xy2 and 8xy3 clear VF
+// QUIRK_CLIP_SPRITES     sprites are cut off at the edges instead of wrapping
+
+#if defined(QUIRKS_cosmac_vip)
+
+// the original interpreter on the COSMAC VIP
+#define QUIRK_SHIFT_VY 1
+#define QUIRK_INDEX_ADVANCE(x) ((x) + 1)
+#define QUIRK_JUMP_VX 0
+#define QUIRK_LOGIC_RESETS_VF 1
+#define QUIRK_CLIP_SPRITES 1
+
+#elif defined(QUIRKS_chip48)
+
+// CHIP-48 on the HP-48 calculators
+#define QUIRK_SHIFT_VY 0
+#define QUIRK_INDEX_ADVANCE(x) (x)
+#define QUIRK_JUMP_VX 1
+#define QUIRK_LOGIC_RESETS_VF 0
+#define QUIRK_CLIP_SPRITES 1
+
+#elif defined(QUIRKS_schip)
+
+// SUPER-CHIP 1.1 running CHIP-8 programs
+#define QUIRK_SHIFT_VY 0
+#define QUIRK_INDEX_ADVANCE(x) 0
+#define QUIRK_JUMP_VX 1
+#define QUIRK_LOGIC_RESETS_VF 0
+#define QUIRK_CLIP_SPRITES 1
+
+#else
+
+// what this emulator has always done, and most ROMs written since expect
+#define QUIRK_SHIFT_VY 0
+#define QUIRK_INDEX_ADVANCE(x) ((x) + 1)
+#define QUIRK_JUMP_VX 0
+#define QUIRK_LOGIC_RESETS_VF 0
+#define QUIRK_CLIP_SPRITES 0
+
+#endif
+
+#endif
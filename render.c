@@ -0,0 +1,187 @@
+#define _POSIX_C_SOURCE 200809L
+
+#include "render.h"
+#include "scheduler.h"
+#include <string.h>
+
+#define COLOR_OFF 0xff000000
+#define COLOR_ON 0xffffffff
+#define COLOR_SECOND 0xff808080 // Only the second XO-CHIP plane
+#define COLOR_BOTH 0xffc0c0c0
+
+#define DEFAULT_REFRESH_RATE 60
+
+// colour for each combination of lit planes
+static const uint32_t palette[1 << CHIP8_PLANE_COUNT] = { COLOR_OFF, COLOR_ON, COLOR_SECOND, COLOR_BOTH };
+
+// convert a display row to the texture rows it covers
+static void convert_row(struct render *render, const struct chip8_display *display, int y)
+{
+    int scale = CHIP8_HIRES_WIDTH / display->width;
+    uint32_t *line = &render->pixels[y * scale * CHIP8_HIRES_WIDTH];
+
+    for (int x = 0; x < display->width; x++) {
+        unsigned int lit = 0;
+
+        for (int plane = 0; plane < CHIP8_PLANE_COUNT; plane++) {
+            lit |= ((display->planes[plane][y][x / 64] >> (63 - x % 64)) & 1) << plane;
+        }
+
+        for (int i = 0; i < scale; i++) {
+            line[x * scale + i] = palette[lit];
+        }
+    }
+
+    for (int i = 1; i < scale; i++) {
+        memcpy(line + i * CHIP8_HIRES_WIDTH, line, CHIP8_HIRES_WIDTH * sizeof(uint32_t));
+    }
+}
+
+static bool row_changed(const struct chip8_display *shown, const struct chip8_display *display, int y)
+{
+    for (int plane = 0; plane < CHIP8_PLANE_COUNT; plane++) {
+        if (memcmp(shown->planes[plane][y], display->planes[plane][y], sizeof(display->planes[plane][y])) != 0) {
+            return true;
+        }
+    }
+    return false;
+}
+
+bool render_init(struct render *render, SDL_Window *window)
+{
+    // let the display pace presenting where the driver can
+    render->renderer = SDL_CreateRenderer(window, -1, SDL_RENDERER_ACCELERATED | SDL_RENDERER_PRESENTVSYNC);
+
+    if (render->renderer == NULL) {
+        render->renderer = SDL_CreateRenderer(window, -1, SDL_RENDERER_ACCELERATED);
+    }
+
+    if (render->renderer == NULL) {
+        return false;
+    }
+
+    SDL_RendererInfo info;
+
+    render->vsync = SDL_GetRendererInfo(render->renderer, &info) == 0 && (info.flags & SDL_RENDERER_PRESENTVSYNC);
+
+    render->texture = SDL_CreateTexture(render->renderer,
+        SDL_PIXELFORMAT_ARGB8888,
+        SDL_TEXTUREACCESS_STREAMING,
+        CHIP8_HIRES_WIDTH,
+        CHIP8_HIRES_HEIGHT);
+
+    if (render->texture == NULL) {
+        SDL_DestroyRenderer(render->renderer);
+        return false;
+    }
+
+    // without vsync, never present faster than the display can show
+    SDL_DisplayMode mode;
+    int refresh_rate = DEFAULT_REFRESH_RATE;
+
+    if (SDL_GetCurrentDisplayMode(SDL_GetWindowDisplayIndex(window), &mode) == 0 && mode.refresh_rate > 0) {
+        refresh_rate = mode.refresh_rate;
+    }
+
+    // a little under the refresh period, so frames paced at the refresh
+    // rate are not skipped because of jitter
+    render->present_interval = render->vsync ? 0 : 900000000ULL / refresh_rate;
+    render->last_present = 0;
+
+    // start from a blank texture
+    memset(&render->shown, 0, sizeof(render->shown));
+    render->shown.width = CHIP8_WIDTH;
+    render->shown.height = CHIP8_HEIGHT;
+
+    for (int y = 0; y < CHIP8_HEIGHT; y++) {
+        convert_row(render, &render->shown, y);
+    }
+
+    SDL_UpdateTexture(render->texture, NULL, render->pixels, CHIP8_HIRES_WIDTH * sizeof(uint32_t));
+    render->stale = true;
+
+    return true;
+}
+
+void render_destroy(struct render *render)
+{
+    SDL_DestroyTexture(render->texture);
+    SDL_DestroyRenderer(render->renderer);
+}
+
+// convert the rows that changed since the last update and upload the span
+// that covers them
+void render_update(struct render *render, const struct chip8_display *display)
+{
+    // every row changes size with the resolution
+    bool resized = display->width != render->shown.width;
+    int scale = CHIP8_HIRES_HEIGHT / display->height;
+    int first = display->height;
+    int last = -1;
+
+    for (int y = 0; y < display->height; y++) {
+        if (resized || row_changed(&render->shown, display, y)) {
+            convert_row(render, display, y);
+
+            for (int plane = 0; plane < CHIP8_PLANE_COUNT; plane++) {
+                memcpy(render->shown.planes[plane][y], display->planes[plane][y], sizeof(display->planes[plane][y]));
+            }
+
+            if (first > y) {
+                first = y;
+            }
+            last = y;
+        }
+    }
+
+    render->shown.width = display->width;
+    render->shown.height = display->height;
+
+    if (last < 0) {
+        return;
+    }
+
+    SDL_Rect rows = {
+        .x = 0,
+        .y = first * scale,
+        .w = CHIP8_HIRES_WIDTH,
+        .h = (last - first + 1) * scale
+    };
+
+    SDL_UpdateTexture(render->texture, &rows, &render->pixels[rows.y * CHIP8_HIRES_WIDTH], CHIP8_HIRES_WIDTH * sizeof(uint32_t));
+    render->stale = true;
+}
+
+// show the texture if it changed, at most once per display refresh
+void render_present(struct render *render)
+{
+    uint64_t now = scheduler_now();
+
+    if (!render->stale || now - render->last_present < render->present_interval) {
+        return;
+    }
+
+    SDL_RenderCopy(render->renderer, render->texture, NULL, NULL);
+    SDL_RenderPresent(render->renderer);
+
+    render->stale = false;
+    render->last_present = now;
+}
+
+// milliseconds until a present would show something, -1 when there is
+// nothing new to show
+int render_timeout(const struct render *render)
+{
+    if (!render->stale) {
+        return -1;
+    }
+
+    uint64_t elapsed = scheduler_now() - render->last_present;
+
+    if (elapsed >= render->present_interval) {
+        return 0;
+    }
+
+    // rounded up, waking early would only mean going back to sleep
+    return (render->present_interval - elapsed + 999999) / 1000000;
+}
@@ -0,0 +1,28 @@
+#ifndef RENDER_H
+#define RENDER_H
+
+#include "chip8.h"
+#include <SDL2/SDL.h>
+#include <stdbool.h>
+#include <stdint.h>
+
+// Draws the display as one scaled texture at the high resolution, with low
+// resolution pixels doubled, uploading only changed rows
+struct render {
+    SDL_Renderer *renderer;
+    SDL_Texture *texture;
+    struct chip8_display shown; // As last uploaded to the texture
+    uint32_t pixels[CHIP8_HIRES_HEIGHT * CHIP8_HIRES_WIDTH]; // ARGB copy of the texture
+    bool stale; // Texture changed since the last present
+    bool vsync; // Presenting waits for the display's vertical blank
+    uint64_t present_interval; // Shortest time between presents (ns)
+    uint64_t last_present;
+};
+
+bool render_init(struct render *render, SDL_Window *window);
+void render_destroy(struct render *render);
+void render_update(struct render *render, const struct chip8_display *display);
+void render_present(struct render *render);
+int render_timeout(const struct render *render);
+
+#endif
@@ -0,0 +1,361 @@
+#include "rewind.h"
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+// History of recent frames for stepping backwards. Every few frames a
+// keyframe holds the whole machine, the frames in between only hold what
+// differs from their keyframe: the registers and display XORed against it,
+// plus the memory pages written since, all run-length encoded. Pages that
+// were never written are skipped without being compared, using the dirty
+// page bits the core sets on every memory write.
+
+// bytes of a snapshot before memory, always encoded in full
+#define CORE_SIZE offsetof(struct chip8_snapshot, memory)
+
+// worst case for RLE: a two byte header for every literal byte
+#define MAX_RECORD_SIZE (1 + sizeof(uint64_t) + 2 * sizeof(struct chip8_snapshot))
+
+// Encoded frame
+struct record {
+    uint8_t *data;
+    size_t size;
+    bool keyframe;
+};
+
+struct rewind {
+    struct record *records; // Ring of frames, oldest at head
+    size_t capacity;
+    size_t head;
+    size_t count;
+    size_t bytes; // Encoded size of every stored record
+    size_t max_bytes;
+    unsigned int keyframe_interval;
+    unsigned int since_keyframe; // Frames pushed since the last keyframe
+
+    uint64_t pages; // Memory pages that differ from the keyframe
+    struct chip8_snapshot keyframe; // State at the last keyframe
+    struct chip8_snapshot current; // State at the last push
+    uint8_t scratch[MAX_RECORD_SIZE];
+};
+
+static const struct chip8_snapshot zero;
+
+struct rewind *rewind_create(size_t frames, size_t bytes, unsigned int keyframe_interval)
+{
+    if (frames == 0 || keyframe_interval == 0) {
+        return NULL;
+    }
+
+    struct rewind *rewind = calloc(1, sizeof(*rewind));
+
+    if (rewind == NULL) {
+        return NULL;
+    }
+
+    rewind->records = calloc(frames, sizeof(*rewind->records));
+
+    if (rewind->records == NULL) {
+        free(rewind);
+        return NULL;
+    }
+
+    rewind->capacity = frames;
+    rewind->max_bytes = bytes;
+    rewind->keyframe_interval = keyframe_interval;
+    return rewind;
+}
+
+void rewind_destroy(struct rewind *rewind)
+{
+    if (rewind == NULL) {
+        return;
+    }
+
+    for (size_t i = 0; i < rewind->count; i++) {
+        free(rewind->records[(rewind->head + i) % rewind->capacity].data);
+    }
+
+    free(rewind->records);
+    free(rewind);
+}
+
+size_t rewind_count(const struct rewind *rewind)
+{
+    return rewind->count;
+}
+
+size_t rewind_bytes(const struct rewind *rewind)
+{
+    return rewind->bytes;
+}
+
+static uint8_t *put_varint(uint8_t *out, size_t value)
+{
+    while (value >= 0x80) {
+        *out++ = value | 0x80;
+        value >>= 7;
+    }
+
+    *out++ = value;
+    return out;
+}
+
+static const uint8_t *get_varint(const uint8_t *in, size_t *value)
+{
+    int shift = 0;
+
+    *value = 0;
+
+    do {
+        *value |= (size_t)(*in & 0x7f) << shift;
+        shift += 7;
+    } while (*in++ & 0x80);
+
+    return in;
+}
+
+// encode state XOR base as alternating runs: a count of unchanged bytes,
+// then a count of changed bytes followed by their XOR
+static uint8_t *encode(uint8_t *out, const uint8_t *state, const uint8_t *base, size_t size)
+{
+    size_t i = 0;
+
+    while (i < size) {
+        size_t same = i;
+
+        while (same < size && state[same] == base[same]) {
+            same += 1;
+        }
+
+        // a short run of unchanged bytes costs less as part of the literal
+        size_t changed = same;
+
+        while (changed < size) {
+            if (state[changed] != base[changed]) {
+                changed += 1;
+            } else if (changed + 2 < size && (state[changed + 1] != base[changed + 1] || state[changed + 2] != base[changed + 2])) {
+                changed += 1;
+            } else {
+                break;
+            }
+        }
+
+        out = put_varint(out, same - i);
+        out = put_varint(out, changed - same);
+
+        for (size_t j = same; j < changed; j++) {
+            *out++ = state[j] ^ base[j];
+        }
+
+        i = changed;
+    }
+
+    return out;
+}
+
+static const uint8_t *decode(const uint8_t *in, uint8_t *state, const uint8_t *base, size_t size)
+{
+    size_t i = 0;
+
+    while (i < size) {
+        size_t same;
+        size_t changed;
+
+        in = get_varint(in, &same);
+        in = get_varint(in, &changed);
+
+        memcpy(state + i, base + i, same);
+        i += same;
+
+        for (size_t j = 0; j < changed; j++) {
+            state[i + j] = base[i + j] ^ *in++;
+        }
+
+        i += changed;
+    }
+
+    return in;
+}
+
+// record layout: keyframe flag, page bitmap, core run, one run per page
+static size_t encode_record(uint8_t *out, const struct chip8_snapshot *state, const struct chip8_snapshot *base, uint64_t pages, bool keyframe)
+{
+    uint8_t *start = out;
+
+    *out++ = keyframe;
+    memcpy(out, &pages, sizeof(pages));
+    out += sizeof(pages);
+
+    out = encode(out, (const uint8_t *)state, (const uint8_t *)base, CORE_SIZE);
+
+    for (int page = 0; page < CHIP8_PAGE_COUNT; page++) {
+        if (pages & (1ULL << page)) {
+            size_t offset = page * CHIP8_PAGE_SIZE;
+            out = encode(out, state->memory + offset, base->memory + offset, CHIP8_PAGE_SIZE);
+        }
+    }
+
+    return out - start;
+}
+
+// rebuild a frame on top of its keyframe (or nothing, for a keyframe)
+static uint64_t decode_record(const struct record *record, struct chip8_snapshot *state, const struct chip8_snapshot *base)
+{
+    const uint8_t *in = record->data + 1;
+    uint64_t pages;
+
+    memcpy(&pages, in, sizeof(pages));
+    in += sizeof(pages);
+
+    in = decode(in, (uint8_t *)state, (const uint8_t *)base, CORE_SIZE);
+
+    for (int page = 0; page < CHIP8_PAGE_COUNT; page++) {
+        size_t offset = page * CHIP8_PAGE_SIZE;
+
+        if (pages & (1ULL << page)) {
+            in = decode(in, state->memory + offset, base->memory + offset, CHIP8_PAGE_SIZE);
+        } else {
+            memcpy(state->memory + offset, base->memory + offset, CHIP8_PAGE_SIZE);
+        }
+    }
+
+    return pages;
+}
+
+static struct record *record_at(struct rewind *rewind, size_t index)
+{
+    return &rewind->records[(rewind->head + index) % rewind->capacity];
+}
+
+// drop the oldest keyframe with the frames that depend on it
+static void evict_oldest(struct rewind *rewind)
+{
+    do {
+        struct record *record = record_at(rewind, 0);
+
+        rewind->bytes -= record->size;
+        free(record->data);
+        record->data = NULL;
+
+        rewind->head = (rewind->head + 1) % rewind->capacity;
+        rewind->count -= 1;
+    } while (rewind->count > 0 && !record_at(rewind, 0)->keyframe);
+}
+
+// add the machine's current state as the newest frame, call once per frame
+void rewind_push(struct rewind *rewind, struct chip8 *chip8)
+{
+    // bring the copy of the machine up to date, memory only where written
+    struct chip8_snapshot *current = &rewind->current;
+    uint64_t dirty = chip8->dirty_pages;
+
+    current->cpu = chip8->cpu;
+    memcpy(current->graphics, chip8->graphics, sizeof(current->graphics));
+    current->delay_timer = chip8->delay_timer;
+    current->sound_timer = chip8->sound_timer;
+    memcpy(current->keypad, chip8->keypad, sizeof(current->keypad));
+    current->rng = chip8->rng;
+
+    for (int page = 0; page < CHIP8_PAGE_COUNT; page++) {
+        if (dirty & (1ULL << page)) {
+            size_t offset = page * CHIP8_PAGE_SIZE;
+            memcpy(current->memory + offset, chip8->memory + offset, CHIP8_PAGE_SIZE);
+        }
+    }
+
+    chip8->dirty_pages = 0;
+    rewind->pages |= dirty;
+
+    bool keyframe = rewind->count == 0 || rewind->since_keyframe + 1 >= rewind->keyframe_interval;
+    size_t size;
+
+    for (;;) {
+        if (keyframe) {
+            size = encode_record(rewind->scratch, current, &zero, UINT64_MAX, true);
+        } else {
+            size = encode_record(rewind->scratch, current, &rewind->keyframe, rewind->pages, false);
+        }
+
+        while (rewind->count > 0 && (rewind->count == rewind->capacity || rewind->bytes + size > rewind->max_bytes)) {
+            evict_oldest(rewind);
+        }
+
+        // evicting took this frame's keyframe with it, store a new one
+        if (rewind->count == 0 && !keyframe) {
+            keyframe = true;
+            continue;
+        }
+
+        break;
+    }
+
+    if (rewind->bytes + size > rewind->max_bytes) {
+        // a single keyframe does not fit the budget, keep nothing
+        return;
+    }
+
+    struct record *record = record_at(rewind, rewind->count);
+
+    record->data = malloc(size);
+
+    if (record->data == NULL) {
+        return;
+    }
+
+    memcpy(record->data, rewind->scratch, size);
+    record->size = size;
+    record->keyframe = keyframe;
+
+    rewind->count += 1;
+    rewind->bytes += size;
+
+    if (keyframe) {
+        rewind->keyframe = *current;
+        rewind->pages = 0;
+        rewind->since_keyframe = 0;
+    } else {
+        rewind->since_keyframe += 1;
+    }
+}
+
+// put the machine back to the frame pushed back frames before the newest
+// (0 is the newest) and forget every frame after it
+bool rewind_restore(struct rewind *rewind, size_t back, struct chip8 *chip8)
+{
+    if (back >= rewind->count) {
+        return false;
+    }
+
+    size_t index = rewind->count - 1 - back;
+    size_t key = index;
+
+    while (!record_at(rewind, key)->keyframe) {
+        key -= 1;
+    }
+
+    decode_record(record_at(rewind, key), &rewind->keyframe, &zero);
+    rewind->since_keyframe = index - key;
+
+    if (index == key) {
+        rewind->current = rewind->keyframe;
+        rewind->pages = 0;
+    } else {
+        rewind->pages = decode_record(record_at(rewind, index), &rewind->current, &rewind->keyframe);
+    }
+
+    while (rewind->count > index + 1) {
+        struct record *record = record_at(rewind, rewind->count - 1);
+
+        rewind->bytes -= record->size;
+        free(record->data);
+        record->data = NULL;
+        rewind->count -= 1;
+    }
+
+    chip8_restore(chip8, &rewind->current);
+
+    // the copy kept here now matches the machine exactly
+    chip8->dirty_pages = 0;
+    return true;
+}
@@ -0,0 +1,17 @@
+#ifndef REWIND_H
+#define REWIND_H
+
+#include "chip8.h"
+#include <stdbool.h>
+#include <stddef.h>
+
+struct rewind;
+
+struct rewind *rewind_create(size_t frames, size_t bytes, unsigned int keyframe_interval);
+void rewind_destroy(struct rewind *rewind);
+void rewind_push(struct rewind *rewind, struct chip8 *chip8);
+bool rewind_restore(struct rewind *rewind, size_t back, struct chip8 *chip8);
+size_t rewind_count(const struct rewind *rewind);
+size_t rewind_bytes(const struct rewind *rewind);
+
+#endif
@@ -0,0 +1,435 @@
+#define _POSIX_C_SOURCE 200809L
+
+#include "rompack.h"
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+// A ROM pack is one file holding many ROMs, mapped read-only once and
+// shared by every machine and thread that runs them. Each ROM is stored as
+// the whole memory a machine starts it with, font included, so starting
+// one is a single copy (chip8_init_image) and nothing is read per ROM.
+//
+// The file starts with the magic, a version byte, three reserved bytes and
+// the ROM count (4 bytes). Then comes an index entry per ROM, sorted by
+// content hash: the hash (8 bytes), the offsets of the image and of the
+// name in the file (4 each), the program size (2) and six reserved bytes.
+// After the index, the entry numbers sorted by name (4 bytes each), the
+// names, NUL terminated, and the images, aligned to their size so each has
+// pages of its own. ROMs with the same content share one image. Numbers
+// are little endian.
+#define PACK_MAGIC "C8PK"
+#define PACK_VERSION 1
+#define PACK_HEADER_SIZE 12
+#define PACK_ENTRY_SIZE 24
+#define PACK_IMAGE_SIZE CHIP8_MEMORY_SIZE
+
+struct rom_pack {
+    const uint8_t *data; // The mapped file
+    size_t size;
+    uint32_t count;
+    const uint8_t *entries; // Index, in hash order
+    const uint8_t *by_name; // Entry numbers, in name order
+};
+
+// A ROM read from a file to be packed
+struct packed_rom {
+    const char *name;
+    uint64_t hash;
+    uint8_t *program;
+    size_t size;
+    uint32_t image; // Offset of its image in the pack
+};
+
+static uint64_t get_le(const uint8_t *in, int size)
+{
+    uint64_t value = 0;
+
+    for (int i = size - 1; i >= 0; i--) {
+        value = value << 8 | in[i];
+    }
+
+    return value;
+}
+
+static uint8_t *put_le(uint8_t *out, uint64_t value, int size)
+{
+    for (int i = 0; i < size; i++) {
+        *out++ = value >> (8 * i);
+    }
+
+    return out;
+}
+
+static void read_entry(const struct rom_pack *pack, uint32_t index, struct rom_pack_rom *rom)
+{
+    const uint8_t *entry = pack->entries + (size_t)index * PACK_ENTRY_SIZE;
+
+    rom->hash = get_le(entry, 8);
+    rom->image = pack->data + get_le(entry + 8, 4);
+    rom->name = (const char *)pack->data + get_le(entry + 12, 4);
+    rom->size = get_le(entry + 16, 2);
+}
+
+static uint32_t name_order(const struct rom_pack *pack, size_t position)
+{
+    return get_le(pack->by_name + position * 4, 4);
+}
+
+// every offset is checked once here, so lookups can trust them
+static bool validate(const struct rom_pack *pack)
+{
+    struct rom_pack_rom previous;
+
+    for (uint32_t i = 0; i < pack->count; i++) {
+        const uint8_t *entry = pack->entries + (size_t)i * PACK_ENTRY_SIZE;
+        uint64_t image = get_le(entry + 8, 4);
+        uint64_t name = get_le(entry + 12, 4);
+        struct rom_pack_rom rom;
+
+        if (pack->size < PACK_IMAGE_SIZE || image > pack->size - PACK_IMAGE_SIZE || name >= pack->size
+            || memchr(pack->data + name, '\0', pack->size - name) == NULL
+            || get_le(entry + 16, 2) > MAX_PROGRAM_SIZE || name_order(pack, i) >= pack->count) {
+            return false;
+        }
+
+        read_entry(pack, i, &rom);
+
+        if (i > 0 && previous.hash > rom.hash) {
+            return false;
+        }
+
+        previous = rom;
+    }
+
+    // names may only be checked for order once every entry is known good
+    for (uint32_t i = 1; i < pack->count; i++) {
+        struct rom_pack_rom rom;
+
+        read_entry(pack, name_order(pack, i - 1), &previous);
+        read_entry(pack, name_order(pack, i), &rom);
+
+        if (strcmp(previous.name, rom.name) >= 0) {
+            return false;
+        }
+    }
+
+    return true;
+}
+
+struct rom_pack *rom_pack_open(const char *path)
+{
+    int fd = open(path, O_RDONLY);
+
+    if (fd < 0) {
+        return NULL;
+    }
+
+    struct rom_pack *pack = calloc(1, sizeof(*pack));
+    struct stat status;
+    void *data = MAP_FAILED;
+
+    if (pack != NULL && fstat(fd, &status) == 0 && status.st_size >= PACK_HEADER_SIZE) {
+        data = mmap(NULL, status.st_size, PROT_READ, MAP_SHARED, fd, 0);
+    }
+
+    // the mapping outlives the descriptor
+    close(fd);
+
+    if (data == MAP_FAILED) {
+        free(pack);
+        return NULL;
+    }
+
+    pack->data = data;
+    pack->size = status.st_size;
+    pack->count = get_le(pack->data + 8, 4);
+    pack->entries = pack->data + PACK_HEADER_SIZE;
+    pack->by_name = pack->entries + (size_t)pack->count * PACK_ENTRY_SIZE;
+
+    if (memcmp(pack->data, PACK_MAGIC, 4) != 0 || pack->data[4] != PACK_VERSION
+        || (pack->size - PACK_HEADER_SIZE) / (PACK_ENTRY_SIZE + 4) < pack->count || !validate(pack)) {
+        rom_pack_close(pack);
+        return NULL;
+    }
+
+    return pack;
+}
+
+void rom_pack_close(struct rom_pack *pack)
+{
+    if (pack == NULL) {
+        return;
+    }
+
+    munmap((void *)pack->data, pack->size);
+    free(pack);
+}
+
+size_t rom_pack_count(const struct rom_pack *pack)
+{
+    return pack->count;
+}
+
+// ROMs are numbered in hash order
+void rom_pack_get(const struct rom_pack *pack, size_t index, struct rom_pack_rom *rom)
+{
+    read_entry(pack, index, rom);
+}
+
+bool rom_pack_find(const struct rom_pack *pack, const char *name, struct rom_pack_rom *rom)
+{
+    size_t low = 0;
+    size_t high = pack->count;
+
+    while (low < high) {
+        size_t middle = low + (high - low) / 2;
+
+        read_entry(pack, name_order(pack, middle), rom);
+
+        int order = strcmp(rom->name, name);
+
+        if (order == 0) {
+            return true;
+        } else if (order < 0) {
+            low = middle + 1;
+        } else {
+            high = middle;
+        }
+    }
+
+    return false;
+}
+
+// the first of the ROMs with this content
+bool rom_pack_find_hash(const struct rom_pack *pack, uint64_t hash, struct rom_pack_rom *rom)
+{
+    size_t low = 0;
+    size_t high = pack->count;
+
+    while (low < high) {
+        size_t middle = low + (high - low) / 2;
+
+        if (get_le(pack->entries + middle * PACK_ENTRY_SIZE, 8) < hash) {
+            low = middle + 1;
+        } else {
+            high = middle;
+        }
+    }
+
+    if (low == pack->count) {
+        return false;
+    }
+
+    read_entry(pack, low, rom);
+    return rom->hash == hash;
+}
+
+// FNV-1a over the program
+uint64_t rom_pack_hash(const uint8_t *program, size_t size)
+{
+    uint64_t hash = 0xcbf29ce484222325ULL;
+
+    for (size_t i = 0; i < size; i++) {
+        hash ^= program[i];
+        hash *= 0x100000001b3ULL;
+    }
+
+    return hash;
+}
+
+static bool read_rom(const char *path, struct packed_rom *rom)
+{
+    FILE *file = fopen(path, "rb");
+
+    if (file == NULL) {
+        return false;
+    }
+
+    // read one byte more than fits to notice oversized files
+    uint8_t program[MAX_PROGRAM_SIZE + 1];
+    size_t size = fread(program, 1, sizeof(program), file);
+    bool failed = ferror(file) || size > MAX_PROGRAM_SIZE;
+
+    fclose(file);
+
+    rom->name = path;
+    rom->size = size;
+    rom->hash = rom_pack_hash(program, size);
+    rom->program = failed ? NULL : malloc(size + 1);
+
+    if (rom->program == NULL) {
+        return false;
+    }
+
+    memcpy(rom->program, program, size);
+    return true;
+}
+
+static int compare_content(const struct packed_rom *a, const struct packed_rom *b)
+{
+    if (a->hash != b->hash) {
+        return a->hash < b->hash ? -1 : 1;
+    }
+
+    if (a->size != b->size) {
+        return a->size < b->size ? -1 : 1;
+    }
+
+    return memcmp(a->program, b->program, a->size);
+}
+
+// by hash, keeping equal content together even when hashes collide
+static int compare_roms(const void *a, const void *b)
+{
+    int order = compare_content(a, b);
+
+    return order != 0 ? order : strcmp(((const struct packed_rom *)a)->name, ((const struct packed_rom *)b)->name);
+}
+
+static int compare_names(const void *a, const void *b)
+{
+    return strcmp((*(const struct packed_rom *const *)a)->name, (*(const struct packed_rom *const *)b)->name);
+}
+
+static bool write_pack(FILE *file, struct packed_rom *roms, const struct packed_rom **by_name, size_t count, struct chip8 *chip8)
+{
+    // lay the file out first, images after the names at the next boundary
+    uint64_t names = PACK_HEADER_SIZE + (uint64_t)count * (PACK_ENTRY_SIZE + 4);
+    uint64_t end = names;
+
+    for (size_t i = 0; i < count; i++) {
+        end += strlen(roms[i].name) + 1;
+    }
+
+    uint64_t images = (end + PACK_IMAGE_SIZE - 1) / PACK_IMAGE_SIZE * PACK_IMAGE_SIZE;
+
+    end = images;
+
+    for (size_t i = 0; i < count; i++) {
+        if (i > 0 && compare_content(&roms[i - 1], &roms[i]) == 0) {
+            roms[i].image = roms[i - 1].image;
+        } else {
+            roms[i].image = end;
+            end += PACK_IMAGE_SIZE;
+        }
+    }
+
+    // offsets are four bytes
+    if (end - PACK_IMAGE_SIZE > UINT32_MAX) {
+        return false;
+    }
+
+    uint8_t header[PACK_HEADER_SIZE] = { 0 };
+
+    memcpy(header, PACK_MAGIC, 4);
+    header[4] = PACK_VERSION;
+    put_le(header + 8, count, 4);
+    fwrite(header, 1, sizeof(header), file);
+
+    uint32_t name = names;
+
+    for (size_t i = 0; i < count; i++) {
+        uint8_t entry[PACK_ENTRY_SIZE] = { 0 };
+        uint8_t *out = entry;
+
+        out = put_le(out, roms[i].hash, 8);
+        out = put_le(out, roms[i].image, 4);
+        out = put_le(out, name, 4);
+        put_le(out, roms[i].size, 2);
+        fwrite(entry, 1, sizeof(entry), file);
+        name += strlen(roms[i].name) + 1;
+    }
+
+    for (size_t i = 0; i < count; i++) {
+        uint8_t number[4];
+
+        put_le(number, by_name[i] - roms, 4);
+        fwrite(number, 1, sizeof(number), file);
+    }
+
+    for (size_t i = 0; i < count; i++) {
+        fwrite(roms[i].name, 1, strlen(roms[i].name) + 1, file);
+    }
+
+    for (uint64_t offset = name; offset < images; offset++) {
+        putc(0, file);
+    }
+
+    // made the way a machine would load the ROM, so the image is exactly
+    // the memory chip8_init and chip8_load leave
+    for (size_t i = 0; i < count; i++) {
+        if (i == 0 || roms[i].image != roms[i - 1].image) {
+            chip8_init(chip8);
+            chip8_load(chip8, roms[i].program, roms[i].size);
+            fwrite(chip8->memory, 1, PACK_IMAGE_SIZE, file);
+        }
+    }
+
+    return !ferror(file);
+}
+
+// pack ROM files, named by their paths as given. The pack replaces the file
+// in one step, so anyone who has the old one mapped keeps reading it intact.
+bool rom_pack_write(const char *path, const char *const *roms, size_t count)
+{
+    struct packed_rom *packed = calloc(count + 1, sizeof(*packed));
+    const struct packed_rom **by_name = malloc((count + 1) * sizeof(*by_name));
+    struct chip8 *chip8 = malloc(sizeof(*chip8));
+    size_t length = strlen(path);
+    char *temporary = malloc(length + sizeof(".tmp"));
+    bool failed = packed == NULL || by_name == NULL || chip8 == NULL || temporary == NULL || count > UINT32_MAX;
+
+    for (size_t i = 0; i < count && !failed; i++) {
+        failed = !read_rom(roms[i], &packed[i]);
+    }
+
+    if (!failed) {
+        qsort(packed, count, sizeof(*packed), compare_roms);
+
+        for (size_t i = 0; i < count; i++) {
+            by_name[i] = &packed[i];
+        }
+
+        qsort(by_name, count, sizeof(*by_name), compare_names);
+
+        // names are the keys of the index
+        for (size_t i = 1; i < count && !failed; i++) {
+            failed = strcmp(by_name[i - 1]->name, by_name[i]->name) == 0;
+        }
+    }
+
+    if (!failed) {
+        memcpy(temporary, path, length);
+        memcpy(temporary + length, ".tmp", sizeof(".tmp"));
+
+        FILE *file = fopen(temporary, "wb");
+        bool written = file != NULL && write_pack(file, packed, by_name, count, chip8);
+
+        if (file != NULL) {
+            written &= fclose(file) == 0;
+        }
+
+        written = written && rename(temporary, path) == 0;
+
+        if (!written) {
+            remove(temporary);
+        }
+
+        failed = !written;
+    }
+
+    for (size_t i = 0; packed != NULL && i < count; i++) {
+        free(packed[i].program);
+    }
+
+    free(packed);
+    free(by_name);
+    free(chip8);
+    free(temporary);
+    return !failed;
+}
@@ -0,0 +1,28 @@
+#ifndef ROMPACK_H
+#define ROMPACK_H
+
+#include "chip8.h"
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+// A ROM in a pack, pointing straight into the mapped file
+struct rom_pack_rom {
+    const char *name; // Path the ROM was packed from
+    uint64_t hash; // FNV-1a of the program, see rom_pack_hash
+    const uint8_t *image; // Memory after chip8_init and chip8_load, for chip8_init_image
+    uint16_t size; // Of the program
+};
+
+struct rom_pack;
+
+struct rom_pack *rom_pack_open(const char *path);
+void rom_pack_close(struct rom_pack *pack);
+size_t rom_pack_count(const struct rom_pack *pack);
+void rom_pack_get(const struct rom_pack *pack, size_t index, struct rom_pack_rom *rom);
+bool rom_pack_find(const struct rom_pack *pack, const char *name, struct rom_pack_rom *rom);
+bool rom_pack_find_hash(const struct rom_pack *pack, uint64_t hash, struct rom_pack_rom *rom);
+uint64_t rom_pack_hash(const uint8_t *program, size_t size);
+bool rom_pack_write(const char *path, const char *const *roms, size_t count);
+
+#endif
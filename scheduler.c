@@ -0,0 +1,73 @@
+#define _POSIX_C_SOURCE 200809L
+
+#include "scheduler.h"
+#include "chip8.h"
+#include <errno.h>
+#include <stdint.h>
+#include <time.h>
+
+#define NS_PER_SECOND 1000000000ULL
+
+// frames we may fall behind by before giving up on catching up
+#define MAX_LAG_FRAMES 6
+
+// monotonic time in nanoseconds
+uint64_t scheduler_now(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * NS_PER_SECOND + ts.tv_nsec;
+}
+
+static uint64_t frame_deadline(const struct scheduler *scheduler, uint64_t frame)
+{
+    // computed from the start so rounding never accumulates into drift
+    return scheduler->start + frame * NS_PER_SECOND / CHIP8_FRAME_RATE;
+}
+
+void scheduler_init(struct scheduler *scheduler, bool uncapped)
+{
+    scheduler->start = scheduler_now();
+    scheduler->frame = 0;
+    scheduler->uncapped = uncapped;
+}
+
+// when the frame about to run was due, later than any time when uncapped
+uint64_t scheduler_frame_time(const struct scheduler *scheduler)
+{
+    return scheduler->uncapped ? UINT64_MAX : frame_deadline(scheduler, scheduler->frame);
+}
+
+// sleep until the next frame is due
+void scheduler_wait(struct scheduler *scheduler)
+{
+    if (scheduler->uncapped) {
+        return;
+    }
+
+    scheduler->frame += 1;
+
+    uint64_t deadline = frame_deadline(scheduler, scheduler->frame);
+    uint64_t now = scheduler_now();
+
+    if (now > deadline + MAX_LAG_FRAMES * NS_PER_SECOND / CHIP8_FRAME_RATE) {
+        // the host stalled (suspend, debugger...), restart the timeline
+        // instead of running a burst of frames to catch up
+        scheduler->start = now;
+        scheduler->frame = 0;
+        return;
+    }
+
+    if (now >= deadline) {
+        return;
+    }
+
+    struct timespec ts = {
+        .tv_sec = deadline / NS_PER_SECOND,
+        .tv_nsec = deadline % NS_PER_SECOND
+    };
+
+    while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &ts, NULL) == EINTR) {
+        // interrupted by a signal, keep waiting for the same deadline
+    }
+}
@@ -0,0 +1,19 @@
+#ifndef SCHEDULER_H
+#define SCHEDULER_H
+
+#include <stdbool.h>
+#include <stdint.h>
+
+// Paces emulated frames against the host's monotonic clock
+struct scheduler {
+    uint64_t start; // Time of frame zero (ns)
+    uint64_t frame; // Frames scheduled since start
+    bool uncapped; // Run as fast as the host allows
+};
+
+void scheduler_init(struct scheduler *scheduler, bool uncapped);
+void scheduler_wait(struct scheduler *scheduler);
+uint64_t scheduler_frame_time(const struct scheduler *scheduler);
+uint64_t scheduler_now(void);
+
+#endif
@@ -0,0 +1,117 @@
+#include "chip8.h"
+#include "instructions.h"
+#include "opcodes.h"
+
+// Specialized core: a handler for each of the 65536 opcodes with the
+// operands as constants, so running an instruction is one load from the
+// table and one call, without decoding. The handlers are expanded from
+// instructions.h by the preprocessor. Building them is slow, so the
+// Makefile compiles this file once per opcode class (SPECIALIZED_CLASS is
+// the class's hexadecimal digit), and once more without it for the table.
+
+#define HIDDEN __attribute__((visibility("hidden")))
+
+// expand M once for each hexadecimal digit appended to a prefix, which
+// starts out as 0x and ends up as a complete opcode
+#define DIGITS_4(M, p) M(p##0) M(p##1) M(p##2) M(p##3) M(p##4) M(p##5) M(p##6) M(p##7) \
+    M(p##8) M(p##9) M(p##A) M(p##B) M(p##C) M(p##D) M(p##E) M(p##F)
+#define DIGITS_3(M, p) DIGITS_4(M, p##0) DIGITS_4(M, p##1) DIGITS_4(M, p##2) DIGITS_4(M, p##3) \
+    DIGITS_4(M, p##4) DIGITS_4(M, p##5) DIGITS_4(M, p##6) DIGITS_4(M, p##7)                    \
+    DIGITS_4(M, p##8) DIGITS_4(M, p##9) DIGITS_4(M, p##A) DIGITS_4(M, p##B)                    \
+    DIGITS_4(M, p##C) DIGITS_4(M, p##D) DIGITS_4(M, p##E) DIGITS_4(M, p##F)
+#define DIGITS_2(M, p) DIGITS_3(M, p##0) DIGITS_3(M, p##1) DIGITS_3(M, p##2) DIGITS_3(M, p##3) \
+    DIGITS_3(M, p##4) DIGITS_3(M, p##5) DIGITS_3(M, p##6) DIGITS_3(M, p##7)                    \
+    DIGITS_3(M, p##8) DIGITS_3(M, p##9) DIGITS_3(M, p##A) DIGITS_3(M, p##B)                    \
+    DIGITS_3(M, p##C) DIGITS_3(M, p##D) DIGITS_3(M, p##E) DIGITS_3(M, p##F)
+#define DIGITS_1(M, p) DIGITS_2(M, p##0) DIGITS_2(M, p##1) DIGITS_2(M, p##2) DIGITS_2(M, p##3) \
+    DIGITS_2(M, p##4) DIGITS_2(M, p##5) DIGITS_2(M, p##6) DIGITS_2(M, p##7)                    \
+    DIGITS_2(M, p##8) DIGITS_2(M, p##9) DIGITS_2(M, p##A) DIGITS_2(M, p##B)                    \
+    DIGITS_2(M, p##C) DIGITS_2(M, p##D) DIGITS_2(M, p##E) DIGITS_2(M, p##F)
+
+// the class is pasted after 0x, so it has to be expanded first
+#define CLASS_OPCODES(M, class) DIGITS_2(M, 0x##class)
+#define EXPAND_CLASS_OPCODES(M, class) CLASS_OPCODES(M, class)
+
+#define DECLARE(opcode) HIDDEN void specialized_##opcode(struct chip8 *chip8);
+
+#ifdef SPECIALIZED_CLASS
+
+#define CASE(kind, name)                 \
+    case kind:                           \
+        instruction_##name(chip8, &ins); \
+        break;
+
+// run the instruction an opcode decodes to. A macro rather than a function,
+// so that the switch is on a constant and keeps a single case before
+// anything is inlined, which keeps compiling 4096 of them bearable.
+#define EXECUTE(opcode)                                                 \
+    do {                                                                \
+        const struct instruction ins = INSTRUCTION(opcode);             \
+                                                                        \
+        switch (INSTRUCTION_KIND(opcode)) {                             \
+            CASE(OP_UNKNOWN, unknown)                                   \
+                                                                        \
+            CASE(OP_CLEAR_SCREEN, clear_screen)                         \
+            CASE(OP_RETURN, return)                                     \
+            CASE(OP_JUMP, jump)                                         \
+            CASE(OP_CALL, call)                                         \
+            CASE(OP_SKIP_EQUAL, skip_equal)                             \
+            CASE(OP_SKIP_NOT_EQUAL, skip_not_equal)                     \
+            CASE(OP_SKIP_REGISTERS_EQUAL, skip_registers_equal)         \
+            CASE(OP_LOAD, load)                                         \
+            CASE(OP_ADD, add)                                           \
+                                                                        \
+            CASE(OP_LOAD_FROM_REGISTER, load_from_register)             \
+            CASE(OP_OR, or)                                             \
+            CASE(OP_AND, and)                                           \
+            CASE(OP_XOR, xor)                                           \
+            CASE(OP_ADD_REGISTERS, add_registers)                       \
+            CASE(OP_SUBTRACT_X_Y, subtract_x_y)                         \
+            CASE(OP_SHIFT_RIGHT, shift_right)                           \
+            CASE(OP_SUBTRACT_Y_X, subtract_y_x)                         \
+            CASE(OP_SHIFT_LEFT, shift_left)                             \
+                                                                        \
+            CASE(OP_SKIP_REGISTERS_NOT_EQUAL, skip_registers_not_equal) \
+            CASE(OP_LOAD_I, load_i)                                     \
+            CASE(OP_JUMP_OFFSET, jump_offset)                           \
+            CASE(OP_RANDOM, random)                                     \
+            CASE(OP_DRAW, draw)                                         \
+            CASE(OP_SKIP_KEY_PRESSED, skip_key_pressed)                 \
+            CASE(OP_SKIP_KEY_NOT_PRESSED, skip_key_not_pressed)         \
+                                                                        \
+            CASE(OP_LOAD_DELAY_TIMER, load_delay_timer)                 \
+            CASE(OP_WAIT_FOR_KEY, wait_for_key)                         \
+            CASE(OP_SET_DELAY_TIMER, set_delay_timer)                   \
+            CASE(OP_SET_SOUND_TIMER, set_sound_timer)                   \
+            CASE(OP_ADD_I, add_i)                                       \
+            CASE(OP_LOAD_SPRITE, load_sprite)                           \
+            CASE(OP_BCD, bcd)                                           \
+            CASE(OP_REGISTER_DUMP, register_dump)                       \
+            CASE(OP_REGISTER_LOAD, register_load)                       \
+                                                                        \
+        default:                                                        \
+            break;                                                      \
+        }                                                               \
+    } while (0)
+
+// flatten pulls every helper in, however many handlers use it
+#define SPECIALIZE(opcode)                                                  \
+    DECLARE(opcode)                                                         \
+    __attribute__((flatten)) void specialized_##opcode(struct chip8 *chip8) \
+    {                                                                       \
+        EXECUTE(opcode);                                                    \
+    }
+
+EXPAND_CLASS_OPCODES(SPECIALIZE, SPECIALIZED_CLASS)
+
+#else
+
+#define ENTRY(opcode) specialized_##opcode,
+
+DIGITS_1(DECLARE, 0x)
+
+const specialized_handler specialized_handlers[SPECIALIZED_HANDLER_COUNT] = {
+    DIGITS_1(ENTRY, 0x)
+};
+
+#endif
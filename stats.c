@@ -0,0 +1,197 @@
+#define _POSIX_C_SOURCE 200809L
+
+#include "stats.h"
+#include <stdlib.h>
+#include <string.h>
+
+// opcode pattern for each instruction kind, the first digit is its class
+static const char *patterns[INSTRUCTION_KIND_COUNT] = {
+    [OP_CLEAR_SCREEN] = "00E0",
+    [OP_RETURN] = "00EE",
+    [OP_JUMP] = "1NNN",
+    [OP_CALL] = "2NNN",
+    [OP_SKIP_EQUAL] = "3XNN",
+    [OP_SKIP_NOT_EQUAL] = "4XNN",
+    [OP_SKIP_REGISTERS_EQUAL] = "5XY0",
+    [OP_LOAD] = "6XNN",
+    [OP_ADD] = "7XNN",
+
+    [OP_LOAD_FROM_REGISTER] = "8XY0",
+    [OP_OR] = "8XY1",
+    [OP_AND] = "8XY2",
+    [OP_XOR] = "8XY3",
+    [OP_ADD_REGISTERS] = "8XY4",
+    [OP_SUBTRACT_X_Y] = "8XY5",
+    [OP_SHIFT_RIGHT] = "8XY6",
+    [OP_SUBTRACT_Y_X] = "8XY7",
+    [OP_SHIFT_LEFT] = "8XYE",
+
+    [OP_SKIP_REGISTERS_NOT_EQUAL] = "9XY0",
+    [OP_LOAD_I] = "ANNN",
+    [OP_JUMP_OFFSET] = "BNNN",
+    [OP_RANDOM] = "CXNN",
+    [OP_DRAW] = "DXYN",
+    [OP_SKIP_KEY_PRESSED] = "EX9E",
+    [OP_SKIP_KEY_NOT_PRESSED] = "EXA1",
+
+    [OP_LOAD_DELAY_TIMER] = "FX07",
+    [OP_WAIT_FOR_KEY] = "FX0A",
+    [OP_SET_DELAY_TIMER] = "FX15",
+    [OP_SET_SOUND_TIMER] = "FX18",
+    [OP_ADD_I] = "FX1E",
+    [OP_LOAD_SPRITE] = "FX29",
+    [OP_BCD] = "FX33",
+    [OP_REGISTER_DUMP] = "FX55",
+    [OP_REGISTER_LOAD] = "FX65"
+};
+
+// start counting, false when built without CHIP8_STATS
+bool stats_enable(struct chip8 *chip8)
+{
+#ifdef CHIP8_STATS
+    if (chip8->stats == NULL) {
+        chip8->stats = malloc(sizeof(*chip8->stats));
+
+        if (chip8->stats == NULL) {
+            return false;
+        }
+
+        stats_reset(chip8->stats);
+    }
+
+    return true;
+#else
+    return false;
+#endif
+}
+
+void stats_disable(struct chip8 *chip8)
+{
+    free(chip8->stats);
+    chip8->stats = NULL;
+}
+
+void stats_reset(struct chip8_stats *stats)
+{
+    memset(stats, 0, sizeof(*stats));
+}
+
+static uint64_t total_instructions(const struct chip8_stats *stats)
+{
+    uint64_t total = 0;
+
+    for (int kind = 0; kind < INSTRUCTION_KIND_COUNT; kind++) {
+        total += stats->opcodes[kind];
+    }
+
+    return total;
+}
+
+static void end_counter(struct stats_counter *counter, uint64_t *start, uint64_t now)
+{
+    counter->last = now - *start;
+    counter->total += counter->last;
+
+    if (counter->max < counter->last) {
+        counter->max = counter->last;
+    }
+
+    *start = now;
+}
+
+// close the current frame, called after its instructions and timers
+void stats_end_frame(struct chip8_stats *stats)
+{
+    stats->frames += 1;
+    end_counter(&stats->instructions, &stats->frame_start[0], total_instructions(stats));
+    end_counter(&stats->draws, &stats->frame_start[1], stats->opcodes[OP_DRAW]);
+    end_counter(&stats->clears, &stats->frame_start[2], stats->opcodes[OP_CLEAR_SCREEN]);
+}
+
+static void write_counter(FILE *file, const char *name, const struct stats_counter *counter, uint64_t frames, bool last)
+{
+    fprintf(file, "    \"%s\": {\"last\": %llu, \"max\": %llu, \"mean\": %.3f}%s\n",
+        name,
+        (unsigned long long)counter->last,
+        (unsigned long long)counter->max,
+        frames ? (double)counter->total / frames : 0.0,
+        last ? "" : ",");
+}
+
+bool stats_write_json(const struct chip8_stats *stats, FILE *file)
+{
+    uint64_t classes[16] = { 0 };
+
+    for (int kind = 0; kind < INSTRUCTION_KIND_COUNT; kind++) {
+        if (patterns[kind] != NULL) {
+            char digit = patterns[kind][0];
+            classes[digit <= '9' ? digit - '0' : digit - 'A' + 10] += stats->opcodes[kind];
+        }
+    }
+
+    fprintf(file, "{\n  \"instructions\": %llu,\n  \"frames\": %llu,\n",
+        (unsigned long long)total_instructions(stats), (unsigned long long)stats->frames);
+
+    fputs("  \"classes\": {", file);
+    for (int class = 0; class < 16; class++) {
+        fprintf(file, "%s\"%X\": %llu", class ? ", " : "", class, (unsigned long long)classes[class]);
+    }
+    fprintf(file, ", \"unknown\": %llu},\n", (unsigned long long)stats->opcodes[OP_UNKNOWN]);
+
+    fputs("  \"opcodes\": {", file);
+    for (int kind = OP_CLEAR_SCREEN; kind < INSTRUCTION_KIND_COUNT; kind++) {
+        fprintf(file, "%s\"%s\": %llu", kind > OP_CLEAR_SCREEN ? ", " : "", patterns[kind], (unsigned long long)stats->opcodes[kind]);
+    }
+    fputs("},\n", file);
+
+    fputs("  \"per_frame\": {\n", file);
+    write_counter(file, "instructions", &stats->instructions, stats->frames, false);
+    write_counter(file, "draws", &stats->draws, stats->frames, false);
+    write_counter(file, "clears", &stats->clears, stats->frames, true);
+    fputs("  },\n", file);
+
+    // only addresses that ran, the rest of memory is data or unused
+    fputs("  \"pc\": {", file);
+    bool first = true;
+
+    for (int address = 0; address < CHIP8_MEMORY_SIZE; address++) {
+        if (stats->pc[address] != 0) {
+            fprintf(file, "%s\"%03X\": %llu", first ? "" : ", ", address, (unsigned long long)stats->pc[address]);
+            first = false;
+        }
+    }
+
+    fputs("}\n}\n", file);
+    return !ferror(file);
+}
+
+// write the JSON to a file, replacing it in one step so a reader never
+// sees half of it
+bool stats_dump(const struct chip8_stats *stats, const char *path)
+{
+    size_t length = strlen(path);
+    char *temporary = malloc(length + sizeof(".tmp"));
+
+    if (temporary == NULL) {
+        return false;
+    }
+
+    memcpy(temporary, path, length);
+    memcpy(temporary + length, ".tmp", sizeof(".tmp"));
+
+    FILE *file = fopen(temporary, "w");
+    bool written = file != NULL && stats_write_json(stats, file);
+
+    if (file != NULL) {
+        written &= fclose(file) == 0;
+    }
+
+    written = written && rename(temporary, path) == 0;
+
+    if (!written) {
+        remove(temporary);
+    }
+
+    free(temporary);
+    return written;
+}
@@ -0,0 +1,47 @@
+#ifndef STATS_H
+#define STATS_H
+
+#include "chip8.h"
+#include "opcodes.h"
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+
+// Instrumentation of the interpreter. Counting is only compiled in when
+// built with CHIP8_STATS defined (make STATS=1); otherwise stats_enable
+// fails and the interpreter carries no trace of it.
+
+// A quantity measured once per frame
+struct stats_counter {
+    uint64_t last; // Value in the most recent frame
+    uint64_t max;
+    uint64_t total; // Sum over every frame
+};
+
+struct chip8_stats {
+    uint64_t opcodes[INSTRUCTION_KIND_COUNT]; // Executions per instruction kind
+    uint64_t pc[CHIP8_MEMORY_SIZE]; // Executions per address
+    uint64_t frames;
+    struct stats_counter instructions;
+    struct stats_counter draws;
+    struct stats_counter clears;
+
+    // totals when the current frame started, to take the frame's share
+    uint64_t frame_start[3];
+};
+
+bool stats_enable(struct chip8 *chip8);
+void stats_disable(struct chip8 *chip8);
+void stats_reset(struct chip8_stats *stats);
+void stats_end_frame(struct chip8_stats *stats);
+bool stats_write_json(const struct chip8_stats *stats, FILE *file);
+bool stats_dump(const struct chip8_stats *stats, const char *path);
+
+// count an instruction about to run, from the interpreter's dispatch
+static inline void stats_count(struct chip8_stats *stats, uint16_t pc, uint8_t kind)
+{
+    stats->opcodes[kind] += 1;
+    stats->pc[pc] += 1;
+}
+
+#endif
@@ -0,0 +1,42 @@
+#define _POSIX_C_SOURCE 200809L
+
+#include "capture.h"
+#include <stdio.h>
+
+#define USAGE "Usage: chip8-y4m capture [output]"
+
+// convert a native capture from chip8-headless -c to Y4M, written to
+// standard output unless a file is given
+int main(int argc, char *argv[])
+{
+    if (argc < 2 || argc > 3) {
+        puts(USAGE);
+        return 0;
+    }
+
+    FILE *in = fopen(argv[1], "rb");
+
+    if (in == NULL) {
+        fprintf(stderr, "Could not open capture: %s\n", argv[1]);
+        return -1;
+    }
+
+    FILE *out = argc == 3 ? fopen(argv[2], "wb") : stdout;
+
+    if (out == NULL) {
+        fprintf(stderr, "Could not open output: %s\n", argv[2]);
+        fclose(in);
+        return -1;
+    }
+
+    bool converted = capture_to_y4m(in, out);
+
+    fclose(in);
+
+    if ((out != stdout && fclose(out) != 0) || !converted) {
+        fprintf(stderr, "Could not convert capture: %s\n", argv[1]);
+        return -1;
+    }
+
+    return 0;
+}